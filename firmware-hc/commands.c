@@ -42,6 +42,7 @@ static int g_uninitialized_wiped = 0;
 static int g_mmc_tx_cplt = 0;
 static int g_mmc_tx_dma_cplt = 0;
 static int g_mmc_rx_cplt = 0;
+static volatile int g_cmd_packet_sent = 0;
 
 #if ENABLE_MMC_STANDBY
 volatile int g_emmc_idle_ms = -1;
@@ -59,12 +60,20 @@ static int s_subsystem_release_requested = 1;
 // Incoming buffer for next command request
 u8 cmd_packet_buf[CMD_PACKET_BUF_SIZE] __attribute__((aligned(16)));
 
+//Set while the current command still reads data from 'cmd_packet_buf'. The next
+//request isn't received until cmd_packet_release() is called
+static int cmd_packet_held = 0;
+static int cmd_packet_held_by_command = 0;
+
 //Paramaters and temporary state for the command currently being
 //executed
 union cmd_data_u cmd_data;
 
 u8 g_encrypt_key[AES_256_KEY_SIZE] __attribute__((aligned(16)));
 
+//Key schedules for 'g_encrypt_key'. Set up once per login
+struct signet_aes_256_ctx g_encrypt_ctx;
+
 u8 token_auth_rand_cyphertext[AES_256_KEY_SIZE];
 u8 token_encrypt_key_cyphertext[AES_256_KEY_SIZE];
 
@@ -100,7 +109,19 @@ extern MMC_HandleTypeDef hmmc1;
 
 volatile enum emmc_user g_emmc_user = EMMC_USER_NONE;
 
-int g_emmc_user_ready[EMMC_NUM_USER];
+//Requests queued by each user that haven't started yet
+struct emmc_pending {
+	int count;
+	int head;
+	u32 queued_ms[EMMC_QUEUE_DEPTH];
+};
+
+static struct emmc_pending g_emmc_pending[EMMC_NUM_USER];
+
+struct emmc_queue_stats g_emmc_queue_stats[EMMC_NUM_USER];
+
+//DB requests granted in a row while a storage request was waiting
+static int g_emmc_db_burst = 0;
 
 enum db_action {
 	DB_ACTION_NONE,
@@ -108,13 +129,21 @@ enum db_action {
 	DB_ACTION_WRITE
 };
 
-static enum db_action g_db_action = DB_ACTION_NONE;
+struct db_request {
+	enum db_action action;
+	int idx;
+	u8 *data; //Destination of a read or source of a write
+	int len;
+	void (*complete)(); //Called from the main loop once the transfer has finished
+};
 
-static int g_db_read_idx;
-static u8 *g_db_read_dest;
+//DB requests are started in the order they are queued
+static struct db_request g_db_requests[EMMC_QUEUE_DEPTH];
+static int g_db_request_head = 0;
+static int g_db_request_count = 0;
 
-static int g_db_write_idx;
-static const u8 *g_db_write_src;
+//The DB request that owns the eMMC
+static struct db_request g_db_request;
 
 #include "usbd_msc_scsi.h"
 #include "usbd_msc.h"
@@ -144,34 +173,41 @@ static void subsystem_idle_check()
 	}
 }
 
+//Reads transfer whole sectors so the destination is written up to the end of the last one
+static int db_read_dma_len(int len)
+{
+	return ((len + MSC_MEDIA_PACKET - 1)/MSC_MEDIA_PACKET) * MSC_MEDIA_PACKET;
+}
+
 void emmc_user_db_start()
 {
-	HAL_MMC_CardStateTypeDef cardState;
-	switch (g_db_action) {
+	assert(g_db_request_count);
+	g_db_request = g_db_requests[g_db_request_head];
+	g_db_request_head = (g_db_request_head + 1) % EMMC_QUEUE_DEPTH;
+	g_db_request_count--;
+	int idx = g_db_request.idx;
+	int len = g_db_request.len;
+	switch (g_db_request.action) {
 	case DB_ACTION_READ: {
-		int idx = g_db_read_idx;
-		u8 *dest = g_db_read_dest;
-		do {
-			cardState = HAL_MMC_GetCardState(&hmmc1);
-		} while (cardState != HAL_MMC_CARD_TRANSFER);
+		u8 *dest = g_db_request.data;
+		//Stale lines are discarded before the transfer so they can't be written back over
+		//the data and again when it completes in case they were speculatively refilled
+		assert(dcache_is_dma_safe(dest, db_read_dma_len(len)));
+		dcache_invalidate(dest, db_read_dma_len(len));
 		HAL_MMC_ReadBlocks_DMA(&hmmc1,
 		                       dest,
 				       (idx - MIN_DATA_BLOCK + EMMC_DB_FIRST_BLOCK)*(HC_BLOCK_SZ/EMMC_SUB_BLOCK_SZ),
-		                       BLK_SIZE/MSC_MEDIA_PACKET);
+		                       (len + MSC_MEDIA_PACKET - 1)/MSC_MEDIA_PACKET);
 	}
 	break;
 	case DB_ACTION_WRITE: {
-		int idx = g_db_write_idx;
-		const u8 *src = g_db_write_src;
-		do {
-			cardState = HAL_MMC_GetCardState(&hmmc1);
-		} while (cardState != HAL_MMC_CARD_TRANSFER);
-
+		const u8 *src = g_db_request.data;
+		dcache_clean(src, len);
 		HAL_MMC_WriteBlocks_DMA_Initial(&hmmc1,
 		                                src,
-		                                BLK_SIZE,
+		                                len,
 						(idx - MIN_DATA_BLOCK + EMMC_DB_FIRST_BLOCK)*(HC_BLOCK_SZ/EMMC_SUB_BLOCK_SZ),
-						BLK_SIZE/MSC_MEDIA_PACKET);
+						len/MSC_MEDIA_PACKET);
 	}
 	break;
 	default:
@@ -179,9 +215,22 @@ void emmc_user_db_start()
 	}
 }
 
+static void db_request_queue(enum db_action action, int idx, u8 *data, int len, void (*complete)())
+{
+	assert(g_db_request_count < EMMC_QUEUE_DEPTH);
+	struct db_request *req = g_db_requests + ((g_db_request_head + g_db_request_count) % EMMC_QUEUE_DEPTH);
+	req->action = action;
+	req->idx = idx;
+	req->data = data;
+	req->len = len;
+	req->complete = complete;
+	g_db_request_count++;
+	emmc_user_queue(EMMC_USER_DB);
+}
+
 int command_idle_ready()
 {
-	return g_read_db_tx_complete | g_write_db_tx_complete | g_mmc_tx_cplt | g_mmc_tx_dma_cplt | g_mmc_rx_cplt;
+	return g_read_db_tx_complete | g_write_db_tx_complete | g_mmc_tx_cplt | g_mmc_tx_dma_cplt | g_mmc_rx_cplt | g_cmd_packet_sent;
 }
 
 volatile int g_write_test_tx_complete = 0;
@@ -189,17 +238,35 @@ volatile int g_read_test_tx_complete = 0;
 
 void command_idle()
 {
+#ifdef BOOT_MODE_B
+	if (g_cmd_packet_sent) {
+		g_cmd_packet_sent = 0;
+		END_WORK(CMD_PACKET_SENT_WORK);
+		switch (active_cmd) {
+		case READ_ALL_UIDS:
+			read_all_uids_cmd_complete();
+			break;
+		case READ_ALL_UID_INFO:
+		case READ_UIDS_CHANGED_SINCE:
+			uid_info_cmd_complete();
+			break;
+		}
+	}
+#endif
 	if (g_read_db_tx_complete) {
 		g_read_db_tx_complete = 0;
 		END_WORK(READ_DB_TX_CPLT_WORK);
+		dcache_invalidate(g_db_request.data, db_read_dma_len(g_db_request.len));
+		void (*complete)() = g_db_request.complete;
 		emmc_user_done();
-		read_block_complete();
+		complete();
 	}
 	if (g_write_db_tx_complete) {
 		g_write_db_tx_complete = 0;
 		END_WORK(WRITE_DB_TX_WORK);
+		void (*complete)() = g_db_request.complete;
 		emmc_user_done();
-		write_block_complete();
+		complete();
 	}
 	if (g_mmc_tx_cplt) {
 		g_mmc_tx_cplt = 0;
@@ -268,6 +335,105 @@ static void emmc_user_standby_end()
 }
 #endif
 
+//
+// Picks the next user of the eMMC. DB requests are interactive and are served
+// first but after EMMC_DB_BURST_MAX DB requests in a row a waiting storage
+// request is served so MSC streaming isn't starved during a sync
+//
+static enum emmc_user emmc_user_next()
+{
+	int db = g_emmc_pending[EMMC_USER_DB].count;
+	int storage = g_emmc_pending[EMMC_USER_STORAGE].count;
+	if (db && (!storage || g_emmc_db_burst < EMMC_DB_BURST_MAX)) {
+		if (storage) {
+			g_emmc_db_burst++;
+		}
+		return EMMC_USER_DB;
+	} else if (storage) {
+		g_emmc_db_burst = 0;
+		return EMMC_USER_STORAGE;
+	} else if (g_emmc_pending[EMMC_USER_TEST].count) {
+		return EMMC_USER_TEST;
+	}
+#if ENABLE_MMC_STANDBY
+	else if (g_emmc_pending[EMMC_USER_STANDBY].count) {
+		return EMMC_USER_STANDBY;
+	}
+#endif
+	return EMMC_USER_NONE;
+}
+
+static void emmc_user_dequeue(enum emmc_user user)
+{
+	struct emmc_pending *pending = g_emmc_pending + user;
+	struct emmc_queue_stats *stats = g_emmc_queue_stats + user;
+	u32 wait_ms = HAL_GetTick() - pending->queued_ms[pending->head];
+	pending->head = (pending->head + 1) % EMMC_QUEUE_DEPTH;
+	pending->count--;
+	stats->wait_ms_total += wait_ms;
+	if (wait_ms > stats->wait_ms_max) {
+		stats->wait_ms_max = wait_ms;
+	}
+}
+
+//
+// Transfers can only start once the card is back in the transfer state. After a
+// write the card stays busy while it programs so instead of spinning on CMD13 the
+// owner waits with MMC_READY_WORK set and emmc_idle() polls the card from the
+// main loop once per millisecond. MMC_READY_WORK is part of TICK_WORK so the main
+// loop sleeps between polls
+//
+static int g_emmc_card_waiting = 0;
+static u32 g_emmc_card_wait_ms;
+static u32 g_emmc_card_poll_ms;
+
+static void emmc_user_start()
+{
+	switch (g_emmc_user) {
+	case EMMC_USER_DB:
+		emmc_user_db_start();
+		break;
+	case EMMC_USER_STORAGE:
+		emmc_user_storage_start();
+		break;
+	default:
+		break;
+	}
+}
+
+static void emmc_user_start_when_ready()
+{
+	if (HAL_MMC_GetCardState(&hmmc1) == HAL_MMC_CARD_TRANSFER) {
+		emmc_user_start();
+	} else {
+		g_emmc_card_wait_ms = HAL_GetTick();
+		g_emmc_card_poll_ms = g_emmc_card_wait_ms;
+		g_emmc_card_waiting = 1;
+		g_emmc_queue_stats[g_emmc_user].card_waits++;
+		BEGIN_WORK(MMC_READY_WORK);
+	}
+}
+
+void emmc_idle()
+{
+	if (!g_emmc_card_waiting || HAL_GetTick() == g_emmc_card_poll_ms) {
+		return;
+	}
+	g_emmc_card_poll_ms = HAL_GetTick();
+	if (HAL_MMC_GetCardState(&hmmc1) != HAL_MMC_CARD_TRANSFER) {
+		return;
+	}
+	g_emmc_card_waiting = 0;
+	END_WORK(MMC_READY_WORK);
+	struct emmc_queue_stats *stats = g_emmc_queue_stats + g_emmc_user;
+	u32 wait_ms = HAL_GetTick() - g_emmc_card_wait_ms;
+	stats->card_wait_ms_total += wait_ms;
+	if (wait_ms > stats->card_wait_ms_max) {
+		stats->card_wait_ms_max = wait_ms;
+	}
+	emmc_user_start();
+}
+
 static void emmc_user_schedule()
 {
 #if ENABLE_MMC_STANDBY
@@ -277,30 +443,33 @@ static void emmc_user_schedule()
 		return;
 	}
 #endif
+	enum emmc_user next = EMMC_USER_NONE;
+	//Storage requests can be queued from the USB interrupt
+	__disable_irq();
 	if (g_emmc_user == EMMC_USER_NONE) {
 #if ENABLE_MMC_STANDBY
 		g_emmc_idle_ms = HAL_GetTick();
 		BEGIN_WORK(MMC_IDLE_WORK);
 #endif
-		if (g_emmc_user_ready[EMMC_USER_DB]) {
-			g_emmc_user = EMMC_USER_DB;
-			g_emmc_user_ready[g_emmc_user] = 0;
-			emmc_user_db_start();
-		} else if (g_emmc_user_ready[EMMC_USER_STORAGE]) {
-			g_emmc_user = EMMC_USER_STORAGE;
-			g_emmc_user_ready[g_emmc_user] = 0;
-			emmc_user_storage_start();
-		} else if (g_emmc_user_ready[EMMC_USER_TEST]) {
-			g_emmc_user = EMMC_USER_TEST;
-			g_emmc_user_ready[g_emmc_user] = 0;
+		next = emmc_user_next();
+		if (next != EMMC_USER_NONE) {
+			g_emmc_user = next;
+			emmc_user_dequeue(next);
 		}
+	}
+	__enable_irq();
+	switch (next) {
+	case EMMC_USER_DB:
+	case EMMC_USER_STORAGE:
+		emmc_user_start_when_ready();
+		break;
 #if ENABLE_MMC_STANDBY
-		else if (g_emmc_user_ready[EMMC_USER_STANDBY]) {
-			g_emmc_user = EMMC_USER_STANDBY;
-			g_emmc_user_ready[EMMC_USER_STANDBY] = 0;
-			emmc_user_standby_start();
-		}
+	case EMMC_USER_STANDBY:
+		emmc_user_standby_start();
+		break;
 #endif
+	default:
+		break;
 	}
 }
 
@@ -312,39 +481,143 @@ void emmc_user_done()
 
 void emmc_user_queue(enum emmc_user user)
 {
-	assert(!g_emmc_user_ready[user]);
-	g_emmc_user_ready[user] = 1;
+	struct emmc_pending *pending = g_emmc_pending + user;
+	struct emmc_queue_stats *stats = g_emmc_queue_stats + user;
+	__disable_irq();
+	assert(pending->count < EMMC_QUEUE_DEPTH);
+	pending->queued_ms[(pending->head + pending->count) % EMMC_QUEUE_DEPTH] = HAL_GetTick();
+	pending->count++;
+	stats->requests++;
+	if (pending->count > stats->max_depth) {
+		stats->max_depth = pending->count;
+	}
+	__enable_irq();
 	emmc_user_schedule();
 }
 
-void read_data_block (int idx, u8 *dest)
+//Returns the number of transfers 'user' has queued that haven't started yet
+int emmc_user_queued(enum emmc_user user)
+{
+	return g_emmc_pending[user].count;
+}
+
+#ifdef BOOT_MODE_B
+
+//
+// The CRYP peripheral is shared by the encrypted storage volumes and the database.
+// Users queue for it like the eMMC and own it until they call cryp_user_done()
+//
+volatile enum cryp_user g_cryp_user = CRYP_USER_NONE;
+
+static volatile int g_cryp_user_ready[CRYP_NUM_USER];
+
+void cryp_user_storage_start();
+void cryp_user_db_start();
+
+static void cryp_user_schedule()
+{
+	enum cryp_user next = CRYP_USER_NONE;
+	//Storage buffers are queued from the USB interrupt
+	__disable_irq();
+	if (g_cryp_user == CRYP_USER_NONE) {
+		if (g_cryp_user_ready[CRYP_USER_DB]) {
+			next = CRYP_USER_DB;
+		} else if (g_cryp_user_ready[CRYP_USER_STORAGE]) {
+			next = CRYP_USER_STORAGE;
+		}
+		if (next != CRYP_USER_NONE) {
+			g_cryp_user = next;
+			g_cryp_user_ready[next] = 0;
+		}
+	}
+	__enable_irq();
+	switch (next) {
+	case CRYP_USER_DB:
+		cryp_user_db_start();
+		break;
+	case CRYP_USER_STORAGE:
+		cryp_user_storage_start();
+		break;
+	default:
+		break;
+	}
+}
+
+void cryp_user_done()
+{
+	g_cryp_user = CRYP_USER_NONE;
+	cryp_user_schedule();
+}
+
+void cryp_user_queue(enum cryp_user user)
+{
+	assert(!g_cryp_user_ready[user]);
+	g_cryp_user_ready[user] = 1;
+	cryp_user_schedule();
+}
+
+void HAL_CRYP_OutCpltCallback(CRYP_HandleTypeDef *hcryp)
+{
+	switch (g_cryp_user) {
+	case CRYP_USER_STORAGE:
+		usbd_scsi_cryp_complete();
+		break;
+	case CRYP_USER_DB:
+		db_cryp_complete();
+		break;
+	default:
+		assert(0);
+	}
+}
+
+#endif
+
+//Reads the first 'len' bytes of a block. 'len' is rounded up to a whole number of eMMC sectors
+void read_data_block_part (int idx, u8 *dest, int len)
 {
 	if (idx == ROOT_DATA_BLOCK) {
-		memcpy(dest, (u8 *)_root_page, BLK_SIZE);
+		memcpy(dest, (u8 *)_root_page, len);
 		read_block_complete();
 	} else {
-		g_db_action = DB_ACTION_READ;
-		g_db_read_idx = idx;
-		g_db_read_dest = dest;
-		emmc_user_queue(EMMC_USER_DB);
+		db_request_queue(DB_ACTION_READ, idx, dest, len, read_block_complete);
 	}
 }
 
-void write_data_block (int idx, const u8 *src)
+void read_data_block (int idx, u8 *dest)
+{
+	read_data_block_part(idx, dest, BLK_SIZE);
+}
+
+static void db_write_complete()
 {
 #ifdef BOOT_MODE_B
-	invalidate_data_block_cache(idx);
+	if (db_index_write_complete())
+		return;
 #endif
+	write_block_complete();
+}
+
+//Writes the first 'len' bytes of a block. 'len' must be a whole number of eMMC sectors
+void write_data_block_part (int idx, const u8 *src, int len)
+{
 	if (idx == ROOT_DATA_BLOCK) {
-		write_root_block(src, BLK_SIZE);
+		write_root_block(src, len);
 	} else {
-		g_db_action = DB_ACTION_WRITE;
-		g_db_write_idx = idx;
-		g_db_write_src = src;
-		emmc_user_queue(EMMC_USER_DB);
+		db_request_queue(DB_ACTION_WRITE, idx, (u8 *)src, len, db_write_complete);
 	}
 }
 
+void write_data_block (int idx, const u8 *src)
+{
+#ifdef BOOT_MODE_B
+	if (db_index_write_data_block(idx, src)) {
+		return;
+	}
+	update_data_block_cache(idx, src);
+#endif
+	write_data_block_part(idx, src, BLK_SIZE);
+}
+
 void HAL_MMC_RxCpltCallback(MMC_HandleTypeDef *hmmc1)
 {
 	g_mmc_rx_cplt = 1;
@@ -406,6 +679,27 @@ void sync_root_block_immediate()
 	write_root_block((const u8 *)&root_page, sizeof(root_page));
 }
 
+static const u8 *root_block_write_src;
+static int root_block_write_sz;
+
+static void write_root_block_crc_complete(u32 crc)
+{
+	struct hc_device_data *d = (struct hc_device_data *)root_block_write_src;
+	d->crc = crc;
+	if (_root_page == &_crypt_data1) {
+		_root_page = &_crypt_data2;
+	} else if (_root_page == &_crypt_data2) {
+		_root_page = &_crypt_data1;
+	} else {
+		_root_page = &_crypt_data1;
+	}
+	flash_write_page((u8 *)_root_page, root_block_write_src, root_block_write_sz);
+}
+
+//
+// Writes the root block. The CRC is computed with the DMA and the flash is
+// reserved until it completes. Completion is signalled by flash_write_complete()
+//
 void write_root_block(const u8 *data, int sz)
 {
 	struct hc_device_data *d = (struct hc_device_data *)data;
@@ -415,15 +709,28 @@ void write_root_block(const u8 *data, int sz)
 	} else {
 		d->data_iteration = 0;
 	}
-	d->crc = compute_device_data_crc(d);
-	if (_root_page == &_crypt_data1) {
-		_root_page = &_crypt_data2;
-	} else if (_root_page == &_crypt_data2) {
-		_root_page = &_crypt_data1;
-	} else {
-		_root_page = &_crypt_data1;
+	root_block_write_src = data;
+	root_block_write_sz = sz;
+	flash_reserve();
+	if (!crc_32_dma_start(((u8 *)d) + 4, sizeof(struct hc_device_data) - 4, CRC_USER_ROOT_BLOCK)) {
+		write_root_block_crc_complete(compute_device_data_crc(d));
+	}
+}
+
+void crc_32_dma_complete(enum crc_user user, u32 crc)
+{
+	switch (user) {
+	case CRC_USER_ROOT_BLOCK:
+		write_root_block_crc_complete(crc);
+		break;
+#ifdef BOOT_MODE_B
+	case CRC_USER_DB_INDEX:
+		db_index_crc_complete(crc);
+		break;
+#endif
+	default:
+		break;
 	}
-	flash_write_page((u8 *)_root_page, data, sz);
 }
 
 void get_progress_check();
@@ -536,11 +843,16 @@ void finish_command_multi (enum command_responses resp, int messages_remaining,
 	if (payload) {
 		memcpy(cmd_resp + CMD_PACKET_HEADER_SIZE, payload, payload_len);
 	}
+	cmd_packet_release();
 	if (!messages_remaining && !cmd_messages_remaining) {
 		active_cmd = -1;
 	}
 	cmd_packet_send(cmd_resp, full_length);
 	subsystem_idle_check();
+#ifdef BOOT_MODE_B
+	//Checkpoints and group commit write backs wait for commands to finish
+	BEGIN_WORK(DB_INDEX_SYNC_WORK);
+#endif
 }
 
 void finish_command (enum command_responses resp, const u8 *payload, int payload_len)
@@ -802,7 +1114,12 @@ void cmd_packet_sent()
 #ifdef BOOT_MODE_B
 	switch(active_cmd) {
 	case READ_ALL_UIDS:
-		read_all_uids_cmd_complete();
+	case READ_ALL_UID_INFO:
+	case READ_UIDS_CHANGED_SINCE:
+		//Called from the USB interrupt. Continue from the main loop so that sending the
+		//next message can't race with the block cache and the reads that are in flight
+		g_cmd_packet_sent = 1;
+		BEGIN_WORK(CMD_PACKET_SENT_WORK);
 		break;
 	}
 #endif
@@ -889,11 +1206,19 @@ void button_release()
 int attempt_login_256 (const u8 *auth_key, const u8 *auth_rand, const u8 *auth_rand_cyphertext, const u8 *encrypt_key_cyphertext, u8 *encrypt_key)
 {
 	u8 auth_rand_cyphertext_test[AUTH_RANDOM_DATA_LEN];
-	signet_aes_256_encrypt_cbc(auth_key, AUTH_RANDOM_DATA_LEN/AES_BLK_SIZE, NULL, auth_rand, auth_rand_cyphertext_test);
+	struct signet_aes_256_ctx ctx;
+	signet_aes_256_ctx_init(&ctx, auth_key);
+	signet_aes_256_ctx_encrypt_cbc(&ctx, AUTH_RANDOM_DATA_LEN/AES_BLK_SIZE, NULL, auth_rand, auth_rand_cyphertext_test);
 	if (memcmp(auth_rand_cyphertext_test, auth_rand_cyphertext, AUTH_RANDOM_DATA_LEN)) {
+		signet_aes_256_ctx_clear(&ctx);
 		return 0;
 	} else {
-		signet_aes_256_decrypt_cbc(auth_key, HC_KEYSTORE_KEY_SIZE/AES_BLK_SIZE, NULL, encrypt_key_cyphertext, encrypt_key);
+		signet_aes_256_ctx_decrypt_cbc(&ctx, HC_KEYSTORE_KEY_SIZE/AES_BLK_SIZE, NULL, encrypt_key_cyphertext, encrypt_key);
+		signet_aes_256_ctx_clear(&ctx);
+		signet_aes_256_ctx_init(&g_encrypt_ctx, encrypt_key);
+#ifdef BOOT_MODE_B
+		usbd_scsi_set_encrypt_key(encrypt_key);
+#endif
 		return 1;
 	}
 }
@@ -905,10 +1230,13 @@ void login_cmd_iter ()
 			for (int i = 0; i < (AES_256_KEY_SIZE/4); i++) {
 				cmd_data.login.token[i] = rand_get();
 			}
-			signet_aes_256_encrypt_cbc((u8 *)cmd_data.login.token, AES_256_KEY_SIZE/AES_BLK_SIZE, NULL,
-			                           root_page.auth_random_cleartext, token_auth_rand_cyphertext);
-			signet_aes_256_encrypt_cbc((u8 *)cmd_data.login.token, AES_256_KEY_SIZE/AES_BLK_SIZE, NULL,
-			                           g_encrypt_key, token_encrypt_key_cyphertext);
+			struct signet_aes_256_ctx ctx;
+			signet_aes_256_ctx_init(&ctx, (u8 *)cmd_data.login.token);
+			signet_aes_256_ctx_encrypt_cbc(&ctx, AES_256_KEY_SIZE/AES_BLK_SIZE, NULL,
+			                               root_page.auth_random_cleartext, token_auth_rand_cyphertext);
+			signet_aes_256_ctx_encrypt_cbc(&ctx, AES_256_KEY_SIZE/AES_BLK_SIZE, NULL,
+			                               g_encrypt_key, token_encrypt_key_cyphertext);
+			signet_aes_256_ctx_clear(&ctx);
 			finish_command(OKAY, (u8 *)cmd_data.login.gen_token, AES_256_KEY_SIZE);
 			enter_state(DS_LOGGED_IN);
 		}
@@ -1273,6 +1601,9 @@ void cmd_disconnect()
 	end_long_button_press_wait();
 	active_cmd = -1;
 	enter_state(DS_DISCONNECTED);
+#ifdef BOOT_MODE_B
+	db_flush_group_commit();
+#endif
 }
 
 void get_rand_bits_cmd_check()
@@ -1572,12 +1903,12 @@ int logged_in_state(int cmd, u8 *data, int data_len)
 			return 0;
 		}
 		if (active_cmd == UPDATE_UID) {
-			update_uid_cmd(uid, data, data_len, sz, 1 /* short press */);
+			update_uid_cmd(uid, data, data_len, sz, 1 /* short press */, 0);
 		} else {
 			if (!cmd_iter_count) {
-				update_uid_cmd(uid, data, data_len, sz, 2 /* long press */);
+				update_uid_cmd(uid, data, data_len, sz, 2 /* long press */, cmd_messages_remaining);
 			} else {
-				update_uid_cmd(uid, data, data_len, sz, 0 /* no press */);
+				update_uid_cmd(uid, data, data_len, sz, 0 /* no press */, cmd_messages_remaining);
 			}
 		}
 	}
@@ -1591,6 +1922,19 @@ int logged_in_state(int cmd, u8 *data, int data_len)
 		read_all_uids_cmd(masked);
 	}
 	break;
+	case READ_ALL_UID_INFO:
+		read_all_uid_info_cmd();
+		break;
+	case READ_UIDS_CHANGED_SINCE: {
+		if (data_len < 6) {
+			finish_command_resp(INVALID_INPUT);
+			return 0;
+		}
+		int epoch = data[0] + (data[1] << 8);
+		u32 gen = data[2] + (data[3] << 8) + (data[4] << 16) + ((u32)data[5] << 24);
+		read_uids_changed_since_cmd(epoch, gen);
+	}
+	break;
 	case TYPE: {
 		int n_chars = data_len >> 1;
 		if (n_chars * 4 > sizeof(cmd_data.type_data.chars)) {
@@ -1610,6 +1954,10 @@ int logged_in_state(int cmd, u8 *data, int data_len)
 		begin_button_press_wait();
 		break;
 	case LOGOUT:
+		signet_aes_256_ctx_clear(&g_encrypt_ctx);
+#ifdef BOOT_MODE_B
+		usbd_scsi_clear_encrypt_key();
+#endif
 		enter_state(DS_LOGGED_OUT);
 		finish_command_resp(OKAY);
 		break;
@@ -1896,6 +2244,33 @@ void cmd_packet_recv()
 	}
 }
 
+void cmd_packet_hold()
+{
+	cmd_packet_held = 1;
+	cmd_packet_held_by_command = 1;
+}
+
+void cmd_packet_release()
+{
+	if (cmd_packet_held) {
+		cmd_packet_held = 0;
+		USBD_HID_rx_resume(INTERFACE_CMD);
+	}
+}
+
+//Runs the request in 'cmd_packet_buf' again after restart_signet_command() made it wait
+void cmd_packet_restart()
+{
+	if (!restart_signet_command()) {
+		USBD_HID_rx_resume(INTERFACE_CMD);
+	}
+}
+
+//
+// Returns non-zero if the caller must not resume receiving requests. This is the case
+// if the command was deferred or if it held the command packet. A held packet is
+// released with cmd_packet_release()
+//
 static int restart_signet_command()
 {
 	u8 *data = cmd_packet_buf;
@@ -1905,8 +2280,15 @@ static int restart_signet_command()
 	if (!request_device(SIGNET_SUBSYSTEM)) {
 		return 1;
 	}
+	cmd_packet_held_by_command = 0;
 	cmd_messages_remaining = messages_remaining;
 
+#ifdef BOOT_MODE_B
+	if (active_cmd != GET_DEVICE_STATE && db_command_wait(active_cmd == UPDATE_UIDS && cmd_iter_count)) {
+		return 1;
+	}
+#endif
+
 	if (active_cmd == STARTUP) {
 		startup_cmd(data, data_len);
 		return 0;
@@ -1914,7 +2296,13 @@ static int restart_signet_command()
 
 	//Always allow the GET_DEVICE_STATE command. It's easiest to handle it here
 	if (active_cmd == GET_DEVICE_STATE) {
+#ifdef BOOT_MODE_B
+		u8 resp[1 + DEVICE_STATE_DB_CACHE_STATS_SZ];
+		resp[0] = g_device_state;
+		memcpy(resp + 1, &g_db_block_cache_stats, DEVICE_STATE_DB_CACHE_STATS_SZ);
+#else
 		u8 resp[] = {g_device_state};
+#endif
 		finish_command(OKAY, resp, sizeof(resp));
 		return 0;
 	}
@@ -1989,5 +2377,5 @@ static int restart_signet_command()
 		long_button_press();
 	}
 #endif
-	return 0;
+	return cmd_packet_held_by_command;
 }
@@ -3,6 +3,7 @@
 #include "types.h"
 #include "signetdev_common_priv.h"
 #include "db.h"
+#include "dcache.h"
 
 void get_progress_cmd(u8 *data, int data_len);
 
@@ -53,8 +54,7 @@ union cmd_data_u {
 		struct block_info blk_info;
 	} init_data;
 	struct {
-		u8 read_block[BLK_SIZE];
-		u8 block[BLK_SIZE];
+		u8 block[BLK_SIZE] DCACHE_ALIGNED; //Read from the eMMC with DMA
 		u8 resp[STARTUP_RESP_SIZE];
 		struct block_info blk_info;
 	} startup;
@@ -63,7 +63,7 @@ union cmd_data_u {
 		int block_idx;
 	} wipe_data;
 	struct {
-		u8 block[BLK_SIZE];
+		u8 block[BLK_SIZE] DCACHE_ALIGNED; //Read from the eMMC with DMA
 		int block_idx;
 	} read_block;
 	struct {
@@ -101,10 +101,14 @@ union cmd_data_u {
 		int prev_block_num;
 		int press_type;
 		struct block_info blk_info;
-		u8 entry[BLK_SIZE];
+		const u8 *entry; //Points into 'cmd_packet_buf' until the record is encrypted
 		int entry_sz;
-		u8 block[BLK_SIZE];
+		u8 block[BLK_SIZE] DCACHE_ALIGNED; //Records are encrypted into the block with DMA
 		int update_uid_stage;
+		int group_commit;
+		int messages_remaining;
+		enum command_responses resp;
+		int rev;
 	} update_uid;
 	struct {
 		u8 block[NUM_CLEARTEXT_PASS * 64];
@@ -122,15 +126,32 @@ union cmd_data_u {
 		const struct uid_ent *ent;
 		int masked;
 		int waiting_for_button_press;
-		u8 block[BLK_SIZE];
+		int decrypting;
+		u8 block[BLK_SIZE] DCACHE_ALIGNED; //Decrypted in place with DMA
 	} read_uid;
 	struct {
 		u8 iv[AES_BLK_SIZE];
-		int uid;
 		int expected_remaining;
 		int masked;
-		u8 block[BLK_SIZE];
+		int block_num;
+		int next_block_num;
+		int index;
+		int staged; //'block' holds the next message to send
+		enum command_responses staged_resp;
+		int staged_remaining;
+		int staged_len;
+		int sending; //Waiting for the previous message to be sent
+		int done;
+		int decrypting; //The next record is being decrypted into 'block'
+		u8 block[BLK_SIZE] DCACHE_ALIGNED; //Decrypted in place with DMA
 	} read_all_uids;
+	struct {
+		int uid;
+		int len;
+		int all;
+		u32 since_gen;
+		u8 block[BLK_SIZE];
+	} uid_info;
 	struct {
 		u16 sz;
 		u8 block[BLK_SIZE];
@@ -142,7 +163,7 @@ union cmd_data_u {
 	struct {
 		int idx;
 	} read_cleartext_password;
-} __attribute__((aligned(16)));
+} DCACHE_ALIGNED;
 
 extern union cmd_data_u cmd_data;
 void sync_root_block_immediate();
@@ -154,13 +175,18 @@ void cmd_packet_send(const u8 *data, u16 len);
 void cmd_event_send(int event_num, const u8 *data, int data_len);
 
 extern u8 cmd_packet_buf[];
+void cmd_packet_hold();
+void cmd_packet_release();
+void cmd_packet_restart();
 
 void enter_state(enum device_state state);
 void enter_progressing_state(enum device_state state, int _n_progress_components, int *_progress_maximums);
 
 void cmd_rand_update();
 void write_data_block(int pg, const u8 *src);
+void write_data_block_part(int pg, const u8 *src, int len);
 void read_data_block(int pg, u8 *dest);
+void read_data_block_part(int pg, u8 *dest, int len);
 void sync_root_block();
 int sync_root_block_writing();
 int sync_root_block_pending();
@@ -193,14 +219,52 @@ enum emmc_user {
 	EMMC_NUM_USER
 };
 
+//Number of requests each eMMC user can have waiting
+#ifndef EMMC_QUEUE_DEPTH
+#define EMMC_QUEUE_DEPTH (4)
+#endif
+
+//DB requests served in a row before a waiting storage request goes next
+#ifndef EMMC_DB_BURST_MAX
+#define EMMC_DB_BURST_MAX (4)
+#endif
+
 void emmc_user_queue(enum emmc_user user);
+int emmc_user_queued(enum emmc_user user);
 void emmc_user_done();
+void emmc_idle();
+
+struct emmc_queue_stats {
+	u32 requests;
+	u32 max_depth; //Most requests waiting at once
+	u32 wait_ms_total; //Time spent waiting for the eMMC
+	u32 wait_ms_max;
+	u32 card_waits; //Transfers that had to wait for the card to finish programming
+	u32 card_wait_ms_total;
+	u32 card_wait_ms_max;
+};
+
+extern struct emmc_queue_stats g_emmc_queue_stats[EMMC_NUM_USER];
 
 extern volatile enum emmc_user g_emmc_user;
 
+enum cryp_user {
+	CRYP_USER_NONE,
+	CRYP_USER_STORAGE,
+	CRYP_USER_DB,
+	CRYP_NUM_USER
+};
+
+void cryp_user_queue(enum cryp_user user);
+void cryp_user_done();
+
+extern volatile enum cryp_user g_cryp_user;
+
 //TODO: Use functions to update progress
 extern int g_progress_level[];
 extern u8 g_encrypt_key[];
+struct signet_aes_256_ctx;
+extern struct signet_aes_256_ctx g_encrypt_ctx;
 void command_idle();
 int command_idle_ready();
 
@@ -3,6 +3,8 @@
 #include "stm32f7xx.h"
 
 #include "types.h"
+#include "main.h"
+#include "dcache.h"
 
 static CRC_HandleTypeDef hcrc = {
     .Instance = CRC,
@@ -14,18 +16,159 @@ static CRC_HandleTypeDef hcrc = {
     .InputDataFormat = CRC_INPUTDATA_FORMAT_BYTES,
 };
 
+//
+// CRC combination
+//
+// The CRC of two concatenated buffers can be computed from the CRC of each buffer
+// and the length of the second one. This lets CRCs of unmodified regions be reused.
+// Polynomials are stored bit reflected like the CRC itself
+//
+#define CRC_32_POLY (0xedb88320)
+
+//x^(2^n) mod p for n = 0..31
+static u32 crc_x2n_table[32];
+
+//Returns a * b mod p
+static u32 crc_multmodp(u32 a, u32 b)
+{
+	u32 m = (u32)1 << 31;
+	u32 p = 0;
+	while (1) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0) {
+				break;
+			}
+		}
+		m >>= 1;
+		b = (b & 1) ? ((b >> 1) ^ CRC_32_POLY) : (b >> 1);
+	}
+	return p;
+}
+
+//
+// DMA CRC
+//
+// crc_32_dma_start() feeds a buffer to the CRC unit with a memory to memory
+// DMA transfer so the main loop isn't stalled by large CRCs. The result is
+// passed to crc_32_dma_complete() from crc_idle(). Only one transfer can be
+// in progress and crc_32() waits for it to finish since it shares the CRC unit
+//
+static DMA_HandleTypeDef hdma_crc;
+static volatile int crc_dma_busy = 0; //DMA transfer in progress
+static volatile int crc_dma_cplt = 0; //Result waiting for crc_idle()
+static volatile u32 crc_dma_result;
+static enum crc_user crc_dma_user;
+
+__weak void crc_32_dma_complete(enum crc_user user, u32 crc)
+{
+}
+
+static void crc_dma_xfer_cplt(DMA_HandleTypeDef *hdma)
+{
+	crc_dma_result = ~hcrc.Instance->DR;
+	crc_dma_busy = 0;
+	crc_dma_cplt = 1;
+	BEGIN_WORK(CRC_WORK);
+}
+
+void DMA2_Stream0_IRQHandler(void)
+{
+	HAL_DMA_IRQHandler(&hdma_crc);
+}
+
+static void crc_dma_wait()
+{
+	while (crc_dma_busy);
+}
+
+int crc_32_dma_start(const u8 *din, int count, enum crc_user user)
+{
+	if (crc_dma_busy || crc_dma_cplt || count <= 0) {
+		return 0;
+	}
+	crc_dma_busy = 1;
+	crc_dma_user = user;
+	dcache_clean(din, count);
+	__HAL_CRC_DR_RESET(&hcrc);
+	HAL_DMA_Start_IT(&hdma_crc, (u32)din, (u32)&hcrc.Instance->DR, count);
+	return 1;
+}
+
+void crc_idle()
+{
+	if (crc_dma_cplt) {
+		crc_dma_cplt = 0;
+		END_WORK(CRC_WORK);
+		crc_32_dma_complete(crc_dma_user, crc_dma_result);
+	}
+}
+
 void crc_init()
 {
 	HAL_CRC_Init(&hcrc);
+
+	hdma_crc.Instance = DMA2_Stream0;
+	hdma_crc.Init.Channel = DMA_CHANNEL_0;
+	hdma_crc.Init.Direction = DMA_MEMORY_TO_MEMORY;
+	hdma_crc.Init.PeriphInc = DMA_PINC_ENABLE;
+	hdma_crc.Init.MemInc = DMA_MINC_DISABLE;
+	hdma_crc.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+	hdma_crc.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+	hdma_crc.Init.Mode = DMA_NORMAL;
+	hdma_crc.Init.Priority = DMA_PRIORITY_LOW;
+	hdma_crc.Init.FIFOMode = DMA_FIFOMODE_ENABLE;
+	hdma_crc.Init.FIFOThreshold = DMA_FIFO_THRESHOLD_FULL;
+	hdma_crc.Init.MemBurst = DMA_MBURST_SINGLE;
+	hdma_crc.Init.PeriphBurst = DMA_PBURST_SINGLE;
+	if (HAL_DMA_Init(&hdma_crc) != HAL_OK) {
+		Error_Handler();
+	}
+	hdma_crc.XferCpltCallback = crc_dma_xfer_cplt;
+	HAL_NVIC_SetPriority(DMA2_Stream0_IRQn, LOW_INT_PRIORITY, 0);
+	HAL_NVIC_EnableIRQ(DMA2_Stream0_IRQn);
+
+	u32 p = (u32)1 << 30; //x^1
+	crc_x2n_table[0] = p;
+	for (int n = 1; n < 32; n++) {
+		p = crc_multmodp(p, p);
+		crc_x2n_table[n] = p;
+	}
+}
+
+u32 crc_32_shift_op(int len)
+{
+	u32 p = (u32)1 << 31; //x^0
+	int k = 3; //8 bits per byte
+	while (len) {
+		if (len & 1) {
+			p = crc_multmodp(crc_x2n_table[k & 31], p);
+		}
+		len >>= 1;
+		k++;
+	}
+	return p;
+}
+
+u32 crc_32_combine_op(u32 op, u32 crc1, u32 crc2)
+{
+	return crc_multmodp(op, crc1) ^ crc2;
+}
+
+u32 crc_32_combine(u32 crc1, u32 crc2, int len2)
+{
+	return crc_32_combine_op(crc_32_shift_op(len2), crc1, crc2);
 }
 
 u32 crc_32(const u8 *din, int count)
 {
+	crc_dma_wait();
 	u32 crc = HAL_CRC_Calculate(&hcrc, (uint32_t *)din, count);
 	return ~crc;
 }
 
 u32 crc_32_cont(const u8 *din, int count)
 {
+	crc_dma_wait();
 	return ~HAL_CRC_Accumulate(&hcrc, (uint32_t *)din, count);
 }
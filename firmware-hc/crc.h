@@ -4,8 +4,27 @@
 #include "signetdev_common.h"
 
 void crc_init();
+void crc_idle();
+
+enum crc_user {
+	CRC_USER_ROOT_BLOCK,
+	CRC_USER_DB_INDEX
+};
+
+//Starts a CRC with the DMA. Returns zero if a DMA CRC is already in progress
+int crc_32_dma_start(const u8 *din, int count, enum crc_user user);
+
+//Called from crc_idle() with the result of crc_32_dma_start()
+void crc_32_dma_complete(enum crc_user user, u32 crc);
 
 u32 crc_32(const u8 *din, int count);
 u32 crc_32_cont(const u8 *din, int count);
 
+//Returns the CRC of the concatenation of two buffers with CRCs 'crc1' and 'crc2'
+u32 crc_32_combine(u32 crc1, u32 crc2, int len2);
+
+//Precomputes the 'len2' dependent part of crc_32_combine() for crc_32_combine_op()
+u32 crc_32_shift_op(int len2);
+u32 crc_32_combine_op(u32 op, u32 crc1, u32 crc2);
+
 #endif
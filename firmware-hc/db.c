@@ -8,6 +8,8 @@
 #include "commands.h"
 #include "signet_aes.h"
 #include "main.h"
+#include "memory_layout.h"
+#include "dcache.h"
 
 #ifdef BOOT_MODE_B
 
@@ -20,30 +22,81 @@ enum update_uid_status {
 
 #define MAX_PART_SIZE ((BLK_SIZE - sizeof(struct block) - sizeof(struct uid_ent))/SUB_BLK_SIZE)
 
-static u8 block_read_cache[BLK_SIZE];
-static u16 block_read_cache_idx = -1;
+//Number of decoded data blocks kept in RAM. Each entry costs BLK_SIZE bytes
+#ifndef DB_BLOCK_CACHE_ENTRIES
+#define DB_BLOCK_CACHE_ENTRIES (2)
+#endif
+
+struct block_cache_ent {
+	u8 data[BLK_SIZE];
+	u16 idx;
+	u8 dirty; //Modified by a group commit and not yet written back
+	u32 last_used;
+} DCACHE_ALIGNED;
+
+static struct block_cache_ent block_read_cache[DB_BLOCK_CACHE_ENTRIES];
+static u32 block_read_cache_tick = 0;
 static int block_read_cache_updating = 0;
+static struct block_cache_ent *block_read_cache_loading = NULL;
+static int block_read_cache_flushing = 0;
+static int block_cache_background_flush = 0; //The write back in progress was started by db_index_idle()
+static int block_cache_cmd_waiting = 0; //A command waits in db_command_wait() for dirty blocks to be written back
+static int block_cache_flush_requested = 0; //Write back dirty blocks without waiting for DB_GROUP_COMMIT_FLUSH_MS
+static int block_cache_dirty_ms = 0; //When a block was last staged by a group commit
+
+struct db_block_cache_stats g_db_block_cache_stats;
+
+int db3_startup_scan_running = 0;
 
 static void update_uid_cmd_iter();
+static void update_uid_cmd_deallocate_prev();
 static void read_uid_cmd_iter();
 static void db3_startup_scan_resume();
+static void db3_startup_scan_finish();
+static void db3_startup_scan_replay(int mark_changed);
+static void block_lazy_crc_check(int idx, const struct block *blk);
+static void update_uid_cmd_resume();
+static int update_uid_cmd_waiting();
+static void block_cache_flush(struct block_cache_ent *ent);
+static void uid_meta_load(int blk_num, const struct block *blk);
+
+//Resumes the active command once a block it was waiting on has been loaded into the cache
+static int db3_cache_resume()
+{
+	if (db3_startup_scan_running) {
+		db3_startup_scan_resume();
+		return 1;
+	}
+	switch(active_cmd) {
+	case UPDATE_UID:
+	case UPDATE_UIDS:
+		update_uid_cmd_resume();
+		return 1;
+	case READ_UID:
+		read_uid_cmd_iter();
+		return 1;
+	case READ_ALL_UIDS:
+		read_all_uids_cmd_iter();
+		return 1;
+	case READ_ALL_UID_INFO:
+	case READ_UIDS_CHANGED_SINCE:
+		uid_info_cmd_iter();
+		return 1;
+	}
+	return 0;
+}
 
 int db3_read_block_complete()
 {
 	if (block_read_cache_updating) {
 		block_read_cache_updating = 0;
-		switch(active_cmd) {
-		case UPDATE_UID:
-		case UPDATE_UIDS:
-			update_uid_cmd_iter();
-			return 1;
-		case READ_UID:
-			read_uid_cmd_iter();
-			return 1;
-		case READ_ALL_UIDS:
-			read_all_uids_cmd_iter();
-			return 1;
+		block_lazy_crc_check(block_read_cache_loading->idx, (const struct block *)block_read_cache_loading->data);
+		uid_meta_load(block_read_cache_loading->idx, (const struct block *)block_read_cache_loading->data);
+		if (!db3_cache_resume()) {
+			//A prefetch finished after its command. Write backs may have been waiting for it
+			BEGIN_WORK(DB_INDEX_SYNC_WORK);
 		}
+		return 1;
 	}
 	switch (g_device_state) {
 	case DS_INITIALIZING:
@@ -64,6 +117,21 @@ int db3_read_block_complete()
 
 int db3_write_block_complete()
 {
+	if (block_read_cache_flushing) {
+		block_read_cache_flushing = 0;
+		if (block_cache_cmd_waiting) {
+			//The command checks for more dirty blocks when it is restarted
+			block_cache_cmd_waiting = 0;
+			block_cache_background_flush = 0;
+			cmd_packet_restart();
+		} else if (block_cache_background_flush) {
+			block_cache_background_flush = 0;
+			BEGIN_WORK(DB_INDEX_SYNC_WORK);
+		} else {
+			db3_cache_resume();
+		}
+		return 1;
+	}
 	switch (active_cmd) {
 	case UPDATE_UIDS:
 	case UPDATE_UID:
@@ -75,35 +143,236 @@ int db3_write_block_complete()
 	return 0;
 }
 
+static void touch_cache_ent(struct block_cache_ent *ent)
+{
+	ent->last_used = ++block_read_cache_tick;
+}
+
+static struct block_cache_ent *lookup_cache_ent(int idx)
+{
+	for (int i = 0; i < DB_BLOCK_CACHE_ENTRIES; i++) {
+		if (block_read_cache[i].idx == idx) {
+			return block_read_cache + i;
+		}
+	}
+	return NULL;
+}
+
+//Returns the least recently used cache entry, preferring empty entries
+static struct block_cache_ent *victim_cache_ent()
+{
+	struct block_cache_ent *victim = block_read_cache;
+	for (int i = 0; i < DB_BLOCK_CACHE_ENTRIES; i++) {
+		struct block_cache_ent *ent = block_read_cache + i;
+		if (ent->idx == INVALID_BLOCK) {
+			return ent;
+		}
+		if (ent->last_used < victim->last_used) {
+			victim = ent;
+		}
+	}
+	return victim;
+}
+
+void invalidate_data_block_cache(int idx)
+{
+	struct block_cache_ent *ent = lookup_cache_ent(idx);
+	if (ent) {
+		ent->idx = INVALID_BLOCK;
+		ent->dirty = 0;
+		ent->last_used = 0;
+	}
+}
+
 //
-// HC_TODO: Should evaluate if there are any performance
-// reasons to update the cache instead of only providing
-// a way to invalidate it
+// Called for every block write so the cache never needs to be
+// invalidated. Written blocks are also inserted into the cache
+// since they are likely to be read again during a sync session
 //
-void invalidate_data_block_cache(int idx)
+void update_data_block_cache(int idx, const u8 *data)
 {
-	if (idx == block_read_cache_idx) {
-		block_read_cache_idx = -1;
+	if (idx < MIN_DATA_BLOCK || idx > MAX_DATA_BLOCK) {
+		return;
+	}
+	struct block_cache_ent *ent = lookup_cache_ent(idx);
+	if (!ent) {
+		if (block_read_cache_updating) {
+			//A read is in flight into the victim entry
+			return;
+		}
+		ent = victim_cache_ent();
+		if (ent->dirty) {
+			return;
+		}
+		ent->idx = idx;
+	}
+	if (ent->data != data) {
+		memcpy(ent->data, data, BLK_SIZE);
 	}
+	ent->dirty = 0;
+	touch_cache_ent(ent);
+	g_db_block_cache_stats.writes++;
 }
 
+static void load_cache_ent(struct block_cache_ent *ent, int idx)
+{
+	ent->idx = idx;
+	touch_cache_ent(ent);
+	g_db_block_cache_stats.misses++;
+	block_read_cache_updating = 1;
+	block_read_cache_loading = ent;
+	read_data_block(idx, ent->data);
+}
+
+//
+// Returns the contents of block 'idx' or NULL if it has to be loaded first. The
+// active command is resumed once the block has been loaded. Blocks are also not
+// returned while another block is being loaded or written back
+//
 static const u8 *get_cached_data_block(int idx)
 {
-	if (block_read_cache_idx == idx) {
-		return block_read_cache;
+	struct block_cache_ent *ent = lookup_cache_ent(idx);
+	if (ent) {
+		if (block_read_cache_updating && ent == block_read_cache_loading) {
+			return NULL;
+		}
+		touch_cache_ent(ent);
+		g_db_block_cache_stats.hits++;
+		return ent->data;
 	} else {
-		block_read_cache_idx = idx;
-		block_read_cache_updating = 1;
-		read_data_block(idx, block_read_cache);
+		if (block_read_cache_updating || block_read_cache_flushing) {
+			return NULL;
+		}
+		ent = victim_cache_ent();
+		if (ent->dirty) {
+			block_cache_flush(ent);
+			return NULL;
+		}
+		load_cache_ent(ent, idx);
 		return NULL;
 	}
 }
 
-extern u8 g_encrypt_key[AES_256_KEY_SIZE];
+//Starts loading block 'idx' into the cache ahead of when it is needed
+static void prefetch_data_block(int idx)
+{
+	if (idx == INVALID_BLOCK || lookup_cache_ent(idx) ||
+	    block_read_cache_updating || block_read_cache_flushing) {
+		return;
+	}
+	struct block_cache_ent *ent = victim_cache_ent();
+	if (ent->dirty) {
+		return;
+	}
+	load_cache_ent(ent, idx);
+}
 
 struct block_info g_block_info_tbl[MAX_DATA_BLOCK + 1];
 
-static u16 uid_map[MAX_UID + 1]; //0 == invalid, block #
+//
+// DB index checkpoint
+//
+// A copy of 'uid_map' and the per-block state in 'g_block_info_tbl' is
+// kept in DB_INDEX_BLOCK so that startup doesn't need to scan every data
+// block. The checkpoint is only trusted if its CRC is valid. A new
+// checkpoint is written once the database has been idle for
+// DB_INDEX_SYNC_DELAY_MS.
+//
+// Before a data block is first written after a checkpoint its number is
+// appended to the journal in DB_JOURNAL_BLOCK. On startup only the blocks
+// listed in the journal are rescanned, resolving records that a crash left
+// in two blocks. If the journal is full the checkpoint is rewritten with an
+// invalid CRC instead which forces a full scan on the next startup.
+//
+// The checkpoint's generation is anchored by the journal. Every checkpoint write
+// increments the generation and is followed by an empty journal carrying it, and
+// entries are only appended to a journal of the current generation. A checkpoint
+// is only used if the journal on the device has the same generation, so an older
+// checkpoint left behind by a checkpoint write that didn't reach the device is
+// never mistaken for the current one.
+//
+// The change generation of every record is written to DB_GEN_BLOCK before
+// each checkpoint. The journal carries a limit that no generation handed out
+// since the checkpoint exceeds. It is raised by DB_JOURNAL_GEN_RESERVE whenever
+// the journal is written and the journal is rewritten before a data block write
+// once the current generation reaches it. Replaying the journal restores the
+// checkpoint's generations and gives every record in the journaled blocks a
+// generation after the limit, so hosts fetch those records again instead of
+// losing all their generations to a new epoch.
+//
+#define DB_INDEX_MAGIC (0x58444944)
+#define DB_INDEX_SYNC_DELAY_MS (1000)
+#define DB_JOURNAL_MAGIC (0x4c4e524a)
+#define DB_JOURNAL_SZ (EMMC_SUB_BLOCK_SZ)
+#define DB_JOURNAL_GEN_RESERVE (256)
+
+enum db_index_state {
+	DB_INDEX_UNKNOWN, //Checkpoint may be valid on the device
+	DB_INDEX_CLEAN, //Checkpoint is valid. Blocks in the journal may have changed since it was written
+	DB_INDEX_INVALIDATING, //Writing an invalid checkpoint
+	DB_INDEX_JOURNALING, //Writing the journal
+	DB_INDEX_DIRTY, //Checkpoint is invalid on the device
+	DB_INDEX_GEN_CRC, //Computing the CRC of the change generations
+	DB_INDEX_WRITING_GEN, //Writing the change generations for a new checkpoint
+	DB_INDEX_CRC, //Computing the CRC of a new checkpoint
+	DB_INDEX_WRITING //Writing a new checkpoint
+};
+
+struct db_index_header {
+	u32 crc;
+	u32 magic;
+	u32 generation;
+	u16 db_format;
+	u16 num_blocks;
+	u8 device_id[DEVICE_ID_LEN];
+	u32 change_gen; //Current change generation
+	u32 gen_crc; //CRC of the change generations in DB_GEN_BLOCK
+};
+
+struct db_index_blk_ent {
+	u16 part_size;
+	u8 part_occupancy;
+	u8 valid;
+};
+
+struct db_index {
+	struct db_index_header header;
+	u16 uid_map[MAX_UID + 1]; //0 == invalid, block #
+	struct db_index_blk_ent blk_tbl[MAX_DATA_BLOCK + 1];
+};
+
+static union {
+	struct db_index index;
+	u8 raw[BLK_SIZE];
+} db_index_blk DCACHE_ALIGNED;
+
+struct db_journal_header {
+	u32 crc;
+	u32 magic;
+	u32 generation; //Generation of the checkpoint the journal applies to
+	u16 count;
+	u16 reserved;
+	u32 change_gen_limit; //Highest change generation that may have been handed out
+};
+
+#define DB_JOURNAL_MAX_BLOCKS ((DB_JOURNAL_SZ - sizeof(struct db_journal_header))/sizeof(u16))
+
+static union {
+	struct {
+		struct db_journal_header header;
+		u16 blocks[DB_JOURNAL_MAX_BLOCKS];
+	} journal;
+	u8 raw[DB_JOURNAL_SZ];
+} db_journal_blk DCACHE_ALIGNED;
+
+static enum db_index_state db_index_state = DB_INDEX_UNKNOWN;
+static int db_index_last_write_ms = 0;
+static int db_index_deferred_idx = INVALID_BLOCK;
+static const u8 *db_index_deferred_src = NULL;
+static int db_index_crc_ready = 0; //DMA CRC of the checkpoint has completed
+static u32 db_index_crc_result;
+
+static u16 *const uid_map = db_index_blk.index.uid_map;
 
 struct uid_ent {
 	unsigned int uid : 12;
@@ -125,31 +394,236 @@ struct block {
 	struct uid_ent uid_tbl[];
 } __attribute__((__packed__));
 
-int db3_startup_scan_running = 0;
 static int db3_startup_scan_blk_num = -1;
+static int db3_startup_scan_read_len;
+static int db3_startup_scan_ent; //Next UID table entry to add or -1 if the block header hasn't been checked
+static int db3_startup_scan_journal_pos = -1; //Position in the journal while replaying it or -1 during a full scan
+static int db3_startup_scan_mark_changed = 0; //Records found while replaying the journal get new change generations
 static struct block *db3_startup_scan_block_read;
-static struct block_info *db3_startup_scan_blk_info_temp;
 
 static enum update_uid_status find_uid (int uid, const struct uid_ent **, int *block_num, struct block **block, int *index);
 static enum update_uid_status deallocate_uid (int uid, int *block_num, struct block *block_temp, struct block_info *blk_info_temp, int deallocate_block);
-static int block_crc(const struct block *blk)
+static int get_block_header_size(int part_count);
+static int get_part_count(int part_size);
+
+//
+// Incremental block CRCs
+//
+// The block CRC covers everything after the CRC field. It is computed from a CRC of
+// the header and UID table, a CRC of every partition and a CRC of the unused space
+// at the end of the block, combined with crc_32_combine_op(). The result is the same
+// CRC as computing it over the whole block so the on-disk format is unchanged.
+// Partition CRCs of recently used blocks are kept so that an update only recomputes
+// the CRCs of the UID table and the partitions it modified
+//
+#ifndef BLOCK_CRC_TBL_ENTRIES
+#define BLOCK_CRC_TBL_ENTRIES (2)
+#endif
+
+//Partition count of the smallest partition size in 'part_sizes[]'
+#define BLOCK_CRC_MAX_PARTS ((BLK_SIZE/SUB_BLK_SIZE)/4)
+
+struct block_crc_tbl {
+	int idx; //Block the partition CRCs belong to or INVALID_BLOCK
+	u32 crc; //Block CRC last computed from the partition CRCs
+	u16 part_size;
+	u32 part_op; //Operator to append a partition to a CRC
+	u32 part_crc[BLOCK_CRC_MAX_PARTS];
+	u32 part_valid[(BLOCK_CRC_MAX_PARTS + 31)/32]; //Bitmap of partitions with an up to date CRC
+};
+
+static struct block_crc_tbl block_crc_tbl[BLOCK_CRC_TBL_ENTRIES];
+static int block_crc_tbl_next = 0;
+
+static struct block_crc_tbl *block_crc_tbl_lookup(int idx)
+{
+	for (int i = 0; i < BLOCK_CRC_TBL_ENTRIES; i++) {
+		if (block_crc_tbl[i].idx == idx && idx != INVALID_BLOCK) {
+			return block_crc_tbl + i;
+		}
+	}
+	return NULL;
+}
+
+//Must be called whenever the contents of partition 'n' of block 'idx' are modified
+static void block_crc_part_modified(int idx, int n)
+{
+	struct block_crc_tbl *tbl = block_crc_tbl_lookup(idx);
+	if (tbl && n < BLOCK_CRC_MAX_PARTS) {
+		tbl->part_valid[n / 32] &= ~(1 << (n % 32));
+	}
+}
+
+//Discards the partition CRCs of block 'idx'. Used when a block is reinitialized
+static void block_crc_forget(int idx)
+{
+	struct block_crc_tbl *tbl = block_crc_tbl_lookup(idx);
+	if (tbl) {
+		tbl->idx = INVALID_BLOCK;
+	}
+}
+
+//
+// Computes the CRC of block 'idx'. The stored partition CRCs are only reused if 'blk'
+// was derived from the contents they were computed from, which is the case when its
+// CRC field holds the last CRC computed from them
+//
+static u32 block_crc(int idx, const struct block *blk)
 {
-	return crc_32(((u8 *)(&blk->header.crc)) + 4, BLK_SIZE - 4);
+	const u8 *data = (const u8 *)blk;
+	int part_size = blk->header.part_size;
+	int part_count = (part_size >= 1 && part_size <= MAX_PART_SIZE) ? get_part_count(part_size) : 0;
+	if (!part_count || part_count > BLOCK_CRC_MAX_PARTS) {
+		return crc_32(data + 4, BLK_SIZE - 4);
+	}
+	struct block_crc_tbl *tbl = block_crc_tbl_lookup(idx);
+	if (!tbl || tbl->part_size != part_size || tbl->crc != blk->header.crc) {
+		if (!tbl) {
+			tbl = block_crc_tbl + block_crc_tbl_next;
+			block_crc_tbl_next = (block_crc_tbl_next + 1) % BLOCK_CRC_TBL_ENTRIES;
+		}
+		tbl->idx = idx;
+		tbl->part_size = part_size;
+		tbl->part_op = crc_32_shift_op(part_size * SUB_BLK_SIZE);
+		memset(tbl->part_valid, 0, sizeof(tbl->part_valid));
+	}
+	int part_offs = get_block_header_size(part_count) * SUB_BLK_SIZE;
+	int part_len = part_size * SUB_BLK_SIZE;
+	u32 crc = crc_32(data + 4, part_offs - 4);
+	for (int i = 0; i < part_count; i++) {
+		if (!(tbl->part_valid[i / 32] & (1 << (i % 32)))) {
+			tbl->part_crc[i] = crc_32(data + part_offs + (i * part_len), part_len);
+			tbl->part_valid[i / 32] |= (1 << (i % 32));
+		}
+		crc = crc_32_combine_op(tbl->part_op, crc, tbl->part_crc[i]);
+	}
+	int tail_offs = part_offs + (part_count * part_len);
+	if (tail_offs < BLK_SIZE) {
+		crc = crc_32_combine(crc, crc_32(data + tail_offs, BLK_SIZE - tail_offs), BLK_SIZE - tail_offs);
+	}
+	tbl->crc = crc;
+	return crc;
 }
 
 //
 // Returns non-zero if CRC and partition size are in an invalid state OR the CRC is
 // correct. If the CRC is correct then the block is allocated otherwise th
 //
-static int block_crc_check(const struct block *blk)
+static int block_crc_check(int idx, const struct block *blk)
 {
 	if (blk->header.part_size == INVALID_PART_SIZE) {
 		return 0;
 	}
-	u32 res = block_crc(blk);
+	u32 res = block_crc(idx, blk);
 	return (res == blk->header.crc) ? 1 : 0;
 }
 
+//
+// Group commit
+//
+// During a multi-message UPDATE_UIDS sequence modified blocks are kept dirty in
+// the block cache instead of being written immediately. Dirty blocks are written
+// back with a single CRC computation when they are evicted or when the last
+// message of the sequence is processed. Records that move to another block are
+// written through and removed from their old block afterwards so a crash leaves
+// either the old record or both copies, the newer one having the higher 'rev'.
+//
+// A sequence that stops early leaves its blocks dirty. They are written back
+// before any command other than the next message of the sequence runs and by
+// db_index_idle() once the sequence has stalled for DB_GROUP_COMMIT_FLUSH_MS or
+// the host has disconnected.
+//
+#ifndef DB_GROUP_COMMIT_FLUSH_MS
+#define DB_GROUP_COMMIT_FLUSH_MS (200)
+#endif
+
+//Writes back a dirty cache entry. Completion is handled by db3_write_block_complete()
+static void block_cache_flush(struct block_cache_ent *ent)
+{
+	struct block *blk = (struct block *)ent->data;
+	if (blk->header.part_size != INVALID_PART_SIZE) {
+		blk->header.crc = block_crc(ent->idx, blk);
+	}
+	block_read_cache_flushing = 1;
+	g_db_block_cache_stats.flushes++;
+	write_data_block(ent->idx, ent->data);
+}
+
+//Writes back one dirty cache entry. Returns zero if there are no dirty entries
+static int block_cache_flush_next()
+{
+	for (int i = 0; i < DB_BLOCK_CACHE_ENTRIES; i++) {
+		struct block_cache_ent *ent = block_read_cache + i;
+		if (ent->dirty) {
+			block_cache_flush(ent);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int block_cache_dirty()
+{
+	for (int i = 0; i < DB_BLOCK_CACHE_ENTRIES; i++) {
+		if (block_read_cache[i].dirty) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+//
+// Stores a modified block in the cache without writing it. Returns zero if a
+// dirty entry has to be written back first in which case the active command is
+// resumed by db3_write_block_complete()
+//
+static int stage_data_block(int idx, const u8 *data)
+{
+	struct block_cache_ent *ent = lookup_cache_ent(idx);
+	if (!ent) {
+		ent = victim_cache_ent();
+		if (ent->dirty) {
+			block_cache_flush(ent);
+			return 0;
+		}
+		ent->idx = idx;
+	}
+	if (ent->data != data) {
+		memcpy(ent->data, data, BLK_SIZE);
+	}
+	ent->dirty = 1;
+	touch_cache_ent(ent);
+	block_cache_dirty_ms = HAL_GetTick();
+	return 1;
+}
+
+//
+// Called before a command runs. Blocks left dirty by a group commit are written back
+// first unless the command continues the UPDATE_UIDS sequence that staged them, so
+// no other command sees blocks on the device that are older than the cache. Returns
+// non-zero if the command has to wait. It is restarted with cmd_packet_restart()
+// once the write back completes
+//
+int db_command_wait(int continuation)
+{
+	if (block_read_cache_flushing && block_cache_background_flush) {
+		block_cache_cmd_waiting = 1;
+		return 1;
+	}
+	if (!continuation && block_cache_flush_next()) {
+		block_cache_cmd_waiting = 1;
+		return 1;
+	}
+	return 0;
+}
+
+//Writes back blocks left dirty by a group commit from db_index_idle() without waiting for DB_GROUP_COMMIT_FLUSH_MS
+void db_flush_group_commit()
+{
+	block_cache_flush_requested = 1;
+	BEGIN_WORK(DB_INDEX_SYNC_WORK);
+}
+
 static int get_block_header_size(int part_count)
 {
 	return SUB_BLK_COUNT(sizeof(struct block_header) + (sizeof(struct uid_ent) * part_count));
@@ -166,130 +640,1035 @@ static int get_part_count(int part_size)
 	return count;
 }
 
-//Returns a pointer to the n'th partition in 'block'
-static u8 *get_part(const struct block *block, const struct block_info *info, int n)
+//Returns a pointer to the n'th partition in 'block'
+static u8 *get_part(const struct block *block, const struct block_info *info, int n)
+{
+	return ((u8 *)block) + ((info->part_tbl_offs + (info->part_size * n)) * SUB_BLK_SIZE);
+}
+
+//Returns non-zero if a block header is plausible without checking the block CRC
+static int block_header_check(const struct block_header *header)
+{
+	if (header->part_size == INVALID_PART_SIZE) {
+		return 1;
+	}
+	if (header->part_size < 1 || header->part_size > MAX_PART_SIZE) {
+		return 0;
+	}
+	return header->occupancy <= get_part_count(header->part_size);
+}
+
+//
+// Partition sizes in sub blocks. Each size is the largest that still fits a
+// given number of partitions in a block so that little space is wasted.
+// The last size holds the largest possible record
+//
+#define NUM_PART_SIZES (15)
+static const u16 part_sizes[NUM_PART_SIZES] = {4, 8, 11, 16, 24, 32, 48, 67, 102, 145, 204, 255, 340, 511, MAX_PART_SIZE};
+
+//Returns the smallest partition size that can hold 'data_bytes' or 0 if it's too large
+static int target_part_size(int data_bytes)
+{
+	int min_part_size = SIZE_TO_SUB_BLK_COUNT(data_bytes);
+	for (int i = 0; i < NUM_PART_SIZES; i++) {
+		if (part_sizes[i] >= min_part_size) {
+			return part_sizes[i];
+		}
+	}
+	return 0;
+}
+
+//
+// Free space tracking
+//
+// Unallocated blocks are tracked in 'free_block_bitmap'. Allocated blocks with free
+// partitions are kept in a doubly linked list per partition size class so that
+// allocate_uid() doesn't need to scan 'g_block_info_tbl'. A block whose partition
+// size isn't in 'part_sizes' is listed under the largest class that fits in it.
+// free_space_update() must be called whenever a block's entry in 'g_block_info_tbl'
+// changes. The lists are only used by the CPU so they are kept in ITCM RAM.
+//
+#define FREE_BLOCK_BITMAP_WORDS ((MAX_DATA_BLOCK + 32) / 32)
+#define NO_PART_LIST (0xff)
+
+static u32 free_block_bitmap[FREE_BLOCK_BITMAP_WORDS];
+static u16 part_list_head[NUM_PART_SIZES];
+static u16 part_list_next[MAX_DATA_BLOCK + 1] ITCM_DATA;
+static u16 part_list_prev[MAX_DATA_BLOCK + 1] ITCM_DATA;
+static u8 part_list_class[MAX_DATA_BLOCK + 1] ITCM_DATA;
+
+//Returns the index of the largest size class that fits in a partition of 'part_size' sub blocks or NO_PART_LIST
+static int part_size_class(int part_size)
+{
+	for (int i = NUM_PART_SIZES - 1; i >= 0; i--) {
+		if (part_sizes[i] <= part_size) {
+			return i;
+		}
+	}
+	return NO_PART_LIST;
+}
+
+static void part_list_remove(int idx)
+{
+	int cls = part_list_class[idx];
+	int next = part_list_next[idx];
+	int prev = part_list_prev[idx];
+	if (prev != INVALID_BLOCK) {
+		part_list_next[prev] = next;
+	} else {
+		part_list_head[cls] = next;
+	}
+	if (next != INVALID_BLOCK) {
+		part_list_prev[next] = prev;
+	}
+	part_list_class[idx] = NO_PART_LIST;
+}
+
+static void part_list_insert(int idx, int cls)
+{
+	int head = part_list_head[cls];
+	part_list_prev[idx] = INVALID_BLOCK;
+	part_list_next[idx] = head;
+	if (head != INVALID_BLOCK) {
+		part_list_prev[head] = idx;
+	}
+	part_list_head[cls] = idx;
+	part_list_class[idx] = cls;
+}
+
+//Returns a block with free partitions in size class 'cls' other than 'exclude_block' or INVALID_BLOCK
+static int part_list_find(int cls, int exclude_block)
+{
+	int idx = part_list_head[cls];
+	if (idx == exclude_block) {
+		idx = part_list_next[idx];
+	}
+	return idx;
+}
+
+static void free_space_update(int idx)
+{
+	const struct block_info *blk_info = g_block_info_tbl + idx;
+	u32 bit = 1 << (idx % 32);
+	if (blk_info->valid && !blk_info->occupied) {
+		free_block_bitmap[idx / 32] |= bit;
+	} else {
+		free_block_bitmap[idx / 32] &= ~bit;
+	}
+	int cls = NO_PART_LIST;
+	if (blk_info->valid && blk_info->occupied && blk_info->part_occupancy < blk_info->part_count) {
+		cls = part_size_class(blk_info->part_size);
+	}
+	if (cls != part_list_class[idx]) {
+		if (part_list_class[idx] != NO_PART_LIST) {
+			part_list_remove(idx);
+		}
+		if (cls != NO_PART_LIST) {
+			part_list_insert(idx, cls);
+		}
+	}
+}
+
+static void free_space_init()
+{
+	memset(free_block_bitmap, 0, sizeof(free_block_bitmap));
+	memset(part_list_class, NO_PART_LIST, sizeof(part_list_class));
+	for (int i = 0; i < NUM_PART_SIZES; i++) {
+		part_list_head[i] = INVALID_BLOCK;
+	}
+	for (int i = MIN_DATA_BLOCK; i <= MAX_DATA_BLOCK; i++) {
+		free_space_update(i);
+	}
+}
+
+//Return a block that has not been allocated or INVALID_BLOCK if there are no free blocks
+static int find_free_block()
+{
+	for (int i = 0; i < FREE_BLOCK_BITMAP_WORDS; i++) {
+		if (free_block_bitmap[i]) {
+			return (i * 32) + __builtin_ctz(free_block_bitmap[i]);
+		}
+	}
+	return INVALID_BLOCK;
+}
+
+//Removes the n'th entry of a block's UID table. The block is freed if it becomes empty and 'deallocate_block' is set
+static void remove_uid_ent(int block_num, struct block *block, struct block_info *blk_info, int index, int deallocate_block)
+{
+	if (blk_info->part_occupancy == 1 && deallocate_block) {
+		//Free the block
+		block_crc_forget(block_num);
+		blk_info->valid = 1;
+		blk_info->occupied = 0;
+		block->header.crc = INVALID_CRC;
+		block->header.part_size = INVALID_PART_SIZE;
+		block->header.occupancy = 0;
+	} else {
+		blk_info->part_occupancy--;
+		block->header.occupancy--;
+		if (block->header.occupancy) {
+			memcpy(get_part(block, blk_info, index),
+			       get_part(block, blk_info, blk_info->part_occupancy),
+			       blk_info->part_size * SUB_BLK_SIZE);
+			block_crc_part_modified(block_num, index);
+			memcpy(block->uid_tbl + index,
+			       block->uid_tbl + blk_info->part_occupancy,
+			       sizeof(struct uid_ent));
+		}
+	}
+}
+
+//
+// Blocks are only read up to the end of their UID table during the startup scan so
+// their CRC can't be checked until they are first read in full
+//
+static void block_lazy_crc_check(int idx, const struct block *blk)
+{
+	struct block_info *blk_info = g_block_info_tbl + idx;
+	if (blk_info->crc_checked) {
+		return;
+	}
+	blk_info->crc_checked = 1;
+	if (!blk_info->occupied || block_crc_check(idx, blk)) {
+		return;
+	}
+	//HC_TODO: Block is invalid which shouldn't occur. We should perform a recovery
+	blk_info->valid = 0;
+	free_space_update(idx);
+	for (int j = 0; j < blk_info->part_occupancy; j++) {
+		const struct uid_ent *ent = blk->uid_tbl + j;
+		if (ent->uid >= MIN_UID && ent->uid <= MAX_UID && uid_map[ent->uid] == idx) {
+			uid_map[ent->uid] = INVALID_BLOCK;
+		}
+	}
+}
+
+//
+// Size and revision of every record packed as 'sz | (rev << UID_META_REV_SHIFT)'.
+// Records fit in one partition so their size never needs more than 14 bits. An
+// entry is only meaningful while 'uid_map' refers to a block. After starting up from
+// the index checkpoint entries are UID_META_UNKNOWN until the block holding the
+// record is read. Only the CPU uses the table so it is kept in ITCM RAM
+//
+#define UID_META_REV_SHIFT (14)
+#define UID_META_SZ_MASK ((1 << UID_META_REV_SHIFT) - 1)
+#define UID_META_UNKNOWN (0xffff)
+
+static u16 uid_meta[MAX_UID + 1] ITCM_DATA;
+
+static void uid_meta_set(int uid, int sz, int rev)
+{
+	uid_meta[uid] = (sz & UID_META_SZ_MASK) | (rev << UID_META_REV_SHIFT);
+}
+
+//Fills in 'uid_meta' for the records in 'blk' that 'uid_map' refers to
+static void uid_meta_load(int blk_num, const struct block *blk)
+{
+	if (blk->header.part_size == INVALID_PART_SIZE || !block_header_check(&blk->header)) {
+		return;
+	}
+	for (int i = 0; i < blk->header.occupancy; i++) {
+		const struct uid_ent *ent = blk->uid_tbl + i;
+		if (ent->uid >= MIN_UID && ent->uid <= MAX_UID && ent->first && uid_map[ent->uid] == blk_num) {
+			uid_meta_set(ent->uid, ent->sz, ent->rev);
+		}
+	}
+}
+
+//
+// Generation each record last changed in. Deleted records keep the generation
+// they were deleted in. The table is written to DB_GEN_BLOCK with every checkpoint
+// and restored on startup when the checkpoint is used, records that may have changed
+// since then getting new generations from the journal. If the checkpoint can't be
+// used generations restart from zero and 'root_page.db_epoch' is changed so hosts
+// know their generations are no longer meaningful.
+//
+// Only the low 16 bits of each generation are kept. uid_gen_get() returns the
+// latest generation up to 'db_change_gen' with those bits, so a record that hasn't
+// changed in the last 65536 generations is reported as changed more recently than
+// it did. Hosts may fetch such a record again but never miss a change
+//
+static u16 uid_gen[MAX_UID + 1] DCACHE_ALIGNED;
+static u32 db_change_gen = 0;
+static int db_change_gen_valid = 0;
+
+static u32 uid_gen_get(int uid)
+{
+	return db_change_gen - (u16)(db_change_gen - uid_gen[uid]);
+}
+
+static void uid_changed(int uid)
+{
+	db_change_gen++;
+	uid_gen[uid] = db_change_gen;
+}
+
+static void set_block_info(struct block_info *blk_info, int part_size, int occupancy)
+{
+	blk_info->part_size = part_size;
+	//Blocks without records are free so they can be reused with any partition size
+	blk_info->occupied = (part_size != INVALID_PART_SIZE) && occupancy;
+	if (blk_info->occupied && part_size >= 1 && part_size <= MAX_PART_SIZE) {
+		blk_info->part_occupancy = occupancy;
+		blk_info->part_count = get_part_count(part_size);
+		blk_info->part_tbl_offs = get_block_header_size(blk_info->part_count);
+	}
+}
+
+static u32 db_index_crc()
+{
+	return crc_32(((u8 *)&db_index_blk.index) + 4, sizeof(struct db_index) - 4);
+}
+
+//Returns non-zero if the checkpoint in 'db_index_blk' is valid and was loaded
+static int db_index_load()
+{
+	struct db_index_header *header = &db_index_blk.index.header;
+	if (header->magic != DB_INDEX_MAGIC ||
+	    header->db_format != root_page.db_format ||
+	    header->num_blocks != NUM_DATA_BLOCKS ||
+	    memcmp(header->device_id, root_page.device_id, DEVICE_ID_LEN) ||
+	    header->crc != db_index_crc()) {
+		return 0;
+	}
+	for (int i = MIN_DATA_BLOCK; i <= MAX_DATA_BLOCK; i++) {
+		const struct db_index_blk_ent *ent = db_index_blk.index.blk_tbl + i;
+		struct block_info *blk_info = g_block_info_tbl + i;
+		set_block_info(blk_info, ent->part_size, ent->part_occupancy);
+		blk_info->valid = ent->valid;
+		blk_info->crc_checked = 0;
+	}
+	return 1;
+}
+
+//
+// Writes the checkpoint. If 'valid' is zero the checkpoint is written with an invalid CRC.
+// Otherwise the CRC is computed with the DMA first and the write is issued by
+// db_index_crc_complete()
+//
+static void db_index_write(int valid)
+{
+	struct db_index_header *header = &db_index_blk.index.header;
+	header->generation++;
+	if (!valid) {
+		header->crc = INVALID_CRC;
+		write_data_block(DB_INDEX_BLOCK, db_index_blk.raw);
+		return;
+	}
+	db_index_state = DB_INDEX_CRC;
+	if (!crc_32_dma_start(((u8 *)&db_index_blk.index) + 4, sizeof(struct db_index) - 4, CRC_USER_DB_INDEX)) {
+		db_index_crc_complete(db_index_crc());
+	}
+}
+
+//
+// Issues the write that follows a checkpoint CRC. The write waits for DB transfers
+// that were queued while the CRC was computed since db_index_write_complete() routes
+// write completions by the checkpoint state
+//
+static void db_index_crc_write()
+{
+	if (emmc_user_queued(EMMC_USER_DB)) {
+		BEGIN_WORK(DB_INDEX_SYNC_WORK);
+		return;
+	}
+	db_index_crc_ready = 0;
+	struct db_index_header *header = &db_index_blk.index.header;
+	switch (db_index_state) {
+	case DB_INDEX_GEN_CRC:
+		header->gen_crc = db_index_crc_result;
+		db_index_state = DB_INDEX_WRITING_GEN;
+		write_data_block_part(DB_GEN_BLOCK, (const u8 *)uid_gen, sizeof(uid_gen));
+		break;
+	case DB_INDEX_CRC:
+		header->crc = db_index_crc_result;
+		db_index_state = DB_INDEX_WRITING;
+		write_data_block(DB_INDEX_BLOCK, db_index_blk.raw);
+		break;
+	default:
+		break;
+	}
+}
+
+void db_index_crc_complete(u32 crc)
+{
+	db_index_crc_result = crc;
+	db_index_crc_ready = 1;
+	db_index_crc_write();
+}
+
+static u32 db_journal_crc()
+{
+	return crc_32(db_journal_blk.raw + 4, DB_JOURNAL_SZ - 4);
+}
+
+//Returns non-zero if the journal in 'db_journal_blk' is valid
+static int db_journal_load()
+{
+	struct db_journal_header *header = &db_journal_blk.journal.header;
+	if (header->magic != DB_JOURNAL_MAGIC ||
+	    header->crc != db_journal_crc() ||
+	    header->count > DB_JOURNAL_MAX_BLOCKS) {
+		return 0;
+	}
+	if (header->generation != db_index_blk.index.header.generation) {
+		//The journal belongs to another checkpoint so blocks may have changed since this one
+		return 0;
+	}
+	for (int i = 0; i < header->count; i++) {
+		int idx = db_journal_blk.journal.blocks[i];
+		if (idx < MIN_DATA_BLOCK || idx > MAX_DATA_BLOCK) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int db_journal_contains(int idx)
+{
+	for (int i = 0; i < db_journal_blk.journal.header.count; i++) {
+		if (db_journal_blk.journal.blocks[i] == idx) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void db_journal_write()
+{
+	struct db_journal_header *header = &db_journal_blk.journal.header;
+	header->magic = DB_JOURNAL_MAGIC;
+	header->generation = db_index_blk.index.header.generation;
+	header->change_gen_limit = db_change_gen + DB_JOURNAL_GEN_RESERVE;
+	header->crc = db_journal_crc();
+	db_index_state = DB_INDEX_JOURNALING;
+	write_data_block_part(DB_JOURNAL_BLOCK, db_journal_blk.raw, DB_JOURNAL_SZ);
+}
+
+//
+// Called before every write to a data block. Returns non-zero if the write must be deferred
+// until the journal or checkpoint has been written. The deferred write is issued by
+// db_index_write_complete()
+//
+int db_index_write_data_block(int idx, const u8 *src)
+{
+	if (idx < MIN_DATA_BLOCK || idx > MAX_DATA_BLOCK) {
+		return 0;
+	}
+	db_index_last_write_ms = HAL_GetTick();
+	if (!db3_startup_scan_running && g_device_state != DS_LOGGED_IN && g_device_state != DS_LOGGED_OUT) {
+		//Blocks rewritten by a restore, wipe or initialize don't have change generations
+		db_change_gen_valid = 0;
+	}
+	switch (db_index_state) {
+	case DB_INDEX_UNKNOWN:
+		db_index_deferred_idx = idx;
+		db_index_deferred_src = src;
+		db_index_state = DB_INDEX_INVALIDATING;
+		db_index_write(0);
+		return 1;
+	case DB_INDEX_CLEAN: {
+		struct db_journal_header *header = &db_journal_blk.journal.header;
+		BEGIN_WORK(DB_INDEX_SYNC_WORK);
+		int journaled = db_journal_contains(idx);
+		if (journaled && db_change_gen < header->change_gen_limit) {
+			return 0;
+		}
+		db_index_deferred_idx = idx;
+		db_index_deferred_src = src;
+		if (journaled) {
+			//Raise the generation limit
+			db_journal_write();
+		} else if (header->count < DB_JOURNAL_MAX_BLOCKS) {
+			db_journal_blk.journal.blocks[header->count++] = idx;
+			db_journal_write();
+		} else {
+			db_index_state = DB_INDEX_INVALIDATING;
+			db_index_write(0);
+		}
+	} return 1;
+	case DB_INDEX_GEN_CRC:
+	case DB_INDEX_WRITING_GEN:
+	case DB_INDEX_CRC:
+	case DB_INDEX_WRITING:
+	case DB_INDEX_JOURNALING:
+	case DB_INDEX_INVALIDATING:
+		assert(!db_index_deferred_src);
+		db_index_deferred_idx = idx;
+		db_index_deferred_src = src;
+		return 1;
+	default:
+		BEGIN_WORK(DB_INDEX_SYNC_WORK);
+		return 0;
+	}
+}
+
+//Returns non-zero if the completed write was to the checkpoint or journal block
+int db_index_write_complete()
+{
+	switch (db_index_state) {
+	case DB_INDEX_INVALIDATING:
+		db_index_state = DB_INDEX_DIRTY;
+		break;
+	case DB_INDEX_WRITING_GEN:
+		db_index_write(1);
+		return 1;
+	case DB_INDEX_WRITING:
+		//Start an empty journal for the new checkpoint
+		db_journal_blk.journal.header.count = 0;
+		db_journal_write();
+		return 1;
+	case DB_INDEX_JOURNALING:
+		db_index_state = DB_INDEX_CLEAN;
+		break;
+	default:
+		return 0;
+	}
+	if (db_index_deferred_src) {
+		const u8 *src = db_index_deferred_src;
+		db_index_deferred_src = NULL;
+		write_data_block(db_index_deferred_idx, src);
+	}
+	return 1;
+}
+
+void db_index_idle()
+{
+	if (db_index_crc_ready) {
+		END_WORK(DB_INDEX_SYNC_WORK);
+		db_index_crc_write();
+		return;
+	}
+	int ms_count = HAL_GetTick();
+	//Work is ended while a command or transfer is in progress. Finishing it begins the work again
+	int cmd_idle = (active_cmd == -1 || update_uid_cmd_waiting()) && !db3_startup_scan_running;
+	if (block_cache_dirty() || block_read_cache_flushing) {
+		if (!cmd_idle || block_read_cache_flushing || block_read_cache_updating) {
+			END_WORK(DB_INDEX_SYNC_WORK);
+		} else if (block_cache_flush_requested || (ms_count - block_cache_dirty_ms) >= DB_GROUP_COMMIT_FLUSH_MS) {
+			//The group commit has stalled
+			END_WORK(DB_INDEX_SYNC_WORK);
+			block_cache_background_flush = 1;
+			block_cache_flush_next();
+		}
+		return;
+	}
+	block_cache_flush_requested = 0;
+	if (db_index_state != DB_INDEX_DIRTY &&
+	    (db_index_state != DB_INDEX_CLEAN || !db_journal_blk.journal.header.count)) {
+		END_WORK(DB_INDEX_SYNC_WORK);
+		return;
+	}
+	if (g_device_state != DS_LOGGED_IN && g_device_state != DS_LOGGED_OUT) {
+		END_WORK(DB_INDEX_SYNC_WORK);
+		return;
+	}
+	if (!cmd_idle || block_read_cache_updating) {
+		END_WORK(DB_INDEX_SYNC_WORK);
+		return;
+	}
+	if ((ms_count - db_index_last_write_ms) < DB_INDEX_SYNC_DELAY_MS) {
+		return;
+	}
+	END_WORK(DB_INDEX_SYNC_WORK);
+
+	struct db_index_header *header = &db_index_blk.index.header;
+	header->magic = DB_INDEX_MAGIC;
+	header->db_format = root_page.db_format;
+	header->num_blocks = NUM_DATA_BLOCKS;
+	memcpy(header->device_id, root_page.device_id, DEVICE_ID_LEN);
+	for (int i = MIN_DATA_BLOCK; i <= MAX_DATA_BLOCK; i++) {
+		const struct block_info *blk_info = g_block_info_tbl + i;
+		struct db_index_blk_ent *ent = db_index_blk.index.blk_tbl + i;
+		ent->part_size = blk_info->part_size;
+		ent->part_occupancy = blk_info->occupied ? blk_info->part_occupancy : 0;
+		ent->valid = blk_info->valid;
+	}
+	header->change_gen = db_change_gen;
+	db_index_state = DB_INDEX_GEN_CRC;
+	if (!crc_32_dma_start((const u8 *)uid_gen, sizeof(uid_gen), CRC_USER_DB_INDEX)) {
+		db_index_crc_complete(crc_32((const u8 *)uid_gen, sizeof(uid_gen)));
+	}
+}
+
+//Starts reading the header and UID table of a block during the startup scan
+static void db3_startup_scan_read(int idx)
+{
+	db3_startup_scan_blk_num = idx;
+	db3_startup_scan_ent = -1;
+	db3_startup_scan_read_len = EMMC_SUB_BLOCK_SZ;
+	read_data_block_part(idx, (u8 *)db3_startup_scan_block_read, db3_startup_scan_read_len);
+}
+
+//Returns the index of 'uid' in the UID table of 'blk' or -1 if it isn't found
+static int find_uid_ent(const struct block *blk, const struct block_info *blk_info, int uid)
+{
+	for (int j = 0; j < blk_info->part_occupancy; j++) {
+		if (blk->uid_tbl[j].uid == uid) {
+			return j;
+		}
+	}
+	return -1;
+}
+
+//
+// Removes 'uid' from block 'blk_num' during the startup scan. Returns zero if the block
+// has to be loaded or written first
+//
+static int db3_startup_scan_remove_uid(int blk_num, int uid)
+{
+	if (!get_cached_data_block(blk_num)) {
+		return 0;
+	}
+	struct block_cache_ent *ent = lookup_cache_ent(blk_num);
+	struct block *blk = (struct block *)ent->data;
+	struct block_info *blk_info = g_block_info_tbl + blk_num;
+	int index = blk_info->valid ? find_uid_ent(blk, blk_info, uid) : -1;
+	if (index < 0) {
+		return 1;
+	}
+	remove_uid_ent(blk_num, blk, blk_info, index, 1 /* deallocate block */);
+	ent->dirty = 1;
+	block_cache_flush(ent);
+	return 0;
+}
+
+//
+// Adds a record found by the startup scan to 'uid_map'. A crash while a record is
+// moving between blocks can leave a copy in both blocks. The moved copy has the next
+// 'rev' so it is kept and the other copy is removed. Returns zero if a block has to be
+// loaded or written first in which case the same record is added again when the scan
+// resumes
+//
+static int db3_startup_scan_add_uid(int blk_num, const struct uid_ent *ent)
+{
+	int uid = ent->uid;
+	int prev_blk_num = uid_map[uid];
+	if (prev_blk_num == INVALID_BLOCK || prev_blk_num == blk_num) {
+		uid_map[uid] = blk_num;
+		uid_meta_set(uid, ent->sz, ent->rev);
+		return 1;
+	}
+	const struct block *prev_blk = (const struct block *)get_cached_data_block(prev_blk_num);
+	if (!prev_blk) {
+		return 0;
+	}
+	int prev_index = -1;
+	if (uid_map[uid] == prev_blk_num) {
+		prev_index = find_uid_ent(prev_blk, g_block_info_tbl + prev_blk_num, uid);
+	}
+	if (prev_index < 0) {
+		//Other copy was in a block that failed its CRC check
+		uid_map[uid] = blk_num;
+		uid_meta_set(uid, ent->sz, ent->rev);
+		return 1;
+	}
+	if (((prev_blk->uid_tbl[prev_index].rev + 1) & 0x3) == ent->rev) {
+		uid_map[uid] = blk_num;
+		uid_meta_set(uid, ent->sz, ent->rev);
+		return db3_startup_scan_remove_uid(prev_blk_num, uid);
+	} else {
+		return db3_startup_scan_remove_uid(blk_num, uid);
+	}
+}
+
+static void db3_startup_scan_next()
+{
+	if (db3_startup_scan_journal_pos >= 0) {
+		db3_startup_scan_journal_pos++;
+		if (db3_startup_scan_journal_pos < db_journal_blk.journal.header.count) {
+			db3_startup_scan_read(db_journal_blk.journal.blocks[db3_startup_scan_journal_pos]);
+			return;
+		}
+		db3_startup_scan_journal_pos = -1;
+		if (db3_startup_scan_mark_changed) {
+			//Includes records added to the journaled blocks since the checkpoint
+			db3_startup_scan_mark_changed = 0;
+			for (int uid = 0; uid <= MAX_UID; uid++) {
+				if (uid_map[uid] != INVALID_BLOCK && db_journal_contains(uid_map[uid])) {
+					uid_changed(uid);
+				}
+			}
+		}
+	} else if (db3_startup_scan_blk_num < MAX_DATA_BLOCK) {
+		db3_startup_scan_read(db3_startup_scan_blk_num + 1);
+		return;
+	}
+	//Write a checkpoint once the database is idle
+	db_index_last_write_ms = HAL_GetTick();
+	BEGIN_WORK(DB_INDEX_SYNC_WORK);
+	db3_startup_scan_finish();
+}
+
+static void db3_startup_scan_resume ()
+{
+	int i = db3_startup_scan_blk_num;
+	struct block *block_read = db3_startup_scan_block_read;
+
+	if (i == DB_INDEX_BLOCK) {
+		if (db_index_load()) {
+			db_index_state = DB_INDEX_CLEAN;
+			db3_startup_scan_blk_num = DB_JOURNAL_BLOCK;
+			read_data_block_part(DB_JOURNAL_BLOCK, db_journal_blk.raw, DB_JOURNAL_SZ);
+			return;
+		}
+		//Checkpoint is stale or corrupt. Fall back to a full scan
+		for (int uid = 0; uid <= MAX_UID; uid++) {
+			uid_map[uid] = INVALID_BLOCK;
+		}
+		if (db_index_state == DB_INDEX_UNKNOWN || db_index_state == DB_INDEX_CLEAN) {
+			db_index_state = DB_INDEX_DIRTY;
+		}
+		db_journal_blk.journal.header.count = 0;
+		db3_startup_scan_read(MIN_DATA_BLOCK);
+		return;
+	}
+
+	if (i == DB_GEN_BLOCK) {
+		int restored = 0;
+		if (crc_32((const u8 *)uid_gen, sizeof(uid_gen)) == db_index_blk.index.header.gen_crc) {
+			if (db_journal_blk.journal.header.count) {
+				db_change_gen = db_journal_blk.journal.header.change_gen_limit;
+			} else {
+				db_change_gen = db_index_blk.index.header.change_gen;
+			}
+			db_change_gen_valid = 1;
+			restored = 1;
+		}
+		if (db_journal_blk.journal.header.count) {
+			db3_startup_scan_replay(restored);
+		} else {
+			db3_startup_scan_finish();
+		}
+		return;
+	}
+
+	if (i == DB_JOURNAL_BLOCK) {
+		if (!db_journal_load()) {
+			//The journal may have been lost while it was being written
+			db_index_state = DB_INDEX_DIRTY;
+			db_journal_blk.journal.header.count = 0;
+			for (int uid = 0; uid <= MAX_UID; uid++) {
+				uid_map[uid] = INVALID_BLOCK;
+			}
+			db3_startup_scan_read(MIN_DATA_BLOCK);
+			return;
+		}
+		if (!db_change_gen_valid) {
+			db3_startup_scan_blk_num = DB_GEN_BLOCK;
+			read_data_block_part(DB_GEN_BLOCK, (u8 *)uid_gen, sizeof(uid_gen));
+		} else if (db_journal_blk.journal.header.count) {
+			db3_startup_scan_replay(0);
+		} else {
+			db3_startup_scan_finish();
+		}
+		return;
+	}
+
+	struct block_info *blk_info = g_block_info_tbl + i;
+	if (db3_startup_scan_ent < 0) {
+		blk_info->valid = block_header_check(&block_read->header);
+		if (blk_info->valid && block_read->header.part_size != INVALID_PART_SIZE) {
+			//Read more of the block if the UID table doesn't fit in what we have read
+			int uid_tbl_len = get_block_header_size(get_part_count(block_read->header.part_size)) * SUB_BLK_SIZE;
+			if (uid_tbl_len > db3_startup_scan_read_len) {
+				db3_startup_scan_read_len = uid_tbl_len;
+				read_data_block_part(i, (u8 *)block_read, db3_startup_scan_read_len);
+				return;
+			}
+		}
+		set_block_info(blk_info, block_read->header.part_size, block_read->header.occupancy);
+		blk_info->crc_checked = !blk_info->occupied || !blk_info->valid;
+		db3_startup_scan_ent = 0;
+	}
+	if (blk_info->valid == 0) {
+		//HC_TODO: Block is invalid which shouldn't occur. We should perform a recovery
+	} else if (blk_info->occupied) {
+		//Entries are read from the UID table as it was scanned. Records removed from
+		//this block since then are skipped by db3_startup_scan_add_uid()
+		for (; db3_startup_scan_ent < block_read->header.occupancy && blk_info->valid; db3_startup_scan_ent++) {
+			const struct uid_ent *ent = block_read->uid_tbl + db3_startup_scan_ent;
+			int uid = ent->uid;
+			if (uid >= MIN_UID && uid <= MAX_UID && ent->first) {
+				if (!db3_startup_scan_add_uid(i, ent)) {
+					return;
+				}
+			}
+		}
+	}
+	db3_startup_scan_next();
+}
+
+//
+// Rescans the blocks in the journal since they may have changed after the checkpoint.
+// If 'mark_changed' is set the change generations were just restored from the
+// checkpoint and every record in those blocks is given a new generation
+//
+static void db3_startup_scan_replay(int mark_changed)
+{
+	for (int uid = 0; uid <= MAX_UID; uid++) {
+		if (uid_map[uid] != INVALID_BLOCK && db_journal_contains(uid_map[uid])) {
+			if (mark_changed) {
+				uid_changed(uid);
+			}
+			uid_map[uid] = INVALID_BLOCK;
+		}
+	}
+	db3_startup_scan_mark_changed = mark_changed;
+	db3_startup_scan_journal_pos = 0;
+	db3_startup_scan_read(db_journal_blk.journal.blocks[0]);
+}
+
+static void db3_startup_scan_finish()
+{
+	db3_startup_scan_running = 0;
+	free_space_init();
+	if (!db_change_gen_valid) {
+		//Generations of records that changed since the checkpoint are unknown
+		memset(uid_gen, 0, sizeof(uid_gen));
+		db_change_gen = 0;
+		db_change_gen_valid = 1;
+		root_page.db_epoch++;
+		sync_root_block();
+	}
+	//HC_TODO: this functionality should be in callbacks
+	if (active_cmd == STARTUP) {
+		enter_state(DS_LOGGED_OUT);
+		cmd_data.startup.resp[3] = g_device_state;
+		finish_command(OKAY, cmd_data.startup.resp, sizeof(cmd_data.startup.resp));
+	} else if (g_device_state == DS_INITIALIZING) {
+		enter_state(DS_LOGGED_OUT);
+	}
+}
+
+//
+// Initializes 'g_block_info_tbl' and 'uid_map' on startup. The index checkpoint and
+// journal are read first and the data blocks are only all scanned if they aren't valid
+//
+void db3_startup_scan (u8 *block_read, struct block_info *blk_info_temp)
+{
+	db3_startup_scan_running = 1;
+	//Blocks may have been rewritten by an initialize or wipe. Dirty blocks are discarded
+	for (int i = 0; i < DB_BLOCK_CACHE_ENTRIES; i++) {
+		block_read_cache[i].idx = INVALID_BLOCK;
+		block_read_cache[i].dirty = 0;
+	}
+	memset(uid_meta, 0xff, sizeof(uid_meta));
+	db3_startup_scan_block_read = (struct block *)block_read;
+	db3_startup_scan_journal_pos = -1;
+	db3_startup_scan_mark_changed = 0;
+	db3_startup_scan_blk_num = DB_INDEX_BLOCK;
+	read_data_block(DB_INDEX_BLOCK, db_index_blk.raw);
+}
+
+static void initialize_block(int part_size, struct block *block)
+{
+	memset(block, 0, BLK_SIZE);
+	block->header.part_size = part_size;
+	block->header.occupancy = 0;
+}
+
+//Returns an unallocated block. Partition sizes are chosen when records are first added to a block
+struct block *db3_initialize_block(int block_num, struct block *block)
+{
+	block_crc_forget(block_num);
+	initialize_block(INVALID_PART_SIZE, block);
+	block->header.crc = INVALID_CRC;
+	return block;
+}
+
+//
+// Record encryption
+//
+// Records are encrypted and decrypted by the CRYP peripheral with DMA when it is
+// available. The peripheral is shared with the encrypted storage volumes so DB
+// transfers queue for it with cryp_user_queue(). The active command is resumed
+// from db_cryp_idle() once the transfer finishes. Records are AES-256 CBC in the
+// same byte order nettle uses so the software path is a drop in fallback
+//
+
+//Set to zero to always encrypt records in software
+#ifndef DB_HW_CRYP
+#define DB_HW_CRYP (1)
+#endif
+
+extern CRYP_HandleTypeDef hcryp;
+
+static struct {
+	int busy;
+	int encrypt;
+	int blk_count;
+	u8 iv[AES_BLK_SIZE];
+	const u8 *src;
+	u8 *dest;
+	int dma; //'dest' is being written by the CRYP peripheral
+} g_db_cryp;
+
+static volatile int g_db_cryp_cplt = 0;
+
+#if DB_HW_CRYP
+static int g_db_cryp_hw = -1; //-1 = not tested yet, 0 = software only, 1 = use CRYP
+static CRYP_ConfigTypeDef g_db_cryp_conf;
+static u32 g_db_cryp_key[AES_256_KEY_SIZE/4];
+static u32 g_db_cryp_iv[AES_BLK_SIZE/4];
+
+//The CRYP key and IV registers take big endian words
+static void db_cryp_config(const u8 *iv)
 {
-	return ((u8 *)block) + ((info->part_tbl_offs + (info->part_size * n)) * SUB_BLK_SIZE);
+	for (int i = 0; i < AES_256_KEY_SIZE/4; i++) {
+		u32 w;
+		memcpy(&w, g_encrypt_key + i * 4, 4);
+		g_db_cryp_key[i] = __REV(w);
+	}
+	for (int i = 0; i < AES_BLK_SIZE/4; i++) {
+		u32 w;
+		memcpy(&w, iv + i * 4, 4);
+		g_db_cryp_iv[i] = __REV(w);
+	}
+	g_db_cryp_conf.DataType = CRYP_DATATYPE_8B;
+	g_db_cryp_conf.KeySize = CRYP_KEYSIZE_256B;
+	g_db_cryp_conf.pKey = g_db_cryp_key;
+	g_db_cryp_conf.pInitVect = g_db_cryp_iv;
+	g_db_cryp_conf.Algorithm = CRYP_AES_CBC;
+	g_db_cryp_conf.DataWidthUnit = CRYP_DATAWIDTHUNIT_WORD;
+	HAL_CRYP_SetConfig(&hcryp, &g_db_cryp_conf);
 }
 
-static void db3_startup_scan_resume ()
+//Checks the CRYP peripheral produces the same cyphertext as nettle before trusting it with records
+static int db_cryp_self_test()
 {
-	int i = db3_startup_scan_blk_num;
-	struct block *block_read = db3_startup_scan_block_read;
-#if 0
-	struct block_info *blk_info_temp = db3_startup_scan_blk_info_temp;
+	u32 iv[AES_BLK_SIZE/4];
+	u32 plaintext[AES_BLK_SIZE/4];
+	u32 hw[AES_BLK_SIZE/4];
+	u32 sw[AES_BLK_SIZE/4];
+	for (int i = 0; i < AES_BLK_SIZE/4; i++) {
+		iv[i] = 0x03020100 + (i * 0x04040404);
+		plaintext[i] = 0x13121110 + (i * 0x04040404);
+	}
+	signet_aes_256_ctx_encrypt_cbc(&g_encrypt_ctx, 1, (u8 *)iv, (u8 *)plaintext, (u8 *)sw);
+	db_cryp_config((u8 *)iv);
+	if (HAL_CRYP_Encrypt(&hcryp, plaintext, AES_BLK_SIZE/4, hw, 10) != HAL_OK) {
+		return 0;
+	}
+	return memcmp(hw, sw, AES_BLK_SIZE) ? 0 : 1;
+}
 #endif
 
-	struct block_info *blk_info = g_block_info_tbl + i;
-	blk_info->part_size = block_read->header.part_size;
-	blk_info->valid = block_crc_check(block_read) || blk_info->part_size == INVALID_PART_SIZE;
-	blk_info->occupied = (blk_info->part_size != INVALID_PART_SIZE);
-	if (blk_info->valid == 0) {
-		//HC_TODO: Block is invalid which shouldn't occur. We should perform a recovery
-	} else if (blk_info->occupied) {
-		blk_info->part_occupancy = block_read->header.occupancy;
-		blk_info->part_count = get_part_count(block_read->header.part_size);
-		blk_info->part_tbl_offs = get_block_header_size(blk_info->part_count);
-		for (int j = 0; j < blk_info->part_occupancy; j++) {
-			const struct uid_ent *ent = block_read->uid_tbl + j;
-			int uid = ent->uid;
-			if (uid >= MIN_UID && ent->uid <= MAX_UID && ent->first) {
-#if 0
-//
-// HC_TODO: This code needs review and testing. We can get away with this disabled so
-// long as we store only one record per block and records can't span blocks.
-//
-				if (uid_map[uid] != INVALID_BLOCK) {
-					int block_num_temp;
-					int index_temp;
-					const struct uid_ent *prev_ent;
-					struct block *blk;
-				       	enum update_uid_status rc = find_uid(uid, &prev_ent, &block_num_temp, &blk, &index_temp);
-					if (rc != UPDATE_UID_SUCCESS) {
-						return;
-					}
-					if (((ent->rev + 1) & 0x3) == prev_ent->rev) {
-						//HC_TODO: sould be setting block num here
-						uid_map[uid] = i;
-					}
-					struct block *block = (struct block *)block_temp;
-					deallocate_uid(uid, block_num_temp, block, blk_info_temp, 1 /* dellocate block */);
-					if (blk_info_temp->occupied) {
-						block->header.crc = block_crc(block);
-					}
-					write_data_block(block_num, (u8 *)block, BLK_SIZE);
-					return 0;
-				} else {
-					uid_map[uid] = i;
-				}
-#else
-				uid_map[uid] = i;
-#endif
-			}
-		}
-	}
-	db3_startup_scan_blk_num++;
-	if (db3_startup_scan_blk_num <= MAX_DATA_BLOCK) {
-		read_data_block(db3_startup_scan_blk_num, (u8 *)block_read);
+static void db_cryp_sw()
+{
+	if (g_db_cryp.encrypt) {
+		signet_aes_256_ctx_encrypt_cbc(&g_encrypt_ctx, g_db_cryp.blk_count, g_db_cryp.iv, g_db_cryp.src, g_db_cryp.dest);
 	} else {
-		db3_startup_scan_running = 0;
-		//HC_TODO: this functionality should be in callbacks
-		if (active_cmd == STARTUP) {
-			enter_state(DS_LOGGED_OUT);
-			cmd_data.startup.resp[3] = g_device_state;
-			finish_command(OKAY, cmd_data.startup.resp, sizeof(cmd_data.startup.resp));
-		} else if (g_device_state == DS_INITIALIZING) {
-			enter_state(DS_LOGGED_OUT);
-		}
+		signet_aes_256_ctx_decrypt_cbc(&g_encrypt_ctx, g_db_cryp.blk_count, g_db_cryp.iv, g_db_cryp.src, g_db_cryp.dest);
 	}
 }
 
-//Scans blocks on startup to initialize 'g_block_info_tbl' and 'uid_map'
-void db3_startup_scan (u8 *block_read, struct block_info *blk_info_temp)
+//Called when the CRYP peripheral is granted to the DB
+void cryp_user_db_start()
 {
-	int i;
-	for (i = MIN_UID; i <= MAX_UID; i++) {
-		uid_map[i] = INVALID_BLOCK;
+#if DB_HW_CRYP
+	if (g_db_cryp_hw < 0) {
+		g_db_cryp_hw = db_cryp_self_test();
 	}
-	db3_startup_scan_running = 1;
-	db3_startup_scan_blk_info_temp = blk_info_temp;
-	db3_startup_scan_block_read = (struct block *)block_read;
-	db3_startup_scan_blk_num = MIN_DATA_BLOCK;
-	read_data_block(db3_startup_scan_blk_num, (u8 *)db3_startup_scan_block_read);
+	if (g_db_cryp_hw) {
+		HAL_StatusTypeDef status;
+		u16 words = g_db_cryp.blk_count * (AES_BLK_SIZE/4);
+		db_cryp_config(g_db_cryp.iv);
+		dcache_clean(g_db_cryp.src, words * 4);
+		dcache_clean_invalidate(g_db_cryp.dest, words * 4);
+		g_db_cryp.dma = 1;
+		if (g_db_cryp.encrypt) {
+			status = HAL_CRYP_Encrypt_DMA(&hcryp, (u32 *)g_db_cryp.src, words, (u32 *)g_db_cryp.dest);
+		} else {
+			status = HAL_CRYP_Decrypt_DMA(&hcryp, (u32 *)g_db_cryp.src, words, (u32 *)g_db_cryp.dest);
+		}
+		if (status == HAL_OK) {
+			return;
+		}
+		g_db_cryp.dma = 0;
+	}
+#endif
+	db_cryp_sw();
+	db_cryp_complete();
 }
 
-//Return a block that has not been allocated or INVALID_BLOCK if there are no free blocks
-static int find_free_block()
+//
+// Encrypts or decrypts 'blk_count' AES blocks from 'src' to 'dest'. Returns zero if
+// the operation completed immediately in software. Otherwise the active command is
+// resumed when it completes. 'src' and 'dest' may be the same buffer.
+//
+// 'dest' doesn't have to be cache line aligned but the rest of its first and last
+// cache lines must belong to a DCACHE_ALIGNED buffer that nothing writes until the
+// command resumes. They are invalidated when the DMA transfer finishes
+//
+static int db_cryp_start(int encrypt, int blk_count, const u8 *iv, const u8 *src, u8 *dest)
 {
-	for (int i = MIN_DATA_BLOCK; i <= MAX_DATA_BLOCK; i++) {
-		struct block_info *blk_info = g_block_info_tbl + i;
-		if (blk_info->valid && !blk_info->occupied) {
-			return i;
-		}
+	g_db_cryp.encrypt = encrypt;
+	g_db_cryp.blk_count = blk_count;
+	memcpy(g_db_cryp.iv, iv, AES_BLK_SIZE);
+	g_db_cryp.src = src;
+	g_db_cryp.dest = dest;
+#if DB_HW_CRYP
+	//DMA transfers are word sized
+	if (g_db_cryp_hw && !(((u32)src | (u32)dest) & 3)) {
+		g_db_cryp.busy = 1;
+		cryp_user_queue(CRYP_USER_DB);
+		return 1;
 	}
-	return INVALID_BLOCK;
+#endif
+	db_cryp_sw();
+	return 0;
 }
 
-static void initialize_block(int part_size, struct block *block)
+//Called from the CRYP interrupt or when a queued operation fell back to software
+void db_cryp_complete()
 {
-	memset(block, 0, BLK_SIZE);
-	block->header.part_size = part_size;
-	block->header.occupancy = 0;
+	g_db_cryp_cplt = 1;
+	BEGIN_WORK(DB_CRYP_WORK);
 }
 
-struct block *db3_initialize_block(int block_num, struct block *block)
+static void update_uid_cmd_encrypted();
+static void read_uid_cmd_decrypted();
+static void read_all_uids_decrypted();
+
+void db_cryp_idle()
 {
-	initialize_block(MAX_PART_SIZE, block);
-	block->header.crc = block_crc(block);
-	return block;
+	if (!g_db_cryp_cplt) {
+		return;
+	}
+	g_db_cryp_cplt = 0;
+	END_WORK(DB_CRYP_WORK);
+#if DB_HW_CRYP
+	memset(g_db_cryp_key, 0, sizeof(g_db_cryp_key));
+	if (g_db_cryp.dma) {
+		g_db_cryp.dma = 0;
+		dcache_invalidate(g_db_cryp.dest, g_db_cryp.blk_count * AES_BLK_SIZE);
+	}
+#endif
+	g_db_cryp.busy = 0;
+	cryp_user_done();
+	switch (active_cmd) {
+	case UPDATE_UID:
+	case UPDATE_UIDS:
+		update_uid_cmd_encrypted();
+		break;
+	case READ_UID:
+		read_uid_cmd_decrypted();
+		break;
+	case READ_ALL_UIDS:
+		read_all_uids_decrypted();
+		read_all_uids_cmd_iter();
+		break;
+	}
 }
 
-static void allocate_uid_blk (int uid, const u8 *data, int sz, int rev, const u8 *iv, struct block *block_temp, struct block_info *blk_info_temp)
+static void allocate_uid_blk (int uid, const u8 *data, int sz, int rev, const u8 *iv, int block_num, struct block *block_temp, struct block_info *blk_info_temp)
 {
 	int index = blk_info_temp->part_occupancy;
 	blk_info_temp->part_occupancy++;
 	blk_info_temp->occupied = 1;
 	blk_info_temp->valid = 1;
+	blk_info_temp->crc_checked = 1;
 	block_temp->header.occupancy++;
 	block_temp->uid_tbl[index].uid = uid;
 	block_temp->uid_tbl[index].sz = sz;
@@ -299,12 +1678,19 @@ static void allocate_uid_blk (int uid, const u8 *data, int sz, int rev, const u8
 
 	int blk_count = SIZE_TO_SUB_BLK_COUNT(sz);
 
-	signet_aes_256_encrypt_cbc(g_encrypt_key, blk_count, iv, data, get_part(block_temp, blk_info_temp, index));
+	//The command waits in UPDATE_UID_STAGE_ENCRYPT if this completes asynchronously
+	db_cryp_start(1, blk_count, iv, data, get_part(block_temp, blk_info_temp, index));
+	block_crc_part_modified(block_num, index);
 }
 
-static enum update_uid_status allocate_uid (int uid, const u8 *data, int sz, int rev, const u8 *iv, int *block_num, struct block *block_temp, struct block_info *blk_info_temp)
+//
+// Allocates a partition for 'uid' in a block other than 'exclude_block'. Blocks
+// with the same partition size as the record are preferred, then free blocks and
+// then blocks with the smallest larger partition size
+//
+static enum update_uid_status allocate_uid (int uid, const u8 *data, int sz, int rev, const u8 *iv, int *block_num, struct block *block_temp, struct block_info *blk_info_temp, int exclude_block)
 {
-	int part_size = MAX_PART_SIZE;
+	int part_size = target_part_size(sz);
 	*block_num = INVALID_BLOCK;
 
 	if (!part_size) {
@@ -312,23 +1698,19 @@ static enum update_uid_status allocate_uid (int uid, const u8 *data, int sz, int
 	}
 
 	int allocating_block = 0;
+	int cls = part_size_class(part_size);
 
 	//Try to find a block with the right partition size
-	for (int i = MIN_DATA_BLOCK; i <= MAX_DATA_BLOCK; i++) {
-		struct block_info *blk_info = g_block_info_tbl + i;
-		if (!blk_info->valid || !blk_info->occupied)
-			continue;
-		if (blk_info->part_size == part_size && blk_info->part_occupancy < blk_info->part_count) {
-			*block_num = i;
-			memcpy(blk_info_temp, g_block_info_tbl + *block_num, sizeof(*blk_info_temp));
-			break;
-		}
+	*block_num = part_list_find(cls, exclude_block);
+	if (*block_num != INVALID_BLOCK) {
+		memcpy(blk_info_temp, g_block_info_tbl + *block_num, sizeof(*blk_info_temp));
 	}
 
 	//If we can't try to create a new block with the right partition size
 	if (*block_num == INVALID_BLOCK) {
 		*block_num = find_free_block();
 		if (*block_num != INVALID_BLOCK) {
+			block_crc_forget(*block_num);
 			initialize_block(part_size, block_temp);
 			blk_info_temp->part_occupancy = 0;
 			blk_info_temp->part_size = part_size;
@@ -338,19 +1720,12 @@ static enum update_uid_status allocate_uid (int uid, const u8 *data, int sz, int
 		}
 	}
 
-	if (*block_num == INVALID_BLOCK) {
-		//Try to find a block with a large enough partition size if
-		//an exact match or new block can't be found
-		int found_part_size = BLK_SIZE;
-		for (int i = MIN_DATA_BLOCK; i <= MAX_DATA_BLOCK; i++) {
-			struct block_info *blk_info = g_block_info_tbl + i;
-			if (!blk_info->valid || !blk_info->occupied)
-				continue;
-			if (blk_info->part_size >= part_size && blk_info->part_size < found_part_size && blk_info->part_occupancy < blk_info->part_count) {
-				*block_num = i;
-				found_part_size = blk_info->part_size;
-				memcpy(blk_info_temp, g_block_info_tbl + *block_num, sizeof(*blk_info_temp));
-			}
+	//Try to find a block with the smallest larger partition size if
+	//an exact match or new block can't be found
+	for (int i = cls + 1; *block_num == INVALID_BLOCK && i < NUM_PART_SIZES; i++) {
+		*block_num = part_list_find(i, exclude_block);
+		if (*block_num != INVALID_BLOCK) {
+			memcpy(blk_info_temp, g_block_info_tbl + *block_num, sizeof(*blk_info_temp));
 		}
 	}
 
@@ -362,8 +1737,8 @@ static enum update_uid_status allocate_uid (int uid, const u8 *data, int sz, int
 		memcpy(block_temp, blk, BLK_SIZE);
 	}
 
-	if (block_num != INVALID_BLOCK) {
-		allocate_uid_blk(uid, data, sz, rev, iv, block_temp, blk_info_temp);
+	if (*block_num != INVALID_BLOCK) {
+		allocate_uid_blk(uid, data, sz, rev, iv, *block_num, block_temp, blk_info_temp);
 		return UPDATE_UID_SUCCESS;
 	} else {
 		return UPDATE_UID_NO_SPACE;
@@ -410,30 +1785,12 @@ static enum update_uid_status deallocate_uid (int uid, int *block_num, struct bl
 	}
 	struct block_info *blk_info = g_block_info_tbl + *block_num;
 	memcpy(blk_info_temp, blk_info, sizeof(*blk_info_temp));
-	if (blk_info_temp->part_occupancy == 1 && deallocate_block) {
-		//Free the block
-		blk_info_temp->valid = 1;
-		blk_info_temp->occupied = 0;
-		block_temp->header.crc = INVALID_CRC;
-		block_temp->header.part_size = INVALID_PART_SIZE;
-		block_temp->header.occupancy = 0;
-	} else {
-		blk_info_temp->part_occupancy--;
-		memcpy(block_temp, blk, BLK_SIZE);
-		block_temp->header.occupancy--;
-		if (block_temp->header.occupancy) {
-			memcpy(get_part(block_temp, blk_info_temp, index),
-			       get_part(block_temp, blk_info_temp, blk_info_temp->part_occupancy),
-			       blk_info_temp->part_size * SUB_BLK_SIZE);
-			memcpy(block_temp->uid_tbl + index,
-			       block_temp->uid_tbl + blk_info_temp->part_occupancy,
-			       sizeof(struct uid_ent));
-		}
-	}
+	memcpy(block_temp, blk, BLK_SIZE);
+	remove_uid_ent(*block_num, block_temp, blk_info_temp, index, deallocate_block);
 	return UPDATE_UID_SUCCESS;
 }
 
-static enum update_uid_status update_uid (int uid, u8 *data, int sz,
+static enum update_uid_status update_uid (int uid, const u8 *data, int sz,
 		int *prev_block_num,
 		int *next_block_num,
 		const u8 *iv,
@@ -454,37 +1811,41 @@ static enum update_uid_status update_uid (int uid, u8 *data, int sz,
 		case UPDATE_UID_INVALID: {
 			//Allocate for the first time
 			*prev_block_num = INVALID_BLOCK;
-			rc = allocate_uid(uid, data, sz, 0 /* rev */, iv, next_block_num, block_temp, blk_info_temp);
+			rc = allocate_uid(uid, data, sz, 0 /* rev */, iv, next_block_num, block_temp, blk_info_temp, INVALID_BLOCK);
 			if (rc != UPDATE_UID_SUCCESS) {
 				return rc;
 			}
 		} break;
 		case UPDATE_UID_SUCCESS: {
-			int part_size = MAX_PART_SIZE;
+			int part_size = target_part_size(sz);
+			if (!part_size) {
+				return UPDATE_UID_INVALID;
+			}
+			int rev = ent->rev;
 			struct block_info *blk_info = g_block_info_tbl + *next_block_num;
-			memcpy(blk_info_temp, blk_info, sizeof(*blk_info_temp));
-			if (blk_info_temp->part_size == part_size) {
-				//Keep entry in single block by deallocating
-				//and reallocating within the block
-				memcpy(block_temp, blk, BLK_SIZE);
-				*prev_block_num = *next_block_num;
-
-				rc = deallocate_uid(uid, prev_block_num, block_temp, blk_info_temp, 0 /* deallocate block */);
-				if (rc != UPDATE_UID_SUCCESS) {
+			*prev_block_num = *next_block_num;
+			if (blk_info->part_size != part_size) {
+				//Move entry to a block with the right partition size first
+				rc = allocate_uid(uid, data, sz, (rev + 1) & 0x3, iv, next_block_num, block_temp, blk_info_temp, *prev_block_num);
+				if (rc != UPDATE_UID_NO_SPACE || blk_info->part_size < SIZE_TO_SUB_BLK_COUNT(sz)) {
 					return rc;
 				}
+				//No other block has space but the current partition is large enough
+				*next_block_num = *prev_block_num;
+			}
 
-				allocate_uid_blk(uid, data, sz, ent->rev, iv, block_temp, blk_info_temp);
-				return UPDATE_UID_SUCCESS;
-			} else {
-				//Move entry to new block first
-				int new_rev = (ent->rev + 1) & 0x3;
-				*prev_block_num = *next_block_num;
-				rc = allocate_uid(uid, data, sz, new_rev, iv, next_block_num, block_temp, blk_info_temp);
-				if (rc != UPDATE_UID_SUCCESS) {
-					return rc;
-				}
+			//Keep entry in single block by deallocating
+			//and reallocating within the block
+			memcpy(blk_info_temp, blk_info, sizeof(*blk_info_temp));
+			memcpy(block_temp, blk, BLK_SIZE);
+
+			rc = deallocate_uid(uid, prev_block_num, block_temp, blk_info_temp, 0 /* deallocate block */);
+			if (rc != UPDATE_UID_SUCCESS) {
+				return rc;
 			}
+
+			allocate_uid_blk(uid, data, sz, rev, iv, *next_block_num, block_temp, blk_info_temp);
+			return UPDATE_UID_SUCCESS;
 		} break;
 		default:
 			return rc;
@@ -494,7 +1855,23 @@ static enum update_uid_status update_uid (int uid, u8 *data, int sz,
 	return UPDATE_UID_SUCCESS;
 }
 
-void update_uid_cmd (int uid, u8 *data, int data_len, int sz, int press_type)
+enum update_uid_cmd_stage {
+	UPDATE_UID_STAGE_UPDATE, //Modifying the block the record is written to
+	UPDATE_UID_STAGE_ENCRYPT, //Waiting for the record to be encrypted into the block
+	UPDATE_UID_STAGE_COMMIT, //Writing or staging the block the record is written to
+	UPDATE_UID_STAGE_DEALLOCATE_PREV, //Removing a moved record from its previous block
+	UPDATE_UID_STAGE_COMMIT_PREV, //Writing or staging the previous block
+	UPDATE_UID_STAGE_FLUSH, //Writing back dirty blocks at the end of a group commit
+	UPDATE_UID_STAGE_DONE //Response sent. An UPDATE_UIDS sequence waits for its next message
+};
+
+//Returns non-zero if an UPDATE_UIDS sequence is waiting for its next message
+static int update_uid_cmd_waiting()
+{
+	return active_cmd == UPDATE_UIDS && cmd_data.update_uid.update_uid_stage == UPDATE_UID_STAGE_DONE;
+}
+
+void update_uid_cmd (int uid, u8 *data, int data_len, int sz, int press_type, int messages_remaining)
 {
 	derive_iv(uid, cmd_data.update_uid.iv);
 	cmd_data.update_uid.uid = uid;
@@ -502,11 +1879,32 @@ void update_uid_cmd (int uid, u8 *data, int data_len, int sz, int press_type)
 	cmd_data.update_uid.write_count = 0;
 	cmd_data.update_uid.press_type = press_type;
 	cmd_data.update_uid.prev_block_num = INVALID_BLOCK;
-	memcpy(cmd_data.update_uid.entry, data, data_len);
+	cmd_data.update_uid.update_uid_stage = UPDATE_UID_STAGE_UPDATE;
+	cmd_data.update_uid.group_commit = (active_cmd == UPDATE_UIDS);
+	cmd_data.update_uid.messages_remaining = messages_remaining;
+	//The record is encrypted straight from the command packet. It is moved to the
+	//start of the buffer so it is word aligned for the CRYP DMA
+	cmd_packet_hold();
+	memmove(cmd_packet_buf, data, data_len);
+	cmd_data.update_uid.entry = cmd_packet_buf;
 	cmd_data.update_uid.entry_sz = sz;
 	update_uid_cmd_iter();
 }
 
+//Sends the response for the current message. The last message of a group commit waits for dirty blocks to be written
+static void update_uid_cmd_finish(enum command_responses resp)
+{
+	if (cmd_data.update_uid.group_commit && !cmd_data.update_uid.messages_remaining) {
+		cmd_data.update_uid.resp = resp;
+		cmd_data.update_uid.update_uid_stage = UPDATE_UID_STAGE_FLUSH;
+		if (block_cache_flush_next()) {
+			return;
+		}
+	}
+	cmd_data.update_uid.update_uid_stage = UPDATE_UID_STAGE_DONE;
+	finish_command_resp(resp);
+}
+
 static void update_uid_cmd_iter()
 {
 	enum update_uid_status rc = update_uid(cmd_data.update_uid.uid,
@@ -517,18 +1915,21 @@ static void update_uid_cmd_iter()
 	                                cmd_data.update_uid.iv,
 	                                (struct block *)cmd_data.update_uid.block,
 	                                &cmd_data.update_uid.blk_info);
+	if (rc != UPDATE_UID_DATA_LOADING && rc != UPDATE_UID_SUCCESS) {
+		cmd_packet_release();
+	}
 	switch (rc) {
 	case UPDATE_UID_SUCCESS:
-		if (cmd_data.update_uid.press_type == 0) {
-			update_uid_cmd_complete();
-		} else if (cmd_data.update_uid.press_type == 1) {
-			begin_button_press_wait();
-		} else {
-			begin_long_button_press_wait();
+		if (cmd_data.update_uid.sz) {
+			//The record was appended to the UID table
+			const struct block *block = (const struct block *)cmd_data.update_uid.block;
+			cmd_data.update_uid.rev = block->uid_tbl[cmd_data.update_uid.blk_info.part_occupancy - 1].rev;
 		}
+		cmd_data.update_uid.update_uid_stage = UPDATE_UID_STAGE_ENCRYPT;
+		update_uid_cmd_encrypted();
 		break;
 	case UPDATE_UID_NO_SPACE:
-		finish_command_resp(NOT_ENOUGH_SPACE);
+		update_uid_cmd_finish(NOT_ENOUGH_SPACE);
 		break;
 	case UPDATE_UID_DATA_LOADING:
 		break;
@@ -537,13 +1938,95 @@ static void update_uid_cmd_iter()
 	}
 }
 
+//Waits for the button press, if any, once the record has been encrypted into the block
+static void update_uid_cmd_encrypted()
+{
+	if (g_db_cryp.busy || cmd_data.update_uid.update_uid_stage != UPDATE_UID_STAGE_ENCRYPT) {
+		return;
+	}
+	cmd_packet_release();
+	if (cmd_data.update_uid.press_type == 0) {
+		update_uid_cmd_complete();
+	} else if (cmd_data.update_uid.press_type == 1) {
+		begin_button_press_wait();
+	} else {
+		begin_long_button_press_wait();
+	}
+}
+
+//
+// Writes the modified block in 'cmd_data.update_uid.block' to 'idx'. During a group
+// commit the block is staged in the block cache instead unless it receives a moved
+// record, which must reach the device before the record is removed from its old block
+//
+static void update_uid_cmd_commit_block(int idx)
+{
+	struct block *block = (struct block *)cmd_data.update_uid.block;
+	int moving = cmd_data.update_uid.prev_block_num != INVALID_BLOCK &&
+		cmd_data.update_uid.prev_block_num != cmd_data.update_uid.block_num &&
+		idx == cmd_data.update_uid.block_num;
+	if (!cmd_data.update_uid.group_commit || moving) {
+		if (cmd_data.update_uid.blk_info.occupied) {
+			block->header.crc = block_crc(idx, block);
+		}
+		write_data_block(idx, (u8 *)block);
+	} else if (stage_data_block(idx, (u8 *)block)) {
+		update_uid_cmd_write_finished();
+	}
+}
+
 void update_uid_cmd_complete()
+{
+	cmd_data.update_uid.update_uid_stage = UPDATE_UID_STAGE_COMMIT;
+	update_uid_cmd_commit_block(cmd_data.update_uid.block_num);
+}
+
+//Removes a record from the block it was moved out of
+static void update_uid_cmd_deallocate_prev()
 {
 	struct block *block = (struct block *)cmd_data.update_uid.block;
-	if (cmd_data.update_uid.blk_info.occupied) {
-		block->header.crc = block_crc(block);
+	enum update_uid_status rc = deallocate_uid(cmd_data.update_uid.uid, &cmd_data.update_uid.prev_block_num, block, &cmd_data.update_uid.blk_info, 1 /* dellocate block*/);
+	switch (rc) {
+	case UPDATE_UID_SUCCESS:
+		break;
+	case UPDATE_UID_DATA_LOADING:
+		return;
+	default:
+		update_uid_cmd_finish(ID_INVALID);
+		return;
+	}
+	cmd_data.update_uid.update_uid_stage = UPDATE_UID_STAGE_COMMIT_PREV;
+	update_uid_cmd_commit_block(cmd_data.update_uid.prev_block_num);
+}
+
+//Called when a block the command was waiting on has been loaded or written back
+static void update_uid_cmd_resume()
+{
+	switch (cmd_data.update_uid.update_uid_stage) {
+	case UPDATE_UID_STAGE_UPDATE:
+		update_uid_cmd_iter();
+		break;
+	case UPDATE_UID_STAGE_ENCRYPT:
+		update_uid_cmd_encrypted();
+		break;
+	case UPDATE_UID_STAGE_COMMIT:
+		update_uid_cmd_commit_block(cmd_data.update_uid.block_num);
+		break;
+	case UPDATE_UID_STAGE_DEALLOCATE_PREV:
+		update_uid_cmd_deallocate_prev();
+		break;
+	case UPDATE_UID_STAGE_COMMIT_PREV:
+		update_uid_cmd_commit_block(cmd_data.update_uid.prev_block_num);
+		break;
+	case UPDATE_UID_STAGE_FLUSH:
+		if (!block_cache_flush_next()) {
+			cmd_data.update_uid.update_uid_stage = UPDATE_UID_STAGE_DONE;
+			finish_command_resp(cmd_data.update_uid.resp);
+		}
+		break;
+	case UPDATE_UID_STAGE_DONE:
+		break;
 	}
-	write_data_block(cmd_data.update_uid.block_num, (u8 *)block);
 }
 
 void update_uid_cmd_write_finished()
@@ -552,26 +2035,30 @@ void update_uid_cmd_write_finished()
 	if (cmd_data.update_uid.write_count == 1) {
 		//This is the first write completed
 		memcpy(g_block_info_tbl + cmd_data.update_uid.block_num, &cmd_data.update_uid.blk_info, sizeof(struct block_info));
+		free_space_update(cmd_data.update_uid.block_num);
 		if (cmd_data.update_uid.prev_block_num != cmd_data.update_uid.block_num && cmd_data.update_uid.prev_block_num != INVALID_BLOCK) {
 			//Record has moved to a new block. Need to dellocate from original block now
-			struct block *block = (struct block *)cmd_data.update_uid.block;
-			deallocate_uid(cmd_data.update_uid.uid, &cmd_data.update_uid.prev_block_num, block, &cmd_data.update_uid.blk_info, 1 /* dellocate block*/);
-			block->header.crc = block_crc(block);
-			write_data_block(cmd_data.update_uid.prev_block_num, (u8 *)block);
+			cmd_data.update_uid.update_uid_stage = UPDATE_UID_STAGE_DEALLOCATE_PREV;
+			update_uid_cmd_deallocate_prev();
 		} else {
+			uid_changed(cmd_data.update_uid.uid);
 			if (!cmd_data.update_uid.sz) {
 				//Record is being deleted
 				uid_map[cmd_data.update_uid.uid] = INVALID_BLOCK;
 			} else {
 				//Record is staying in the same block or has been added for the first time
 				uid_map[cmd_data.update_uid.uid] = cmd_data.update_uid.block_num;
+				uid_meta_set(cmd_data.update_uid.uid, cmd_data.update_uid.sz, cmd_data.update_uid.rev);
 			}
-			finish_command_resp(OKAY);
+			update_uid_cmd_finish(OKAY);
 		}
 	} else {
 		memcpy(g_block_info_tbl + cmd_data.update_uid.prev_block_num, &cmd_data.update_uid.blk_info, sizeof(struct block_info));
+		free_space_update(cmd_data.update_uid.prev_block_num);
+		uid_changed(cmd_data.update_uid.uid);
 		uid_map[cmd_data.update_uid.uid] = cmd_data.update_uid.block_num;
-		finish_command_resp(OKAY);
+		uid_meta_set(cmd_data.update_uid.uid, cmd_data.update_uid.sz, cmd_data.update_uid.rev);
+		update_uid_cmd_finish(OKAY);
 	}
 }
 
@@ -592,15 +2079,17 @@ static void mask_uid_data(u8 *data, int blk_count)
 	}
 }
 
-static int decode_uid(int sz, int block_num, const struct block *blk, int index, int masked, const u8 *iv, u8 *dest)
+//
+// Decrypts a record into 'dest'. The cyphertext is copied to 'dest' first so the
+// cached block can be evicted while the decryption is in progress. Returns non-zero
+// if the decryption completes asynchronously
+//
+static int decrypt_uid(int sz, int block_num, const struct block *blk, int index, const u8 *iv, u8 *dest)
 {
 	struct block_info *blk_info = g_block_info_tbl + block_num;
 	int blk_count = SIZE_TO_SUB_BLK_COUNT(sz);
-	signet_aes_256_decrypt_cbc(g_encrypt_key, blk_count, iv, get_part(blk, blk_info, index), dest);
-	if (masked) {
-		mask_uid_data(dest, blk_count);
-	}
-	return blk_count;
+	memcpy(dest, get_part(blk, blk_info, index), blk_count * SUB_BLK_SIZE);
+	return db_cryp_start(0, blk_count, iv, dest, dest);
 }
 
 void read_uid_cmd(int uid, int masked)
@@ -608,6 +2097,7 @@ void read_uid_cmd(int uid, int masked)
 	cmd_data.read_uid.uid = uid;
 	cmd_data.read_uid.masked = masked;
 	cmd_data.read_uid.waiting_for_button_press = 0;
+	cmd_data.read_uid.decrypting = 0;
 	derive_iv(cmd_data.read_uid.uid, cmd_data.read_uid.iv);
 	read_uid_cmd_iter();
 }
@@ -645,6 +2135,9 @@ static void read_uid_cmd_iter()
 
 void read_uid_cmd_complete()
 {
+	if (cmd_data.read_uid.decrypting) {
+		return;
+	}
 	cmd_data.read_uid.waiting_for_button_press = 0;
 	u8 *block = cmd_data.read_uid.block;
 	block[0] = cmd_data.read_uid.ent->sz & 0xff;
@@ -653,54 +2146,160 @@ void read_uid_cmd_complete()
 	if (!blk) {
 		return;
 	}
-	int blk_count = decode_uid(cmd_data.read_uid.ent->sz, cmd_data.read_uid.block_num, (struct block *)blk, cmd_data.read_uid.index, cmd_data.read_uid.masked, cmd_data.read_uid.iv, block + 2);
+	//Decrypt to a word aligned offset for the CRYP DMA and move the record after the size once done
+	cmd_data.read_uid.decrypting = 1;
+	if (!decrypt_uid(cmd_data.read_uid.ent->sz, cmd_data.read_uid.block_num, (struct block *)blk, cmd_data.read_uid.index, cmd_data.read_uid.iv, block + 4)) {
+		read_uid_cmd_decrypted();
+	}
+}
+
+static void read_uid_cmd_decrypted()
+{
+	if (!cmd_data.read_uid.decrypting) {
+		return;
+	}
+	cmd_data.read_uid.decrypting = 0;
+	u8 *block = cmd_data.read_uid.block;
+	int blk_count = SIZE_TO_SUB_BLK_COUNT(cmd_data.read_uid.ent->sz);
+	memmove(block + 2, block + 4, blk_count * SUB_BLK_SIZE);
+	if (cmd_data.read_uid.masked) {
+		mask_uid_data(block + 2, blk_count);
+	}
 	finish_command(OKAY, block, (blk_count * SUB_BLK_SIZE) + 2);
 }
 
-void read_all_uids_cmd_iter()
+//Returns the first occupied block after 'block_num' or INVALID_BLOCK if there isn't one
+static int next_occupied_block(int block_num)
+{
+	for (int i = block_num + 1; i <= MAX_DATA_BLOCK; i++) {
+		const struct block_info *blk_info = g_block_info_tbl + i;
+		if (blk_info->valid && blk_info->occupied) {
+			return i;
+		}
+	}
+	return INVALID_BLOCK;
+}
+
+static void read_all_uids_stage_msg(enum command_responses resp, int len)
+{
+	cmd_data.read_all_uids.staged = 1;
+	cmd_data.read_all_uids.staged_resp = resp;
+	cmd_data.read_all_uids.staged_remaining = cmd_data.read_all_uids.expected_remaining;
+	cmd_data.read_all_uids.staged_len = len;
+}
+
+//
+// Decrypts the next record into 'cmd_data.read_all_uids.block'. Returns zero if
+// a block has to be loaded first. Records are visited in the order they are stored
+// so each block is only read once and the next occupied block is read while the
+// records in the current one are sent
+//
+static int read_all_uids_stage()
 {
 	u8 *block = cmd_data.read_all_uids.block;
-	int block_num;
-	const struct uid_ent *ent;
-	int index;
-	struct block *blk;
-	do {
-		while (uid_map[cmd_data.read_all_uids.uid] == INVALID_BLOCK && cmd_data.read_all_uids.uid <= MAX_UID)
-			cmd_data.read_all_uids.uid++;
-
-		if (cmd_data.read_all_uids.uid > MAX_UID) {
-			block[0] = cmd_data.read_all_uids.uid & 0xff;
-			block[1] = cmd_data.read_all_uids.uid >> 8;
-			finish_command_multi(ID_INVALID, 0, block, 2);
-			return;
+	if (cmd_data.read_all_uids.decrypting) {
+		return 0;
+	}
+	while (cmd_data.read_all_uids.expected_remaining && cmd_data.read_all_uids.block_num != INVALID_BLOCK) {
+		int block_num = cmd_data.read_all_uids.block_num;
+		const struct block *blk = (const struct block *)get_cached_data_block(block_num);
+		if (!blk) {
+			return 0;
 		}
-		enum update_uid_status rc = find_uid(cmd_data.read_all_uids.uid, &ent, &block_num, &blk, &index);
-		if (rc != UPDATE_UID_SUCCESS) {
-			return;
+		prefetch_data_block(cmd_data.read_all_uids.next_block_num);
+		const struct block_info *blk_info = g_block_info_tbl + block_num;
+		while (cmd_data.read_all_uids.index < blk_info->part_occupancy) {
+			int index = cmd_data.read_all_uids.index++;
+			const struct uid_ent *ent = blk->uid_tbl + index;
+			int uid = ent->uid;
+			if (uid < MIN_UID || uid > MAX_UID || !ent->first || uid_map[uid] != block_num) {
+				continue;
+			}
+			cmd_data.read_all_uids.expected_remaining--;
+			block[0] = uid & 0xff;
+			block[1] = uid >> 8;
+			block[2] = ent->sz & 0xff;
+			block[3] = ent->sz >> 8;
+			derive_iv(uid, cmd_data.read_all_uids.iv);
+			cmd_data.read_all_uids.decrypting = 1;
+			if (decrypt_uid(ent->sz, block_num, blk, index, cmd_data.read_all_uids.iv, block + 4)) {
+				return 0;
+			}
+			read_all_uids_decrypted();
+			return 1;
 		}
-		cmd_data.read_all_uids.expected_remaining--;
-	} while(!ent);
+		cmd_data.read_all_uids.block_num = cmd_data.read_all_uids.next_block_num;
+		cmd_data.read_all_uids.next_block_num = next_occupied_block(cmd_data.read_all_uids.next_block_num);
+		cmd_data.read_all_uids.index = 0;
+	}
+	block[0] = (MAX_UID + 1) & 0xff;
+	block[1] = (MAX_UID + 1) >> 8;
+	cmd_data.read_all_uids.expected_remaining = 0;
+	read_all_uids_stage_msg(ID_INVALID, 2);
+	return 1;
+}
+
+//Stages the record decrypted by read_all_uids_stage()
+static void read_all_uids_decrypted()
+{
+	if (!cmd_data.read_all_uids.decrypting) {
+		return;
+	}
+	cmd_data.read_all_uids.decrypting = 0;
+	u8 *block = cmd_data.read_all_uids.block;
+	int sz = block[2] | (block[3] << 8);
+	int blk_count = SIZE_TO_SUB_BLK_COUNT(sz);
+	if (cmd_data.read_all_uids.masked) {
+		mask_uid_data(block + 4, blk_count);
+	}
+	read_all_uids_stage_msg(OKAY, (blk_count * 16) + 4);
+}
 
-	block[0] = cmd_data.read_all_uids.uid & 0xff;
-	block[1] = cmd_data.read_all_uids.uid >> 8;
-	block[2] = ent->sz & 0xff;
-	block[3] = ent->sz >> 8;
-	derive_iv(cmd_data.read_all_uids.uid, cmd_data.read_all_uids.iv);
-	int blk_count = decode_uid(ent->sz, block_num, blk, index, cmd_data.read_all_uids.masked, cmd_data.read_all_uids.iv, cmd_data.read_all_uids.block + 4);
-	finish_command_multi(OKAY, cmd_data.read_all_uids.expected_remaining, block, (blk_count * SUB_BLK_SIZE) + 4);
+//
+// Sends the staged record once the previous one has been sent and then decrypts
+// the next record while this one is being sent
+//
+void read_all_uids_cmd_iter()
+{
+	if (cmd_data.read_all_uids.done) {
+		return;
+	}
+	if (!cmd_data.read_all_uids.staged && !read_all_uids_stage()) {
+		return;
+	}
+	if (cmd_data.read_all_uids.sending) {
+		return;
+	}
+	cmd_data.read_all_uids.staged = 0;
+	if (!cmd_data.read_all_uids.staged_remaining) {
+		cmd_data.read_all_uids.done = 1;
+	} else {
+		cmd_data.read_all_uids.sending = 1;
+	}
+	finish_command_multi(cmd_data.read_all_uids.staged_resp, cmd_data.read_all_uids.staged_remaining,
+		cmd_data.read_all_uids.block, cmd_data.read_all_uids.staged_len);
+	if (!cmd_data.read_all_uids.done) {
+		read_all_uids_stage();
+	}
 }
 
 void read_all_uids_cmd_complete()
 {
-	cmd_data.read_all_uids.uid++;
+	cmd_data.read_all_uids.sending = 0;
 	read_all_uids_cmd_iter();
 }
 
 void read_all_uids_cmd(int masked)
 {
-	cmd_data.read_all_uids.uid = 0;
 	cmd_data.read_all_uids.masked = masked;
 	cmd_data.read_all_uids.expected_remaining = 0;
+	cmd_data.read_all_uids.block_num = next_occupied_block(INVALID_BLOCK);
+	cmd_data.read_all_uids.next_block_num = next_occupied_block(cmd_data.read_all_uids.block_num);
+	cmd_data.read_all_uids.index = 0;
+	cmd_data.read_all_uids.staged = 0;
+	cmd_data.read_all_uids.sending = 0;
+	cmd_data.read_all_uids.done = 0;
+	cmd_data.read_all_uids.decrypting = 0;
 
 	for (int i = MIN_UID; i <= MAX_UID; i++)
 		if(uid_map[i] != INVALID_BLOCK)
@@ -713,4 +2312,130 @@ void read_all_uids_cmd(int masked)
 	}
 }
 
+#define UID_INFO_PER_MESSAGE ((BLK_SIZE - UID_INFO_HEADER_SZ)/UID_INFO_SZ)
+
+//Returns non-zero if the metadata of 'uid' should be sent
+static int uid_info_selected(int uid)
+{
+	if (cmd_data.uid_info.all) {
+		return uid_map[uid] != INVALID_BLOCK;
+	} else {
+		return uid_gen_get(uid) > cmd_data.uid_info.since_gen;
+	}
+}
+
+//Returns the number of messages needed to send the metadata of 'uid' and the selected records after it
+static int uid_info_messages_remaining(int uid)
+{
+	int count = 1;
+	for (int i = uid + 1; i <= MAX_UID; i++)
+		if (uid_info_selected(i))
+			count++;
+	return (count + UID_INFO_PER_MESSAGE - 1)/UID_INFO_PER_MESSAGE;
+}
+
+static void uid_info_send(int messages_remaining)
+{
+	u8 *block = cmd_data.uid_info.block;
+	block[0] = root_page.db_epoch & 0xff;
+	block[1] = root_page.db_epoch >> 8;
+	block[2] = 0;
+	block[3] = 0;
+	memcpy(block + 4, &db_change_gen, sizeof(db_change_gen));
+	finish_command_multi(OKAY, messages_remaining, block, UID_INFO_HEADER_SZ + cmd_data.uid_info.len);
+}
+
+//
+// Sends the UID, revision, size and change generation of the selected records
+// packed UID_INFO_SZ bytes each after a header with the DB epoch and current
+// generation. Metadata comes from 'uid_meta' and 'uid_gen' so blocks are only
+// read for records whose metadata isn't known yet. Deleted records are sent
+// with a size of zero
+//
+void uid_info_cmd_iter()
+{
+	u8 *block = cmd_data.uid_info.block + UID_INFO_HEADER_SZ;
+	for (; cmd_data.uid_info.uid <= MAX_UID; cmd_data.uid_info.uid++) {
+		int uid = cmd_data.uid_info.uid;
+		if (!uid_info_selected(uid)) {
+			continue;
+		}
+		int block_num = uid_map[uid];
+		u16 info = uid;
+		u16 sz = 0;
+		if (block_num != INVALID_BLOCK && uid_meta[uid] == UID_META_UNKNOWN) {
+			const u8 *blk = get_cached_data_block(block_num);
+			if (!blk) {
+				return;
+			}
+			uid_meta_load(block_num, (const struct block *)blk);
+		}
+		//A record missing from the block 'uid_map' refers to can't be read. It is sent
+		//as deleted since it may already be in the message count
+		if (block_num != INVALID_BLOCK && uid_meta[uid] != UID_META_UNKNOWN) {
+			info |= (uid_meta[uid] >> UID_META_REV_SHIFT) << 12;
+			sz = uid_meta[uid] & UID_META_SZ_MASK;
+		}
+		int sent = 0;
+		if (cmd_data.uid_info.len == (UID_INFO_PER_MESSAGE * UID_INFO_SZ)) {
+			//A full message is only sent once the record after it is known so the
+			//count starts from a record that will be sent. The response is copied
+			//so 'uid' can start the next message straight away
+			uid_info_send(uid_info_messages_remaining(uid));
+			cmd_data.uid_info.len = 0;
+			sent = 1;
+		}
+		u8 *ent = block + cmd_data.uid_info.len;
+		ent[0] = info & 0xff;
+		ent[1] = info >> 8;
+		ent[2] = sz & 0xff;
+		ent[3] = sz >> 8;
+		u32 gen = uid_gen_get(uid);
+		memcpy(ent + 4, &gen, sizeof(gen));
+		cmd_data.uid_info.len += UID_INFO_SZ;
+		if (sent) {
+			cmd_data.uid_info.uid++;
+			return;
+		}
+	}
+	uid_info_send(0);
+}
+
+void uid_info_cmd_complete()
+{
+	uid_info_cmd_iter();
+}
+
+static void uid_info_cmd(int all, u32 since_gen)
+{
+	if (sync_root_block_pending()) {
+		//A new epoch may not have been stored yet
+		finish_command_resp(IN_PROGRESS);
+		return;
+	}
+	cmd_data.uid_info.uid = MIN_UID;
+	cmd_data.uid_info.len = 0;
+	cmd_data.uid_info.all = all;
+	cmd_data.uid_info.since_gen = since_gen;
+	uid_info_cmd_iter();
+}
+
+void read_all_uid_info_cmd()
+{
+	uid_info_cmd(1, 0);
+}
+
+//
+// Sends the metadata of records changed after generation 'gen'. If 'epoch' doesn't
+// match the generations the host has are meaningless so all records are sent
+//
+void read_uids_changed_since_cmd(int epoch, u32 gen)
+{
+	if (epoch != root_page.db_epoch) {
+		uid_info_cmd(1, 0);
+	} else {
+		uid_info_cmd(0, gen);
+	}
+}
+
 #endif
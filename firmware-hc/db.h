@@ -8,18 +8,53 @@ struct block_info {
 	u8 part_occupancy; //# of partitions allocated in a block
 	u16 part_size; //0 == invalid block, 61=>X>=1 == block size = X * 16,, X > 63 == invalid block
 	u16 part_tbl_offs; // offset of partitions in sub blocks
+	u8 crc_checked; //non-zero if the block CRC has been verified since startup
 };
 
+//Reported after the device state by GET_DEVICE_STATE
+struct db_block_cache_stats {
+	u32 hits;
+	u32 misses;
+	u32 writes;
+	u32 flushes; //Dirty blocks written back by group commits
+};
+
+extern struct db_block_cache_stats g_db_block_cache_stats;
+
+void update_data_block_cache(int idx, const u8 *data);
+
 void read_uid_cmd(int uid, int masked);
-void update_uid_cmd (int uid, u8 *data, int data_len, int sz, int press_type);
+void update_uid_cmd (int uid, u8 *data, int data_len, int sz, int press_type, int messages_remaining);
 void read_all_uids_cmd(int masked);
 void read_all_uids_cmd_iter();
+void read_all_uid_info_cmd();
+void read_uids_changed_since_cmd(int epoch, u32 gen);
+void uid_info_cmd_iter();
+void uid_info_cmd_complete();
 
 void read_uid_cmd_complete();
 void read_all_uids_cmd_complete();
 void update_uid_cmd_complete();
 void update_uid_cmd_write_finished();
 
+//Data block used to store the DB index checkpoint
+#define DB_INDEX_BLOCK (MAX_DATA_BLOCK + 1)
+
+//Data block used to store the list of blocks written since the checkpoint
+#define DB_JOURNAL_BLOCK (DB_INDEX_BLOCK + 1)
+
+//Data block used to store the change generation of every record
+#define DB_GEN_BLOCK (DB_JOURNAL_BLOCK + 1)
+
+int db_index_write_data_block(int idx, const u8 *src);
+int db_index_write_complete();
+void db_index_crc_complete(u32 crc);
+void db_index_idle();
+int db_command_wait(int continuation);
+void db_flush_group_commit();
+void db_cryp_complete();
+void db_cryp_idle();
+
 void db3_startup_scan(u8 *block_read, struct block_info *blk_info_temp);
 struct block *db3_initialize_block(int block_num, struct block *block_temp);
 
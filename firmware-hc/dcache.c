@@ -0,0 +1,137 @@
+#include "dcache.h"
+
+#include "stm32f7xx.h"
+
+#include "main.h"
+
+#if ENABLE_DCACHE_BENCHMARK
+#include <string.h>
+#include "signetdev_common.h"
+#include "signet_aes.h"
+#endif
+
+#define DTCM_START (0x20000000)
+#define DTCM_END (0x20010000)
+#define ITCM_END (0x4000)
+
+//Must match BULK_RAM in the linker scripts. MPU regions are a power of two in size and aligned to their size
+#define BULK_RAM_START (0x20030000)
+#define BULK_RAM_END (0x20040000)
+
+void dcache_init()
+{
+	MPU_Region_InitTypeDef region;
+	HAL_MPU_Disable();
+	region.Enable = MPU_REGION_ENABLE;
+	region.Number = MPU_REGION_NUMBER0;
+	region.BaseAddress = BULK_RAM_START;
+	region.Size = MPU_REGION_SIZE_64KB;
+	region.SubRegionDisable = 0;
+	region.TypeExtField = MPU_TEX_LEVEL1; //Normal memory, non-cacheable
+	region.AccessPermission = MPU_REGION_FULL_ACCESS;
+	region.DisableExec = MPU_INSTRUCTION_ACCESS_DISABLE;
+	region.IsShareable = MPU_ACCESS_SHAREABLE;
+	region.IsCacheable = MPU_ACCESS_NOT_CACHEABLE;
+	region.IsBufferable = MPU_ACCESS_NOT_BUFFERABLE;
+	HAL_MPU_ConfigRegion(&region);
+	HAL_MPU_Enable(MPU_PRIVILEGED_DEFAULT);
+	SCB_EnableDCache();
+}
+
+int dcache_is_coherent(const void *addr, int len)
+{
+	u32 start = (u32)addr;
+	u32 end = start + len;
+	if (start >= DTCM_START && end <= DTCM_END) {
+		return 1;
+	}
+	if (start >= BULK_RAM_START && end <= BULK_RAM_END) {
+		return 1;
+	}
+	if (end <= ITCM_END) {
+		return 1;
+	}
+	return 0;
+}
+
+int dcache_is_dma_safe(const void *addr, int len)
+{
+	if (dcache_is_coherent(addr, len)) {
+		return 1;
+	}
+	return !(((u32)addr | (u32)len) & (DCACHE_LINE_SIZE - 1));
+}
+
+//The CMSIS functions expect the range to start on a cache line
+#define DCACHE_LINE_START(addr) ((u32)(addr) & ~(DCACHE_LINE_SIZE - 1))
+
+void dcache_clean(const void *addr, int len)
+{
+	if (len <= 0 || dcache_is_coherent(addr, len)) {
+		return;
+	}
+	u32 start = DCACHE_LINE_START(addr);
+	SCB_CleanDCache_by_Addr((uint32_t *)start, ((u32)addr + len) - start);
+}
+
+void dcache_invalidate(void *addr, int len)
+{
+	if (len <= 0 || dcache_is_coherent(addr, len)) {
+		return;
+	}
+	u32 start = DCACHE_LINE_START(addr);
+	SCB_InvalidateDCache_by_Addr((uint32_t *)start, ((u32)addr + len) - start);
+}
+
+void dcache_clean_invalidate(void *addr, int len)
+{
+	if (len <= 0 || dcache_is_coherent(addr, len)) {
+		return;
+	}
+	u32 start = DCACHE_LINE_START(addr);
+	SCB_CleanInvalidateDCache_by_Addr((uint32_t *)start, ((u32)addr + len) - start);
+}
+
+#if ENABLE_DCACHE_BENCHMARK
+struct dcache_benchmark g_dcache_benchmark;
+
+#define DCACHE_BENCHMARK_LEN (2048)
+
+//
+// Copies part of the firmware image from flash and encrypts it in software. The
+// buffer is on the stack which is at the top of SRAM so it is cacheable. Each
+// workload runs twice and the second run is recorded so the cached numbers
+// don't include filling the cache
+//
+static void dcache_benchmark_run(int cached)
+{
+	struct signet_aes_256_ctx ctx;
+	u8 key[AES_256_KEY_SIZE];
+	u8 iv[AES_BLK_SIZE];
+	u8 buf[DCACHE_BENCHMARK_LEN] DCACHE_ALIGNED;
+	const u8 *src = (const u8 *)SCB->VTOR;
+
+	memset(key, 0x5a, sizeof(key));
+	memset(iv, 0, sizeof(iv));
+	signet_aes_256_ctx_init(&ctx, key);
+	for (int i = 0; i < 2; i++) {
+		u32 start = DWT->CYCCNT;
+		memcpy(buf, src, DCACHE_BENCHMARK_LEN);
+		u32 copied = DWT->CYCCNT;
+		signet_aes_256_ctx_encrypt_cbc(&ctx, DCACHE_BENCHMARK_LEN/AES_BLK_SIZE, iv, buf, buf);
+		u32 end = DWT->CYCCNT;
+		g_dcache_benchmark.memcpy_cycles[cached] = copied - start;
+		g_dcache_benchmark.aes_cycles[cached] = end - copied;
+	}
+	signet_aes_256_ctx_clear(&ctx);
+}
+
+//Needs the DWT cycle counter. Results are left in g_dcache_benchmark for the debugger
+void dcache_benchmark()
+{
+	SCB_DisableDCache();
+	dcache_benchmark_run(0);
+	SCB_EnableDCache();
+	dcache_benchmark_run(1);
+}
+#endif
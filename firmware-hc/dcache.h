@@ -0,0 +1,63 @@
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include "types.h"
+
+//
+// D-cache and DMA buffers
+//
+// SRAM1 and SRAM2 are cached write back and flash is cached write through. Buffers
+// that a peripheral reads or writes with DMA either live in DTCM, which the D-cache
+// never holds, or in the last 64K of SRAM, which the MPU makes non-cacheable, or
+// are cleaned before the peripheral reads them and invalidated after it writes them.
+//
+// Invalidating a cache line discards the whole line so a DMA destination outside
+// of DTCM must start on a cache line and must not share its last line with other
+// data. Declare such buffers with DCACHE_ALIGNED and keep their size a multiple of
+// DCACHE_LINE_SIZE
+//
+#define DCACHE_LINE_SIZE (32)
+
+#define DCACHE_ALIGNED __attribute__((aligned(DCACHE_LINE_SIZE)))
+
+//Places a zero initialized buffer in DTCM. Used for USB buffers
+#define DMA_BUFFER __attribute__((section(".bss.dma_buffer")))
+
+//Places a buffer in the non-cacheable region at the end of SRAM. Used for the
+//storage bulk buffers which don't fit in DTCM. The region isn't cleared at startup
+#define BULK_BUFFER __attribute__((section(".bulk_buffer"), aligned(DCACHE_LINE_SIZE)))
+
+//Runs a cycle count comparison of the D-cache disabled and enabled at startup
+#ifndef ENABLE_DCACHE_BENCHMARK
+#define ENABLE_DCACHE_BENCHMARK 0
+#endif
+
+void dcache_init();
+
+//Writes back cached data in the range before a peripheral reads it
+void dcache_clean(const void *addr, int len);
+
+//Discards cached data in the range after a peripheral has written it
+void dcache_invalidate(void *addr, int len);
+
+//Writes back and discards cached data in the range before a peripheral writes it
+void dcache_clean_invalidate(void *addr, int len);
+
+//Returns non-zero if the range is never cached so no maintenance is needed
+int dcache_is_coherent(const void *addr, int len);
+
+//Returns non-zero if the range can be invalidated without discarding other data
+int dcache_is_dma_safe(const void *addr, int len);
+
+#if ENABLE_DCACHE_BENCHMARK
+struct dcache_benchmark {
+	u32 aes_cycles[2]; //Software AES-256-CBC of a block with the D-cache disabled and enabled
+	u32 memcpy_cycles[2]; //Copying a block with the D-cache disabled and enabled
+};
+
+extern struct dcache_benchmark g_dcache_benchmark;
+
+void dcache_benchmark();
+#endif
+
+#endif
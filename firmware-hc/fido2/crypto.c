@@ -55,6 +55,19 @@ static void buffer_from_limbs(u8 *buffer, const mp_limb_t *l, int n)
 	}
 }
 
+//Writes 'n' limbs of 'v'. An mpz can have fewer limbs than the curve size when
+//its top limbs are zero
+static void buffer_from_mpz(u8 *buffer, const mpz_t v, int n)
+{
+	mp_limb_t l[n];
+	const mp_limb_t *p = mpz_limbs_read(v);
+	int size = mpz_size(v);
+	for (int i = 0; i < n; i++) {
+		l[i] = (i < size) ? p[i] : 0;
+	}
+	buffer_from_limbs(buffer, l, n);
+}
+
 static void mpz_from_buffer(mpz_t *val, const struct ecc_curve *curve, const uint8_t *buffer)
 {
 	mpz_init(*val);
@@ -72,15 +85,38 @@ static void mpz_from_buffer(mpz_t *val, const struct ecc_curve *curve, const uin
 	mpz_limbs_finish(*val, ecc_size(curve));
 }
 
+static void scalar_from_key_buffer(const struct ecc_curve *curve, struct ecc_scalar *key, const uint8_t *key_buffer)
+{
+	mpz_t val;
+	mpz_from_buffer(&val, curve, key_buffer);
+	ecc_scalar_init(key, curve);
+	ecc_scalar_set(key, val);
+	mpz_clear(val);
+}
+
 void crypto_sha256_init()
 {
     sha256_init(&sha256_ctx);
 }
 
+//HMAC contexts keyed with the master and transport secrets. Restoring these
+//skips hashing the padded key blocks on every credential derivation and tag check
+static struct hmac_sha256_ctx master_hmac_ctx;
+static struct hmac_sha256_ctx transport_hmac_ctx;
+static int secret_hmac_ctx_valid = 0;
+
+static void secret_hmac_ctx_init()
+{
+	hmac_sha256_set_key(&master_hmac_ctx, sizeof(master_secret), master_secret);
+	hmac_sha256_set_key(&transport_hmac_ctx, sizeof(transport_secret), transport_secret);
+	secret_hmac_ctx_valid = 1;
+}
+
 void crypto_reset_master_secret()
 {
     ctap_generate_rng(master_secret, 64);
     ctap_generate_rng(transport_secret, 32);
+    secret_hmac_ctx_init();
 }
 
 void crypto_load_master_secret(uint8_t * key)
@@ -90,6 +126,7 @@ void crypto_load_master_secret(uint8_t * key)
     #endif
     memmove(master_secret, key, 64);
     memmove(transport_secret, key+64, 32);
+    secret_hmac_ctx_init();
 }
 
 void crypto_sha256_update(uint8_t * data, size_t len)
@@ -114,6 +151,11 @@ void crypto_sha256_hmac_update(const uint8_t *data, size_t length)
 
 void crypto_sha256_hmac_init(uint8_t * key, uint32_t klen, uint8_t * hmac)
 {
+    if (secret_hmac_ctx_valid && (key == CRYPTO_MASTER_KEY || key == CRYPTO_TRANSPORT_KEY))
+    {
+        memcpy(&hmac_sha256_ctx, (key == CRYPTO_MASTER_KEY) ? &master_hmac_ctx : &transport_hmac_ctx, sizeof(hmac_sha256_ctx));
+        return;
+    }
     if (key == CRYPTO_MASTER_KEY)
     {
         key = master_secret;
@@ -196,21 +238,15 @@ static void crypto_sign(const struct ecc_curve *curve, const uint8_t * data, int
 	struct dsa_signature signature_pt;
 	struct ecc_scalar signing_key_pt;
 	dsa_signature_init(&signature_pt);
+	scalar_from_key_buffer(curve, &signing_key_pt, _signing_key);
 
-	mpz_t val;
-	mpz_from_buffer(&val, _es256_curve, _signing_key);
-	ecc_scalar_init(&signing_key_pt, _es256_curve);
-	ecc_scalar_set(&signing_key_pt, val);
 	ecdsa_sign(&signing_key_pt,
 		NULL, crypto_random_func,
 		len, data,
 		&signature_pt);
 
-	const mp_limb_t *rp = mpz_limbs_read(signature_pt.r);
-	const mp_limb_t *sp = mpz_limbs_read(signature_pt.s);
-
-	buffer_from_limbs(sig, rp, 8);
-	buffer_from_limbs(sig + 32, sp, 8);
+	buffer_from_mpz(sig, signature_pt.r, ecc_size(curve));
+	buffer_from_mpz(sig + 32, signature_pt.s, ecc_size(curve));
 	ecc_scalar_clear(&signing_key_pt);
 	dsa_signature_clear(&signature_pt);
 }
@@ -285,14 +321,6 @@ void generate_private_key(uint8_t * data, int len, uint8_t * data2, int len2, ui
 	crypto_sha256_hmac_final(CRYPTO_MASTER_KEY, 0, privkey);
 }
 
-static void scalar_from_key_buffer(const struct ecc_curve *curve, struct ecc_scalar *key, const uint8_t *key_buffer)
-{
-	mpz_t val;
-	mpz_from_buffer(&val, curve, key_buffer);
-	ecc_scalar_init(key, curve);
-	ecc_scalar_set(key, val);
-}
-
 static void crypto_compute_public_key(const struct ecc_curve *curve, const uint8_t *privkey, uint8_t *pubkey)
 {
 	struct ecc_point pub_pt;
@@ -305,11 +333,8 @@ static void crypto_compute_public_key(const struct ecc_curve *curve, const uint8
 	mpz_init(x);
 	mpz_init(y);
 	ecc_point_get(&pub_pt, x, y);
-	const mp_limb_t *xp = mpz_limbs_read(x);
-	const mp_limb_t *yp = mpz_limbs_read(y);
-	int i;
-	buffer_from_limbs(pubkey, xp, 8);
-	buffer_from_limbs(pubkey + 32, yp, 8);
+	buffer_from_mpz(pubkey, x, ecc_size(curve));
+	buffer_from_mpz(pubkey + 32, y, ecc_size(curve));
 	mpz_clear(x);
 	mpz_clear(y);
 	ecc_scalar_clear(&priv_scalar);
@@ -351,19 +376,74 @@ void crypto_ecc256_make_key_pair(uint8_t * pubkey, uint8_t * privkey)
 	mpz_init(x);
 	mpz_init(y);
 	ecc_point_get(&pub_pt, x, y);
-	const mp_limb_t *xp = mpz_limbs_read(x);
-	const mp_limb_t *yp = mpz_limbs_read(y);
-	int i;
-	buffer_from_limbs(pubkey, xp, 8);
-	buffer_from_limbs(pubkey + 32, yp, 8);
+	buffer_from_mpz(pubkey, x, ecc_size(_es256_curve));
+	buffer_from_mpz(pubkey + 32, y, ecc_size(_es256_curve));
 	mpz_clear(x);
 	mpz_clear(y);
 
-	buffer_from_limbs(privkey, key_scalar.p, 8);
+	buffer_from_limbs(privkey, key_scalar.p, ecc_size(_es256_curve));
 	ecc_scalar_clear(&key_scalar);
 	ecc_point_clear(&pub_pt);
 }
 
+//Key agreement pairs generated ahead of time from the main loop so that
+//getKeyAgreement and PIN failures don't have to wait for a fresh pair
+#ifndef ECC256_KEY_POOL_SIZE
+#define ECC256_KEY_POOL_SIZE (2)
+#endif
+
+struct ecc256_key_pool_ent {
+	uint8_t pubkey[64];
+	uint8_t privkey[32];
+};
+
+static struct ecc256_key_pool_ent ecc256_key_pool[ECC256_KEY_POOL_SIZE];
+static int ecc256_key_pool_count = 0;
+
+int crypto_ecc256_pool_needs_fill()
+{
+	return ecc256_key_pool_count < ECC256_KEY_POOL_SIZE;
+}
+
+void crypto_ecc256_pool_fill()
+{
+	if (!crypto_ecc256_pool_needs_fill())
+		return;
+	//Don't disturb the entropy accounting of the next CTAP command
+	int requested = s_random_requested;
+	int served = s_random_served;
+	s_random_requested = 0;
+	s_random_served = 0;
+	struct ecc256_key_pool_ent *ent = ecc256_key_pool + ecc256_key_pool_count;
+	crypto_ecc256_make_key_pair(ent->pubkey, ent->privkey);
+	if (s_random_served == s_random_requested) {
+		ecc256_key_pool_count++;
+	} else {
+		memset(ent, 0, sizeof(*ent));
+	}
+	s_random_requested = requested;
+	s_random_served = served;
+}
+
+//Returns 1 if a pre-generated pair was available
+int crypto_ecc256_pool_take(uint8_t * pubkey, uint8_t * privkey)
+{
+	if (!ecc256_key_pool_count)
+		return 0;
+	ecc256_key_pool_count--;
+	struct ecc256_key_pool_ent *ent = ecc256_key_pool + ecc256_key_pool_count;
+	memcpy(pubkey, ent->pubkey, 64);
+	memcpy(privkey, ent->privkey, 32);
+	memset(ent, 0, sizeof(*ent));
+	return 1;
+}
+
+void crypto_ecc256_pool_clear()
+{
+	memset(ecc256_key_pool, 0, sizeof(ecc256_key_pool));
+	ecc256_key_pool_count = 0;
+}
+
 void crypto_ecc256_shared_secret(const uint8_t * pubkey, const uint8_t * privkey, uint8_t * shared_secret)
 {
 	struct ecc_point pubkey_point;
@@ -385,9 +465,7 @@ void crypto_ecc256_shared_secret(const uint8_t * pubkey, const uint8_t * privkey
 	mpz_init(sx);
 	mpz_init(sy);
 	ecc_point_get(&result, sx, sy);
-	const mp_limb_t *sxp = mpz_limbs_read(sx);
-	int i;
-	buffer_from_limbs(shared_secret, sxp, 8);
+	buffer_from_mpz(shared_secret, sx, ecc_size(_es256_curve));
 	mpz_clear(sx);
 	mpz_clear(sy);
 
@@ -38,6 +38,15 @@ void crypto_ecdsa_sign(uint8_t * data, int len, uint8_t * sig, int MBEDTLS_ECP_I
 
 void generate_private_key(uint8_t * data, int len, uint8_t * data2, int len2, uint8_t * privkey);
 void crypto_ecc256_make_key_pair(uint8_t * pubkey, uint8_t * privkey);
+//Words of entropy that must be available before the main loop pre-generates
+//a key agreement pair. Leaves headroom for the next CTAP command.
+#ifndef ECC256_KEY_POOL_RAND_NEEDED
+#define ECC256_KEY_POOL_RAND_NEEDED (32)
+#endif
+int crypto_ecc256_pool_needs_fill();
+void crypto_ecc256_pool_fill();
+int crypto_ecc256_pool_take(uint8_t * pubkey, uint8_t * privkey);
+void crypto_ecc256_pool_clear();
 void crypto_ecc256_shared_secret(const uint8_t * pubkey, const uint8_t * privkey, uint8_t * shared_secret);
 
 #define CRYPTO_TRANSPORT_KEY2            ((uint8_t*)2)
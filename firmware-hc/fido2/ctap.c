@@ -1547,13 +1547,7 @@ uint8_t ctap_client_pin(CborEncoder * encoder, uint8_t * request, int length)
             ret = cbor_encode_int(&map, RESP_keyAgreement);
             check_ret(ret);
 
-	    //HC_TODO: We don't need the line below because we don't use NFC
-            //if (device_is_nfc() == NFC_IS_ACTIVE) device_set_clock_rate(DEVICE_LOW_POWER_FAST);
-
-	    crypto_ecc256_compute_public_key(KEY_AGREEMENT_PRIV, KEY_AGREEMENT_PUB);
-
-	    //HC_TODO: We don't need the line below because we don't use NFC
-            //if (device_is_nfc() == NFC_IS_ACTIVE) device_set_clock_rate(DEVICE_LOW_POWER_IDLE);
+	    //KEY_AGREEMENT_PUB is always set together with KEY_AGREEMENT_PRIV
             ret = ctap_add_cose_key(&map, KEY_AGREEMENT_PUB, KEY_AGREEMENT_PUB+32, PUB_KEY_CRED_PUB_KEY, COSE_ALG_ECDH_ES_HKDF_256);
             check_retr(ret);
 
@@ -2068,12 +2062,16 @@ int8_t ctap_load_key(uint8_t index, uint8_t * key)
 
 static void ctap_reset_key_agreement()
 {
-    crypto_ecc256_make_key_pair(KEY_AGREEMENT_PUB, KEY_AGREEMENT_PRIV);
+    if (!crypto_ecc256_pool_take(KEY_AGREEMENT_PUB, KEY_AGREEMENT_PRIV))
+    {
+        crypto_ecc256_make_key_pair(KEY_AGREEMENT_PUB, KEY_AGREEMENT_PRIV);
+    }
 }
 
 int ctap_reset()
 {
     ctap_state_init();
+    crypto_ecc256_pool_clear();
 
     if (ctap_generate_rng(PIN_TOKEN, PIN_TOKEN_SIZE) != 1)
     {
@@ -20,6 +20,7 @@
 #include "main.h"
 #include "commands.h"
 #include "memory_layout.h"
+#include "dcache.h"
 bool _up_disabled = false;
 
 int device_is_nfc()
@@ -132,7 +133,7 @@ void device_wink()
 	//HC_TODO: What are we supposed to do here?
 }
 
-static u8 ctaphid_tx_buffer[2048] __attribute__((aligned(4)));
+static u8 ctaphid_tx_buffer[2048] DMA_BUFFER __attribute__((aligned(4))); //Packets are sent from the ring with DMA
 static volatile int ctap_hid_bytes_read = 0;
 static volatile int ctap_hid_bytes_write = 0;
 
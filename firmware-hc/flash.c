@@ -5,9 +5,11 @@
 #include "memory_layout.h"
 #include "main.h"
 #include "config.h"
+#include "dcache.h"
 
 enum flash_state {
 	FLASH_IDLE,
+	FLASH_RESERVED,
 	FLASH_ERASING,
 	FLASH_WRITING
 };
@@ -128,6 +130,7 @@ void flash_idle()
 
 	switch (flash_state) {
 	case FLASH_IDLE:
+	case FLASH_RESERVED:
 		break;
 	case FLASH_ERASING:
 		HAL_FLASH_Unlock();
@@ -137,6 +140,9 @@ void flash_idle()
 		et.VoltageRange = FLASH_VOLTAGE_RANGE_3;
 		status = HAL_FLASHEx_Erase(&et, &bs);
 		assert(status == HAL_OK);
+		//Flash reads are cached so lines holding the old contents must be discarded
+		dcache_invalidate((void *)flash_sector_to_addr(flash_erase_sector),
+		                  flash_sector_to_addr(flash_erase_sector + 1) - flash_sector_to_addr(flash_erase_sector));
 		if (flash_write_length) {
 			flash_state = FLASH_WRITING;
 		} else {
@@ -146,7 +152,8 @@ void flash_idle()
 			flash_write_complete();
 		}
 		break;
-	case FLASH_WRITING:
+	case FLASH_WRITING: {
+		u32 start = flash_write_dest;
 		for (int i = 0; i < 16 && flash_write_length > 0; i++) {
 			status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, flash_write_dest, *flash_write_src);
 			assert(status == HAL_OK);
@@ -154,13 +161,14 @@ void flash_idle()
 			flash_write_src++;
 			flash_write_dest += 4;
 		}
+		dcache_invalidate((void *)start, flash_write_dest - start);
 		if (flash_write_length == 0) {
 			flash_state = FLASH_IDLE;
 			END_WORK(FLASH_WORK);
 			HAL_FLASH_Lock();
 			flash_write_complete();
 		}
-		break;
+	} break;
 	}
 }
 
@@ -181,9 +189,16 @@ int flash_write (u8 *dest, const u8 *src, int count)
 	return 0;
 }
 
+//Keeps the flash busy until the caller starts a write with flash_write_page()
+void flash_reserve()
+{
+	assert(flash_state == FLASH_IDLE);
+	flash_state = FLASH_RESERVED;
+}
+
 void flash_write_page (u8 *dest, const u8 *src, int count)
 {
-	if (flash_state == FLASH_IDLE) {
+	if (flash_state == FLASH_IDLE || flash_state == FLASH_RESERVED) {
 		flash_write_dest = (u32)dest;
 		flash_write_src = (u32 *)src;
 		flash_write_length = count;
@@ -3,6 +3,7 @@
 #include "types.h"
 #include "signetdev_hc_common.h"
 
+void flash_reserve();
 void flash_write_page(u8 *dest, const u8 *src, int count);
 int flash_write(u8 *dest, const u8 *src, int count);
 u32 flash_sector_to_addr(int x);
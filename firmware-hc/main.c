@@ -15,6 +15,7 @@
 #include "fido2/crypto.h"
 #include "fido2/ctaphid.h"
 #include "memory_layout.h"
+#include "dcache.h"
 
 void ctaphid_press();
 void ctaphid_idle();
@@ -91,7 +92,8 @@ static void MX_DMA_Init(void);
 #define USB_BULK_BUFFER_SIZE (16384)
 #define USB_BULK_BUFFER_COUNT (4)
 
-static uint8_t g_usbBulkBuffer[USB_BULK_BUFFER_SIZE * USB_BULK_BUFFER_COUNT] __attribute__((aligned(16)));
+//Storage data moves between USB, the eMMC and CRYP with DMA
+static uint8_t g_usbBulkBuffer[USB_BULK_BUFFER_SIZE * USB_BULK_BUFFER_COUNT] BULK_BUFFER;
 struct bufferFIFO usbBulkBufferFIFO;
 
 static int g_ms_last_pressed = 0;
@@ -419,8 +421,7 @@ static int emmc_compare_test(const u8 *write_block, u8 *read_block, int blink_of
 int main (void)
 {
 	SCB_EnableICache();
-	//We don't enable DCACHE tp ensure coherency for DMA transfers
-	//SCB_EnableDCache();
+	dcache_init();
 	HAL_Init();
 	SystemClock_Config();
 	MX_GPIO_Init();
@@ -437,6 +438,9 @@ int main (void)
 	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
 	DWT->CYCCNT = 0;
 	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#if ENABLE_DCACHE_BENCHMARK
+	dcache_benchmark();
+#endif
 
 	__HAL_RCC_CRC_CLK_ENABLE();
 	crc_init();
@@ -515,6 +519,7 @@ int main (void)
 		memset(usbBulkBufferFIFO.bufferStorage, 0x80, BLK_SIZE);
 		write_root_block(usbBulkBufferFIFO.bufferStorage, BLK_SIZE);
 		do {
+			crc_idle();
 			flash_idle();
 		} while(!is_flash_idle());
 		busy_blink(300,300);
@@ -560,6 +565,7 @@ int main (void)
 		if (sync_root_block_pending()) {
 			sync_root_block_immediate();
 			while (flash_idle_ready()) {
+				crc_idle();
 				flash_idle();
 			}
 		}
@@ -606,19 +612,34 @@ int main (void)
 				g_ctap_initialized = 1;
 				release_device_request(CTAP_STARTUP_SUBSYSTEM);
 			}
-		} else if (!work_to_do) {
-			HAL_SuspendTick();
+		} else if (!work_to_do && g_ctap_initialized && crypto_ecc256_pool_needs_fill() &&
+				rand_avail() >= ECC256_KEY_POOL_RAND_NEEDED && !rand_rewind_point_set() &&
+				device_subsystem_owner() == NO_SUBSYSTEM) {
+			//Nothing else to do so generate a key agreement pair ahead of time
+			work_to_do = 1;
+			__enable_irq();
+			crypto_ecc256_pool_fill();
+		} else if (!(work_to_do & ~TICK_WORK)) {
+			if (!work_to_do) {
+				HAL_SuspendTick();
+			}
 			__asm__("wfi");
-			HAL_ResumeTick();
+			if (!work_to_do) {
+				HAL_ResumeTick();
+			}
 			__enable_irq();
 		} else {
 			__enable_irq();
 		}
 #else
-		if (!work_to_do) {
-			HAL_SuspendTick();
+		if (!(work_to_do & ~TICK_WORK)) {
+			if (!work_to_do) {
+				HAL_SuspendTick();
+			}
 			__asm__("wfi");
-			HAL_ResumeTick();
+			if (!work_to_do) {
+				HAL_ResumeTick();
+			}
 		}
 		__enable_irq();
 #endif
@@ -660,9 +681,15 @@ int main (void)
 		usb_keyboard_idle();
 		blink_idle();
 		command_idle();
+		emmc_idle();
 		if (sync_root_block_pending() && is_flash_idle() && !sync_root_block_writing()) {
 			sync_root_block_immediate();
 		}
+#ifdef BOOT_MODE_B
+		db_index_idle();
+		db_cryp_idle();
+#endif
+		crc_idle();
 		flash_idle();
 		usbd_scsi_idle();
 		int current_button_state = buttonState() ? 0 : 1;
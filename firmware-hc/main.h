@@ -52,6 +52,17 @@ int is_ctap_initialized();
 #define MMC_IDLE_WORK (1<<15)
 #endif
 
+#define DB_INDEX_SYNC_WORK (1<<16)
+#define CMD_PACKET_SENT_WORK (1<<17)
+#define CRC_WORK (1<<18)
+#define DB_CRYP_WORK (1<<19)
+#define MMC_READY_WORK (1<<20)
+#define SCSI_WRITE_CACHE_WORK (1<<21)
+
+//Work that only needs to run once per HAL_GetTick() tick. When nothing else is
+//pending the main loop sleeps with SysTick running instead of spinning
+#define TICK_WORK (MMC_READY_WORK)
+
 extern volatile int g_work_to_do;
 
 #define BEGIN_WORK(w) do {\
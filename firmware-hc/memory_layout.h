@@ -6,6 +6,10 @@
 #include "fido2/ctap.h"
 #include "fido2/storage.h"
 
+//Places zero initialized data that only the CPU accesses in ITCM RAM. The startup
+//code clears it along with .bss
+#define ITCM_DATA __attribute__((section(".bss.itcm_data")))
+
 #define FLASH_BASE_ADDR (0x8000000)
 #define BOOT_AREA_A (0x8008000)
 #define BOOT_AREA_B (0x8020000)
@@ -93,6 +97,7 @@ enum hc_firmware_upgrade_state {
 #define HC_VOLUME_FLAG_ENCRYPTED (1<<8)
 #define HC_VOLUME_FLAG_USE_KEYSTORE (1<<9)
 #define HC_VOLUME_FLAG_VIRTUAL (1<<10)
+#define HC_VOLUME_FLAG_XTS (1<<11) //Encrypted with XTS-AES-128 instead of CBC per sector
 
 struct hc_volume {
 	u32 flags;
@@ -113,7 +118,7 @@ struct hc_device_data {
 	u16 db_format;
 
 	u16 data_iteration; //larger is newer
-	u16 reserved;
+	u16 db_epoch; //Changes whenever DB change generations are lost
 	u8 device_id[DEVICE_ID_LEN];
 	u8 device_name[DEVICE_NAME_LEN];
 
@@ -77,6 +77,11 @@ void rand_clear_rewind_point()
 	rtc_rand_irq_enable(1);
 }
 
+int rand_rewind_point_set()
+{
+	return rtc_rand_state.rewind_tail >= 0 || rng_rand_state.rewind_tail >= 0;
+}
+
 void rand_push(enum rand_src _src, u32 val)
 {
 	struct rand_src_state *src;
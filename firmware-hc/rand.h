@@ -10,6 +10,7 @@ u32 rand_get();
 void rand_set_rewind_point();
 void rand_rewind();
 void rand_clear_rewind_point();
+int rand_rewind_point_set();
 
 enum rand_owner {
 	RAND_OWNER_COMMAND,
@@ -1,7 +1,6 @@
 #include <memory.h>
 #include "signet_aes.h"
 
-#include "nettle/aes.h"
 #include "signetdev_common.h"
 
 void signet_aes_init()
@@ -34,38 +33,41 @@ void xor_block(const u8 *src_block, const u8 *mask, u8 *dst_block)
 	}
 }
 
-void signet_aes_128_encrypt_cbc(const u8 *key, int n_blocks, const u8 *iv, const u8 *din, u8 *dout)
+//
+// CBC helpers. The key is expanded once per call instead of once per block
+//
+static void aes_128_encrypt_cbc(const struct aes128_ctx *ctx, int n_blocks, const u8 *iv, const u8 *din, u8 *dout)
 {
 	int i;
 	for (i = 0; i < n_blocks; i++) {
 		u8 temp[AES_BLK_SIZE];
 		xor_block(din, iv, temp);
-		signet_aes_128_encrypt(key, temp, dout);
+		aes128_encrypt(ctx, AES_BLK_SIZE, dout, temp);
 		iv = dout;
 		din += AES_BLK_SIZE;
 		dout += AES_BLK_SIZE;
 	}
 }
 
-void signet_aes_256_encrypt_cbc(const u8 *key, int n_blocks, const u8 *iv, const u8 *din, u8 *dout)
+static void aes_256_encrypt_cbc(const struct aes256_ctx *ctx, int n_blocks, const u8 *iv, const u8 *din, u8 *dout)
 {
 	int i;
 	for (i = 0; i < n_blocks; i++) {
 		u8 temp[AES_BLK_SIZE];
 		xor_block(din, iv, temp);
-		signet_aes_256_encrypt(key, temp, dout);
+		aes256_encrypt(ctx, AES_BLK_SIZE, dout, temp);
 		iv = dout;
 		din += AES_BLK_SIZE;
 		dout += AES_BLK_SIZE;
 	}
 }
 
-void signet_aes_128_decrypt_cbc(const u8 *key, int n_blocks, const u8 *iv, const u8 *din, u8 *dout)
+static void aes_128_decrypt_cbc(const struct aes128_ctx *ctx, int n_blocks, const u8 *iv, const u8 *din, u8 *dout)
 {
 	int i;
 	for (i = 0; i < n_blocks; i++) {
 		u8 temp[AES_BLK_SIZE];
-		signet_aes_128_decrypt(key, din, temp);
+		aes128_decrypt(ctx, AES_BLK_SIZE, temp, din);
 		xor_block(temp, iv, dout);
 		iv = din;
 		din += AES_BLK_SIZE;
@@ -73,19 +75,138 @@ void signet_aes_128_decrypt_cbc(const u8 *key, int n_blocks, const u8 *iv, const
 	}
 }
 
-void signet_aes_256_decrypt_cbc(const u8 *key, int n_blocks, const u8 *iv, const u8 *din, u8 *dout)
+//'din' and 'dout' may be the same buffer. A NULL 'iv' is treated as zero like in xor_block()
+static void aes_256_decrypt_cbc(const struct aes256_ctx *ctx, int n_blocks, const u8 *iv, const u8 *din, u8 *dout)
 {
 	int i;
+	u8 prev[AES_BLK_SIZE];
+	if (iv) {
+		memcpy(prev, iv, AES_BLK_SIZE);
+	} else {
+		memset(prev, 0, AES_BLK_SIZE);
+	}
 	for (i = 0; i < n_blocks; i++) {
 		u8 temp[AES_BLK_SIZE];
-		signet_aes_256_decrypt(key, din, temp);
-		xor_block(temp, iv, dout);
-		iv = din;
+		u8 cyphertext[AES_BLK_SIZE];
+		memcpy(cyphertext, din, AES_BLK_SIZE);
+		aes256_decrypt(ctx, AES_BLK_SIZE, temp, din);
+		xor_block(temp, prev, dout);
+		memcpy(prev, cyphertext, AES_BLK_SIZE);
 		din += AES_BLK_SIZE;
 		dout += AES_BLK_SIZE;
 	}
 }
 
+void signet_aes_128_encrypt_cbc(const u8 *key, int n_blocks, const u8 *iv, const u8 *din, u8 *dout)
+{
+	struct aes128_ctx ctx;
+	aes128_set_encrypt_key(&ctx, key);
+	aes_128_encrypt_cbc(&ctx, n_blocks, iv, din, dout);
+}
+
+void signet_aes_256_encrypt_cbc(const u8 *key, int n_blocks, const u8 *iv, const u8 *din, u8 *dout)
+{
+	struct aes256_ctx ctx;
+	aes256_set_encrypt_key(&ctx, key);
+	aes_256_encrypt_cbc(&ctx, n_blocks, iv, din, dout);
+}
+
+void signet_aes_128_decrypt_cbc(const u8 *key, int n_blocks, const u8 *iv, const u8 *din, u8 *dout)
+{
+	struct aes128_ctx ctx;
+	aes128_set_decrypt_key(&ctx, key);
+	aes_128_decrypt_cbc(&ctx, n_blocks, iv, din, dout);
+}
+
+void signet_aes_256_decrypt_cbc(const u8 *key, int n_blocks, const u8 *iv, const u8 *din, u8 *dout)
+{
+	struct aes256_ctx ctx;
+	aes256_set_decrypt_key(&ctx, key);
+	aes_256_decrypt_cbc(&ctx, n_blocks, iv, din, dout);
+}
+
+void signet_aes_256_ctx_init(struct signet_aes_256_ctx *ctx, const u8 *key)
+{
+	aes256_set_encrypt_key(&ctx->encrypt, key);
+	aes256_invert_key(&ctx->decrypt, &ctx->encrypt);
+}
+
+void signet_aes_256_ctx_clear(struct signet_aes_256_ctx *ctx)
+{
+	memset(ctx, 0, sizeof(*ctx));
+}
+
+void signet_aes_256_ctx_encrypt_cbc(const struct signet_aes_256_ctx *ctx, int n_blocks, const u8 *iv, const u8 *din, u8 *dout)
+{
+	aes_256_encrypt_cbc(&ctx->encrypt, n_blocks, iv, din, dout);
+}
+
+void signet_aes_256_ctx_decrypt_cbc(const struct signet_aes_256_ctx *ctx, int n_blocks, const u8 *iv, const u8 *din, u8 *dout)
+{
+	aes_256_decrypt_cbc(&ctx->decrypt, n_blocks, iv, din, dout);
+}
+
+void signet_aes_128_xts_init(struct signet_aes_128_xts_ctx *ctx, const u8 *key)
+{
+	aes128_set_encrypt_key(&ctx->encrypt, key);
+	aes128_invert_key(&ctx->decrypt, &ctx->encrypt);
+	aes128_set_encrypt_key(&ctx->tweak, key + AES_128_KEY_SIZE);
+}
+
+//Computes the tweak of the first block of 'data_unit'. 'tweak' is four words
+void signet_aes_128_xts_tweak(const struct signet_aes_128_xts_ctx *ctx, u32 data_unit, u32 *tweak)
+{
+	u8 t[AES_BLK_SIZE];
+	memset(t, 0, AES_BLK_SIZE);
+	for (int i = 0; i < 4; i++) {
+		t[i] = (data_unit >> (i * 8)) & 0xff;
+	}
+	aes128_encrypt(&ctx->tweak, AES_BLK_SIZE, t, t);
+	memcpy(tweak, t, AES_BLK_SIZE);
+}
+
+//
+// XORs 'n_blocks' consecutive blocks with 'tweak' multiplied by successive powers
+// of x in GF(2^128). The buffers must be word aligned and may be the same
+//
+void signet_aes_128_xts_whiten(const u32 *tweak, int n_blocks, const u8 *din, u8 *dout)
+{
+	const u32 *src = (const u32 *)din;
+	u32 *dst = (u32 *)dout;
+	u32 t0 = tweak[0], t1 = tweak[1], t2 = tweak[2], t3 = tweak[3];
+	for (int i = 0; i < n_blocks; i++) {
+		dst[0] = src[0] ^ t0;
+		dst[1] = src[1] ^ t1;
+		dst[2] = src[2] ^ t2;
+		dst[3] = src[3] ^ t3;
+		src += 4;
+		dst += 4;
+		u32 carry = t3 >> 31;
+		t3 = (t3 << 1) | (t2 >> 31);
+		t2 = (t2 << 1) | (t1 >> 31);
+		t1 = (t1 << 1) | (t0 >> 31);
+		t0 = (t0 << 1) ^ (carry ? 0x87 : 0);
+	}
+}
+
+void signet_aes_128_xts_encrypt(const struct signet_aes_128_xts_ctx *ctx, u32 data_unit, int n_blocks, const u8 *din, u8 *dout)
+{
+	u32 tweak[AES_BLK_SIZE/4];
+	signet_aes_128_xts_tweak(ctx, data_unit, tweak);
+	signet_aes_128_xts_whiten(tweak, n_blocks, din, dout);
+	aes128_encrypt(&ctx->encrypt, n_blocks * AES_BLK_SIZE, dout, dout);
+	signet_aes_128_xts_whiten(tweak, n_blocks, dout, dout);
+}
+
+void signet_aes_128_xts_decrypt(const struct signet_aes_128_xts_ctx *ctx, u32 data_unit, int n_blocks, const u8 *din, u8 *dout)
+{
+	u32 tweak[AES_BLK_SIZE/4];
+	signet_aes_128_xts_tweak(ctx, data_unit, tweak);
+	signet_aes_128_xts_whiten(tweak, n_blocks, din, dout);
+	aes128_decrypt(&ctx->decrypt, n_blocks * AES_BLK_SIZE, dout, dout);
+	signet_aes_128_xts_whiten(tweak, n_blocks, dout, dout);
+}
+
 void signet_aes_128_decrypt(const u8 *key, const u8 *din, u8 *dout)
 {
 	struct aes128_ctx ctx;
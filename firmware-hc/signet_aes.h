@@ -2,6 +2,27 @@
 #define SIGNET_AES_H
 
 #include "types.h"
+#include "nettle/aes.h"
+
+//
+// Key schedules for a 256 bit key. Use the signet_aes_256_ctx_*() functions when
+// the same key is used repeatedly so the key is only expanded once
+//
+struct signet_aes_256_ctx {
+	struct aes256_ctx encrypt;
+	struct aes256_ctx decrypt;
+};
+
+//
+// XTS-AES-128 (IEEE 1619). The key is Key1 followed by Key2. Every AES block of a
+// data unit is whitened with its own tweak so blocks are independent of each other.
+// This lets the AES-ECB step run over many data units at once
+//
+struct signet_aes_128_xts_ctx {
+	struct aes128_ctx encrypt;
+	struct aes128_ctx decrypt;
+	struct aes128_ctx tweak;
+};
 
 void signet_aes_init();
 void signet_aes_128_encrypt(const u8 *key, const u8 *din, u8 *dout);
@@ -13,4 +34,15 @@ void signet_aes_256_decrypt(const u8 *key, const u8 *din, u8 *dout);
 void signet_aes_256_decrypt_cbc(const u8 *key, int n_blocks, const u8 *iv, const u8 *din, u8 *dout);
 void signet_aes_256_encrypt_cbc(const u8 *key, int n_blocks, const u8 *iv, const u8 *din, u8 *dout);
 
+void signet_aes_256_ctx_init(struct signet_aes_256_ctx *ctx, const u8 *key);
+void signet_aes_256_ctx_clear(struct signet_aes_256_ctx *ctx);
+void signet_aes_256_ctx_decrypt_cbc(const struct signet_aes_256_ctx *ctx, int n_blocks, const u8 *iv, const u8 *din, u8 *dout);
+void signet_aes_256_ctx_encrypt_cbc(const struct signet_aes_256_ctx *ctx, int n_blocks, const u8 *iv, const u8 *din, u8 *dout);
+
+void signet_aes_128_xts_init(struct signet_aes_128_xts_ctx *ctx, const u8 *key);
+void signet_aes_128_xts_tweak(const struct signet_aes_128_xts_ctx *ctx, u32 data_unit, u32 *tweak);
+void signet_aes_128_xts_whiten(const u32 *tweak, int n_blocks, const u8 *din, u8 *dout);
+void signet_aes_128_xts_encrypt(const struct signet_aes_128_xts_ctx *ctx, u32 data_unit, int n_blocks, const u8 *din, u8 *dout);
+void signet_aes_128_xts_decrypt(const struct signet_aes_128_xts_ctx *ctx, u32 data_unit, int n_blocks, const u8 *din, u8 *dout);
+
 #endif
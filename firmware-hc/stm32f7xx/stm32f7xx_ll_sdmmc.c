@@ -727,12 +727,22 @@ uint32_t SDMMC_CmdEraseEndAdd(SDMMC_TypeDef *SDMMCx, uint32_t EndAdd)
   * @retval HAL status
   */
 uint32_t SDMMC_CmdErase(SDMMC_TypeDef *SDMMCx)
+{
+	return SDMMC_CmdEraseType(SDMMCx, 0U);
+}
+
+/**
+  * @brief  Send the Erase command with an erase type argument and check the response
+  * @param  SDMMCx Pointer to SDMMC register base
+  * @param  EraseType Argument of CMD38. 0 for an erase, 1 for an eMMC trim
+  * @retval HAL status
+  */
+uint32_t SDMMC_CmdEraseType(SDMMC_TypeDef *SDMMCx, uint32_t EraseType)
 {
 	SDMMC_CmdInitTypeDef  sdmmc_cmdinit;
 	uint32_t errorstate = SDMMC_ERROR_NONE;
 
-	/* Set Block Size for Card */
-	sdmmc_cmdinit.Argument         = 0;
+	sdmmc_cmdinit.Argument         = EraseType;
 	sdmmc_cmdinit.CmdIndex         = SDMMC_CMD_ERASE;
 	sdmmc_cmdinit.Response         = SDMMC_RESPONSE_SHORT;
 	sdmmc_cmdinit.WaitForInterrupt = SDMMC_WAIT_NO;
@@ -7,6 +7,7 @@
 #include "signetdev_common.h"
 #include "usbd_multi.h"
 #include "config.h"
+#include "dcache.h"
 
 #include "usbd_hid.h"
 
@@ -14,8 +15,9 @@ static const u8 *raw_hid_tx_data = NULL;
 static int raw_hid_tx_seq = 0;
 static int raw_hid_tx_count = 0;
 
-static u8 raw_hid_tx_cmd_packet[HID_CMD_EPIN_SIZE] __attribute__((aligned(16)));
-static u8 raw_hid_tx_event_packet[HID_CMD_EPIN_SIZE] __attribute__((aligned(16)));
+//Packets are sent with DMA from DTCM. cmd_resp and event data are copied into them so those can stay cached
+static u8 raw_hid_tx_cmd_packet[HID_CMD_EPIN_SIZE] DMA_BUFFER __attribute__((aligned(16)));
+static u8 raw_hid_tx_event_packet[HID_CMD_EPIN_SIZE] DMA_BUFFER __attribute__((aligned(16)));
 
 static u8 event_mask = 0;
 static const u8 *event_data[8];
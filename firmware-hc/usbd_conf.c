@@ -1,10 +1,11 @@
 #include "main.h"
 #include "usbd_multi.h"
 #include "usbd_msc.h"
+#include "dcache.h"
 
 #define CURSOR_STEP     5
 
-PCD_HandleTypeDef hpcd;
+PCD_HandleTypeDef hpcd DMA_BUFFER; //The core writes SETUP packets to hpcd.Setup with DMA
 __IO uint32_t remotewakeupon = 0;
 uint8_t HID_Buffer[4];
 extern USBD_HandleTypeDef USBD_Device;
@@ -229,6 +230,7 @@ USBD_StatusTypeDef USBD_LL_Transmit(USBD_HandleTypeDef *pdev,
                                     const uint8_t *pbuf,
                                     uint16_t size)
 {
+	dcache_clean(pbuf, size);
 	HAL_PCD_EP_Transmit(pdev->pData, ep_addr, pbuf, size);
 	return USBD_OK;
 }
@@ -238,6 +240,8 @@ USBD_StatusTypeDef USBD_LL_PrepareReceive(USBD_HandleTypeDef *pdev,
                 uint8_t *pbuf,
                 uint16_t size)
 {
+	//Received data isn't invalidated so it must be written to a DMA_BUFFER
+	assert(!size || dcache_is_coherent(pbuf, size));
 	HAL_PCD_EP_Receive(pdev->pData, ep_addr, pbuf, size);
 	return USBD_OK;
 }
@@ -67,7 +67,7 @@ typedef struct _USBD_STORAGE {
 
 typedef struct {
 	uint32_t                 max_lun;
-	uint8_t                  bot_data[MSC_MEDIA_PACKET * 16] __attribute__((aligned(4)));
+	uint8_t                  bot_data[USBD_BOT_MAX_DATA] __attribute__((aligned(4)));
 	uint32_t                 interface;
 	uint16_t                 bot_data_length;
 	uint8_t                  bot_state;
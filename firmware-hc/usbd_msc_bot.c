@@ -120,7 +120,14 @@ void MSC_BOT_DataOut (USBD_HandleTypeDef  *pdev,
 
 	switch (hmsc->bot_state) {
 	case USBD_BOT_IDLE:
-		MSC_BOT_CBW_Decode(pdev);
+		__disable_irq();
+		if (usbd_scsi_storage_busy()) {
+			hmsc->bot_state = USBD_BOT_CBW_PENDING;
+			__enable_irq();
+		} else {
+			__enable_irq();
+			MSC_BOT_CBW_Decode(pdev);
+		}
 		break;
 
 	case USBD_BOT_DATA_OUT:
@@ -170,7 +177,8 @@ static void  MSC_BOT_CBW_Decode (USBD_HandleTypeDef  *pdev)
 		else if ((hmsc->bot_state != USBD_BOT_DATA_IN) &&
 		         (hmsc->bot_state != USBD_BOT_DATA_OUT) &&
 		         (hmsc->bot_state != USBD_BOT_LAST_DATA_IN) &&
-			 (hmsc->bot_state != USBD_BOT_SEND_DATA)) {
+			 (hmsc->bot_state != USBD_BOT_SEND_DATA) &&
+			 (hmsc->bot_state != USBD_BOT_CBW_PENDING)) {
 			if (hmsc->bot_data_length > 0U) {
 				MSC_BOT_SendData(pdev, hmsc->bot_data, hmsc->bot_data_length);
 			} else if (hmsc->bot_data_length == 0U) {
@@ -184,6 +192,22 @@ static void  MSC_BOT_CBW_Decode (USBD_HandleTypeDef  *pdev)
 	}
 }
 
+/**
+* @brief  MSC_BOT_ResumeCBW
+*         Decode a CBW that was held while storage I/O was in progress
+* @param  pdev: device instance
+* @retval None
+*/
+void MSC_BOT_ResumeCBW (USBD_HandleTypeDef  *pdev)
+{
+	USBD_MSC_BOT_HandleTypeDef  *hmsc = (USBD_MSC_BOT_HandleTypeDef*)pdev->pClassData[INTERFACE_MSC];
+
+	if (hmsc->bot_state == USBD_BOT_CBW_PENDING) {
+		hmsc->bot_state = USBD_BOT_IDLE;
+		MSC_BOT_CBW_Decode(pdev);
+	}
+}
+
 /**
 * @brief  MSC_BOT_SendData
 *         Send the requested data
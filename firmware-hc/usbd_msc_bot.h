@@ -47,6 +47,7 @@ extern "C" {
 #define USBD_BOT_LAST_DATA_IN              3U       /* Last Data In Last */
 #define USBD_BOT_SEND_DATA                 4U       /* Send Immediate data */
 #define USBD_BOT_NO_DATA                   5U       /* No data Stage */
+#define USBD_BOT_CBW_PENDING               6U       /* CBW held until read ahead or a cache flush is done */
 
 #define USBD_BOT_CBW_SIGNATURE             0x43425355U
 #define USBD_BOT_CSW_SIGNATURE             0x53425355U
@@ -128,6 +129,8 @@ void MSC_BOT_SendCSW (USBD_HandleTypeDef  *pdev,
 
 void  MSC_BOT_CplClrFeature (USBD_HandleTypeDef  *pdev,
                              uint8_t epnum);
+
+void MSC_BOT_ResumeCBW (USBD_HandleTypeDef  *pdev);
 /**
   * @}
   */
@@ -7,9 +7,9 @@ const uint8_t  MSC_Page00_Inquiry_Data[] = {
 	0x00,
 	0x00,
 	(LENGTH_INQUIRY_PAGE00 - 4U),
-	0x00,
-	0x80,
-	0x83
+	VPD_SUPPORTED_PAGES,
+	VPD_BLOCK_LIMITS,
+	VPD_LOGICAL_BLOCK_PROVISIONING
 };
 /* USB Mass storage sense 6  Data */
 const uint8_t  MSC_Mode_Sense6_data[] __attribute__((aligned(16))) = {
@@ -10,6 +10,11 @@ extern "C" {
 #define MODE_SENSE6_LEN                    8U
 #define MODE_SENSE10_LEN                   8U
 #define LENGTH_INQUIRY_PAGE00              7U
+#define LENGTH_INQUIRY_PAGE_B0             64U
+#define LENGTH_INQUIRY_PAGE_B2             8U
+#define VPD_SUPPORTED_PAGES                0x00U
+#define VPD_BLOCK_LIMITS                   0xB0U
+#define VPD_LOGICAL_BLOCK_PROVISIONING     0xB2U
 #define LENGTH_FORMAT_CAPACITIES           20U
 
 extern const uint8_t MSC_Page00_Inquiry_Data[];
@@ -8,6 +8,8 @@
 #include "usbd_multi.h"
 #include "memory_layout.h"
 #include "main.h"
+#include "signet_aes.h"
+#include "dcache.h"
 extern struct bufferFIFO usbBulkBufferFIFO;
 
 static int8_t SCSI_TestUnitReady(USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t *params);
@@ -21,6 +23,9 @@ static int8_t SCSI_ModeSense10 (USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t
 static int8_t SCSI_Write10(USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t *params);
 static int8_t SCSI_Read10(USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t *params);
 static int8_t SCSI_Verify10(USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t *params);
+static int8_t SCSI_SynchronizeCache(USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t *params);
+static int8_t SCSI_ReadCapacity16(USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t *params);
+static int8_t SCSI_Unmap(USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t *params);
 static int8_t SCSI_CheckAddressRange (USBD_HandleTypeDef *pdev, uint8_t lun,
                                       uint32_t blk_offset, uint32_t blk_nbr);
 
@@ -43,27 +48,167 @@ static volatile int mmcSubDataToTransfer;
 static volatile int mmcBlocksToTransfer;
 static volatile int mmcDataTransferred;
 
+//
+// Read ahead
+//
+// When a READ(10) continues a sequential stream, the device keeps reading
+// (and decrypting) the following blocks into the bulk buffers after the CSW
+// is sent. If the next READ(10) starts at that block, the eMMC and CRYP
+// stages are skipped for every buffer that is already there. Any other
+// command that uses the bulk buffers drops the read ahead.
+//
+// A CBW that arrives while a read ahead buffer is in progress is held by the
+// BOT layer. Once that buffer is done, no further buffers are started and
+// the CBW is decoded.
+//
+
+//Number of bulk buffers to read ahead. 0 disables read ahead
+#ifndef SCSI_READ_AHEAD_BUFFERS
+#define SCSI_READ_AHEAD_BUFFERS (4)
+#endif
+
+enum scsi_read_ahead_state {
+	READ_AHEAD_IDLE,
+	READ_AHEAD_READING,
+	READ_AHEAD_DECRYPTING
+};
+
+static struct {
+	volatile enum scsi_read_ahead_state state;
+	int valid; //Cleared when the bulk buffers are reused or the volumes change
+	int lun;
+	u32 blk_addr; //Block at the start of the first bulk buffer
+	int len; //Bytes read ahead so far
+	int max_len;
+} g_read_ahead;
+
+static int g_read_ahead_hit_len; //Bytes at the start of the current READ(10) that were read ahead
+static volatile int g_bulk_buffer_wipe; //A volume was hidden. Clear the bulk buffers once they are unused
+static int g_read_stream; //The current READ(10) started where the previous one ended
+static int g_read_stream_lun = -1;
+static u32 g_read_stream_end;
+
+struct scsi_read_ahead_stats g_scsi_read_ahead_stats;
+
+static void read_ahead_start(int lun, u32 blk_addr);
+
+//
+// Write cache
+//
+// A WRITE(10) that fits in one bulk buffer completes into a write back cache.
+// The cache holds one run of consecutive blocks, and writes that overlap or
+// are next to the run are merged into it. Data is cached after encryption,
+// so flushing is only an eMMC write. Reads copy cached blocks over the data
+// they get from the eMMC.
+//
+// The cache is flushed on SYNCHRONIZE CACHE, START STOP UNIT and PREVENT
+// ALLOW MEDIUM REMOVAL, when it is full, when a write can't be merged and
+// when nothing has been written to it for SCSI_WRITE_CACHE_FLUSH_MS. A command that
+// needs the flush sets USBD_BOT_CBW_PENDING and is decoded again when the
+// flush is done. FUA writes bypass the cache.
+//
+
+//Size of the write cache in blocks. A single write must fit in a bulk buffer to be cached
+#ifndef SCSI_WRITE_CACHE_BLOCKS
+#define SCSI_WRITE_CACHE_BLOCKS (16)
+#endif
+
+#ifndef SCSI_WRITE_CACHE_FLUSH_MS
+#define SCSI_WRITE_CACHE_FLUSH_MS (50)
+#endif
+
+static u8 g_write_cache_buf[SCSI_WRITE_CACHE_BLOCKS * 512] DMA_BUFFER __attribute__((aligned(16)));
+
+static struct {
+	volatile int flushing;
+	int lun;
+	u32 blk_addr;
+	u32 n_blocks; //0 when the cache is clean
+	u32 write_ms; //Time of the last write into the cache
+} g_write_cache;
+
+struct scsi_write_cache_stats g_scsi_write_cache_stats;
+
+static int write_cache_hold_cbw(USBD_MSC_BOT_HandleTypeDef *hmsc);
+
+//
+// Unmap
+//
+// READ CAPACITY(16) reports LBPME and the logical block provisioning VPD page
+// reports LBPU, so hosts can send UNMAP for blocks they no longer use. Each
+// range is trimmed on the eMMC. The card stays busy after a trim, so each
+// range is started as a separate eMMC request, and the request only starts
+// once the card is back in the transfer state.
+//
+// Unmapped blocks don't read back as zero (LBPRZ is clear). The card keeps
+// the data of a trimmed block until it reuses the block.
+//
+
+//Enough descriptors for the UNMAP parameter list to fit in bot_data
+#define SCSI_UNMAP_MAX_DESCRIPTORS ((USBD_BOT_MAX_DATA - 8)/16)
+
+struct scsi_unmap_range {
+	u32 blk_addr;
+	u32 blk_len;
+};
+
+static struct {
+	int lun;
+	int count; //Non-zero while an UNMAP is in progress
+	int idx;
+	struct scsi_unmap_range range[SCSI_UNMAP_MAX_DESCRIPTORS];
+} g_unmap;
+
+static int g_emmc_trim = 1; //Cleared if the card rejects a trim
+
+//Returns the eMMC block of a block in a volume
+static u32 storage_emmc_block(int lun, u32 blk_addr)
+{
+	return blk_addr +
+		(EMMC_STORAGE_FIRST_BLOCK * (HC_BLOCK_SZ/EMMC_SUB_BLOCK_SZ)) +
+		(g_scsi_volume[lun].region_start * g_scsi_region_size_blocks);
+}
+
+static u32 scsi_volume_blocks(int lun)
+{
+	return g_scsi_volume[lun].n_regions * g_scsi_region_size_blocks;
+}
+
 #ifdef BOOT_MODE_B
 
+//Maximum number of sectors in a bulk buffer. Must be at least USB_BULK_BUFFER_SIZE/512
+#ifndef SCSI_CRYP_MAX_SECTORS
+#define SCSI_CRYP_MAX_SECTORS (32)
+#endif
+
 static int g_cryptStageIdx;
 static int g_cryptTxLen;
 int g_cryptDataToTransfer;
 extern CRYP_HandleTypeDef hcryp;
-static u8 g_scsi_cur_aes_iv[AES_BLK_SIZE];
+static u32 g_scsi_aes_iv[SCSI_CRYP_MAX_SECTORS][AES_BLK_SIZE/4];
 static u32 g_scsi_cur_aes_sector;
 static u32 g_scsi_num_aes_sector;
+static volatile u32 g_scsi_aes_sector_idx;
 static u32 g_scsi_aes_encrypt;
+static int g_scsi_aes_xts; //Volume uses XTS-AES-128 instead of per sector CBC
+static struct signet_aes_128_xts_ctx g_scsi_xts_ctx;
+static u32 g_scsi_xts_key[AES_128_KEY_SIZE/4];
+static int g_scsi_xts_hw = -1; //-1 = not tested yet, 0 = software ECB, 1 = use CRYP
+static volatile int g_cryptXtsStart = 0;
 static u32 *g_scsi_aes_read;
 static u32 *g_scsi_aes_write;
 static CRYP_ConfigTypeDef g_scsi_aes_crypt_conf;
-static void set_crypt_config();
+static void set_crypt_config(int idx);
 
 #endif
 
 void usbd_scsi_device_state_change(enum device_state state)
 {
+	g_read_ahead.valid = 0;
+	g_read_stream_lun = -1;
 	for (int i = 0; i < g_num_scsi_volumes; i++) {
 		struct scsi_volume *v = g_scsi_volume + i;
+		int was_visible = v->visible;
 		if (!v->flags & HC_VOLUME_FLAG_VALID) {
 			v->visible = 0;
 			v->writable = 0;
@@ -113,6 +258,9 @@ void usbd_scsi_device_state_change(enum device_state state)
 				}
 			}
 		}
+		if (was_visible && !v->visible) {
+			g_bulk_buffer_wipe = 1;
+		}
 	}
 }
 
@@ -194,6 +342,19 @@ int8_t SCSI_ProcessCmd(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *cmd)
 		return SCSI_Verify10(pdev, lun, cmd);
 		break;
 
+	case SCSI_SYNCHRONIZE_CACHE10:
+	case SCSI_SYNCHRONIZE_CACHE16:
+		return SCSI_SynchronizeCache(pdev, lun, cmd);
+		break;
+
+	case SCSI_READ_CAPACITY16:
+		return SCSI_ReadCapacity16(pdev, lun, cmd);
+		break;
+
+	case SCSI_UNMAP:
+		return SCSI_Unmap(pdev, lun, cmd);
+		break;
+
 	default:
 		SCSI_SenseCode(pdev, lun, ILLEGAL_REQUEST, INVALID_CDB, 0);
 		hmsc->bot_data_length = 0U;
@@ -230,13 +391,39 @@ static int8_t  SCSI_Inquiry(USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t *par
 	USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef*) pdev->pClassData[INTERFACE_MSC];
 
 	if (params[1] & 0x01U) { /*Evpd is set*/
-		len = LENGTH_INQUIRY_PAGE00;
-		hmsc->bot_data_length = len;
-
-		while (len) {
-			len--;
-			hmsc->bot_data[len] = MSC_Page00_Inquiry_Data[len];
+		uint8_t *page = hmsc->bot_data;
+		uint16_t alloc_len = ((uint16_t)params[3] << 8) | params[4];
+		switch (params[2]) {
+		case VPD_SUPPORTED_PAGES:
+			len = LENGTH_INQUIRY_PAGE00;
+			memcpy(page, MSC_Page00_Inquiry_Data, len);
+			break;
+		case VPD_BLOCK_LIMITS:
+			len = LENGTH_INQUIRY_PAGE_B0;
+			memset(page, 0, len);
+			page[1] = VPD_BLOCK_LIMITS;
+			page[3] = (uint8_t)(len - 4U);
+			page[7] = (uint8_t)(usbBulkBufferFIFO.maxBufferSize/512); //Optimal transfer length granularity
+			page[20] = 0xff; //Maximum unmap LBA count: no limit
+			page[21] = 0xff;
+			page[22] = 0xff;
+			page[23] = 0xff;
+			page[27] = SCSI_UNMAP_MAX_DESCRIPTORS;
+			break;
+		case VPD_LOGICAL_BLOCK_PROVISIONING:
+			len = LENGTH_INQUIRY_PAGE_B2;
+			memset(page, 0, len);
+			page[1] = VPD_LOGICAL_BLOCK_PROVISIONING;
+			page[3] = (uint8_t)(len - 4U);
+			page[5] = 0x80; //LBPU: UNMAP is supported
+			break;
+		default:
+			SCSI_SenseCode(pdev, lun, ILLEGAL_REQUEST, INVALID_FIELED_IN_COMMAND, 0);
+			hmsc->bot_data_length = 0U;
+			hmsc->bot_state = USBD_BOT_NO_DATA;
+			return -1;
 		}
+		hmsc->bot_data_length = MIN(len, alloc_len);
 	} else {
 		pPage = (uint8_t *)(void *)&((USBD_StorageTypeDef *)pdev->pUserData)->pInquiry[0 * STANDARD_INQUIRY_DATA_LEN];
 		len = (uint16_t)pPage[4] + 5U;
@@ -286,6 +473,46 @@ static int8_t SCSI_ReadCapacity10(USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_
 	}
 }
 
+static u8 capacity16_resp[READ_CAPACITY16_DATA_LEN] __attribute__((aligned(16)));
+
+static int8_t SCSI_ReadCapacity16(USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t *params)
+{
+	USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef*) pdev->pClassData[INTERFACE_MSC];
+
+	if ((params[1] & 0x1fU) != SCSI_SA_READ_CAPACITY16) {
+		SCSI_SenseCode(pdev, lun, ILLEGAL_REQUEST, INVALID_FIELED_IN_COMMAND, 0);
+		hmsc->bot_data_length = 0U;
+		hmsc->bot_state = USBD_BOT_NO_DATA;
+		return -1;
+	}
+	if(((USBD_StorageTypeDef *)pdev->pUserData)->GetCapacity(lun, &hmsc->scsi_blk_nbr, &hmsc->scsi_blk_size) != 0) {
+		SCSI_SenseCode(pdev, lun, NOT_READY, MEDIUM_NOT_PRESENT, 0);
+		USBD_LL_StallEP(pdev, MSC_EPIN_ADDR);
+		hmsc->bot_data_length = 0U;
+		hmsc->bot_state = USBD_BOT_NO_DATA;
+		return -1;
+	} else {
+		u32 alloc_len = ((u32)params[10] << 24) | ((u32)params[11] << 16) | ((u32)params[12] << 8) | params[13];
+		memset(capacity16_resp, 0, READ_CAPACITY16_DATA_LEN);
+		capacity16_resp[4] = (uint8_t)((hmsc->scsi_blk_nbr - 1U) >> 24);
+		capacity16_resp[5] = (uint8_t)((hmsc->scsi_blk_nbr - 1U) >> 16);
+		capacity16_resp[6] = (uint8_t)((hmsc->scsi_blk_nbr - 1U) >>  8);
+		capacity16_resp[7] = (uint8_t)(hmsc->scsi_blk_nbr - 1U);
+		capacity16_resp[8] = (uint8_t)(hmsc->scsi_blk_size >>  24);
+		capacity16_resp[9] = (uint8_t)(hmsc->scsi_blk_size >>  16);
+		capacity16_resp[10] = (uint8_t)(hmsc->scsi_blk_size >>  8);
+		capacity16_resp[11] = (uint8_t)(hmsc->scsi_blk_size);
+		capacity16_resp[14] = 0x80; //LBPME: UNMAP is supported
+		uint16_t length = (uint16_t)MIN(MIN(hmsc->cbw.dDataLength, alloc_len), READ_CAPACITY16_DATA_LEN);
+		hmsc->csw.dDataResidue -= length;
+		hmsc->csw.bStatus = USBD_CSW_CMD_PASSED;
+		hmsc->bot_state = USBD_BOT_SEND_DATA;
+		hmsc->bot_data_length = 0;
+		USBD_LL_Transmit(pdev, MSC_EPIN_ADDR, capacity16_resp, length);
+		return 0;
+	}
+}
+
 static int8_t SCSI_ReadFormatCapacity(USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t *params)
 {
 	USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef*) pdev->pClassData[INTERFACE_MSC];
@@ -322,45 +549,66 @@ static int8_t SCSI_ReadFormatCapacity(USBD_HandleTypeDef  *pdev, uint8_t lun, ui
 	return 0;
 }
 
+//
+// Only the caching page is reported. Write cache enabled is always set and
+// none of its fields can be changed. DPOFUA is set because FUA writes bypass
+// the cache
+//
+#define MODE_SENSE_DPOFUA (0x10)
+#define MODE_PAGE_CACHING (0x08)
+#define MODE_PAGE_CACHING_LEN (20)
+#define MODE_PAGE_ALL (0x3f)
+
+static u8 mode_sense_resp[8 + MODE_PAGE_CACHING_LEN] __attribute__((aligned(16)));
+
+//Writes the requested mode pages to 'page' and returns their length
+static int mode_sense_pages(const uint8_t *params, u8 *page)
+{
+	int page_code = params[2] & 0x3f;
+	int page_control = params[2] >> 6;
+	if (page_code != MODE_PAGE_CACHING && page_code != MODE_PAGE_ALL) {
+		return 0;
+	}
+	memset(page, 0, MODE_PAGE_CACHING_LEN);
+	page[0] = MODE_PAGE_CACHING;
+	page[1] = MODE_PAGE_CACHING_LEN - 2;
+	if (page_control != 1) { //Changeable values are all zero
+		page[2] = 0x04; //WCE
+	}
+	return MODE_PAGE_CACHING_LEN;
+}
+
 static int8_t SCSI_ModeSense6 (USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t *params)
 {
 	USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef*) pdev->pClassData[INTERFACE_MSC];
-#if 0
-	uint16_t len = 8U;
-	hmsc->bot_data_length = len;
-
-	while (len) {
-		len--;
-		hmsc->bot_data[len] = MSC_Mode_Sense6_data[len];
-	}
-#endif
-	uint16_t length = (uint16_t)MIN(hmsc->cbw.dDataLength, 8U);
+	int len = 4 + mode_sense_pages(params, mode_sense_resp + 4);
+	mode_sense_resp[0] = (uint8_t)(len - 1);
+	mode_sense_resp[1] = 0;
+	mode_sense_resp[2] = MODE_SENSE_DPOFUA;
+	mode_sense_resp[3] = 0;
+	uint16_t length = (uint16_t)MIN(hmsc->cbw.dDataLength, len);
 	hmsc->csw.dDataResidue -= length;
 	hmsc->csw.bStatus = USBD_CSW_CMD_PASSED;
 	hmsc->bot_state = USBD_BOT_SEND_DATA;
 	hmsc->bot_data_length = 0;
-	USBD_LL_Transmit(pdev, MSC_EPIN_ADDR, MSC_Mode_Sense6_data, length);
+	USBD_LL_Transmit(pdev, MSC_EPIN_ADDR, mode_sense_resp, length);
 	return 0;
 }
 
 static int8_t SCSI_ModeSense10 (USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t *params)
 {
-	uint16_t len = 8U;
 	USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef*) pdev->pClassData[INTERFACE_MSC];
-#if 0
-	hmsc->bot_data_length = len;
-
-	while (len) {
-		len--;
-		hmsc->bot_data[len] = MSC_Mode_Sense10_data[len];
-	}
-#endif
-	uint16_t length = (uint16_t)MIN(hmsc->cbw.dDataLength, 8U);
+	int len = 8 + mode_sense_pages(params, mode_sense_resp + 8);
+	memset(mode_sense_resp, 0, 8);
+	mode_sense_resp[0] = (uint8_t)((len - 2) >> 8);
+	mode_sense_resp[1] = (uint8_t)(len - 2);
+	mode_sense_resp[3] = MODE_SENSE_DPOFUA;
+	uint16_t length = (uint16_t)MIN(hmsc->cbw.dDataLength, len);
 	hmsc->csw.dDataResidue -= length;
 	hmsc->csw.bStatus = USBD_CSW_CMD_PASSED;
 	hmsc->bot_state = USBD_BOT_SEND_DATA;
 	hmsc->bot_data_length = 0;
-	USBD_LL_Transmit(pdev, MSC_EPIN_ADDR, MSC_Mode_Sense10_data, length);
+	USBD_LL_Transmit(pdev, MSC_EPIN_ADDR, mode_sense_resp, length);
 	return 0;
 }
 
@@ -434,10 +682,13 @@ static int8_t SCSI_StartStopUnit(USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t
 	// start bit, otherwise we should respond to it.
 	//
 
-	//IMMED: We will always return status immediately so this flag has no meaning for us
+	//IMMED: Status is returned once the write cache has been flushed
 	//LOEJ: Ejecting the medium is not a meaningful concept for a virtual volume
-	//NO_FLUSH: We aren't performing any cacheing so this is irrelevant
+	//NO_FLUSH: The write cache is always flushed
 	//
+	if (write_cache_hold_cbw(hmsc)) {
+		return 0;
+	}
 	struct start_stop_unit *ssu = (struct start_stop_unit *)(params);
 	if ((ssu->params & 0xf0) == 0 && (ssu->pwr_modifier & 1) == 0) {
 		if (ssu->params & 0x1) {
@@ -453,6 +704,11 @@ static int8_t SCSI_StartStopUnit(USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t
 void readProcessingComplete(struct bufferFIFO *bf)
 {
 	assert(mmcDataToTransfer == 0);
+	if (g_read_stream) {
+		USBD_MSC_BOT_HandleTypeDef  *hmsc = (USBD_MSC_BOT_HandleTypeDef*) g_pdev->pClassData[INTERFACE_MSC];
+		//Started before the CSW so the next CBW is held if it arrives before the first buffer is done
+		read_ahead_start(hmsc->cbw.bLUN, mmcBlockAddr);
+	}
 	MSC_BOT_SendCSW (g_pdev, USBD_CSW_CMD_PASSED);
 }
 
@@ -486,6 +742,18 @@ static void processUSBReadBuffer(struct bufferFIFO *bf, int readSize, u32 readDa
 	USBD_LL_Transmit(g_pdev, MSC_EPIN_ADDR, hmsc->writeBuffer, hmsc->writeLen);
 }
 
+static void mmc_read_advance()
+{
+	mmcDataToTransfer -= mmcReadLen;
+	mmcDataTransferred += mmcReadLen;
+	mmcBlockAddr += mmcReadLen/512;
+	mmcBlocksToTransfer -= mmcReadLen/512;
+
+	if (mmcDataToTransfer == 0) {
+		bufferFIFO_stallStage(&usbBulkBufferFIFO, mmcStageIdx);
+	}
+}
+
 static void processMMCReadBuffer(struct bufferFIFO *bf, int readLen, u32 readData, const uint8_t *bufferRead, uint8_t *bufferWrite, int stageIdx)
 {
 	uint32_t len;
@@ -497,50 +765,387 @@ static void processMMCReadBuffer(struct bufferFIFO *bf, int readLen, u32 readDat
 	mmcBufferRead = bufferWrite;
 	mmcStageIdx = stageIdx;
 	mmcReadLen = len;
+	if ((mmcDataTransferred + len) <= g_read_ahead_hit_len) {
+		//
+		// Read ahead buffers are stored where the USB stage reads them. A buffer
+		// data of 1 tells the decrypt stage that the buffer is already decrypted
+		//
+		mmc_read_advance();
+		bufferFIFO_processingComplete(&usbBulkBufferFIFO, stageIdx, len, 1);
+		return;
+	}
 	emmc_user_queue(EMMC_USER_STORAGE);
 }
 
 #ifdef BOOT_MODE_B
 
-static void set_crypt_config()
+static void set_crypt_config(int idx)
 {
-	derive_iv(g_scsi_cur_aes_sector, g_scsi_cur_aes_iv);
 	g_scsi_aes_crypt_conf.DataType = CRYP_DATATYPE_32B;
 	g_scsi_aes_crypt_conf.KeySize = CRYP_KEYSIZE_128B;
 	g_scsi_aes_crypt_conf.pKey = (u32 *)g_encrypt_key;
-	g_scsi_aes_crypt_conf.pInitVect = (u32 *)g_scsi_cur_aes_iv;
+	g_scsi_aes_crypt_conf.pInitVect = g_scsi_aes_iv[idx];
 	g_scsi_aes_crypt_conf.Algorithm = CRYP_AES_CBC;
 	g_scsi_aes_crypt_conf.DataWidthUnit = CRYP_DATAWIDTHUNIT_WORD;
 	HAL_CRYP_SetConfig(&hcryp, &g_scsi_aes_crypt_conf);
 }
 
-static void processDecryptReadBuffer(struct bufferFIFO *bf,
-		int readLen, u32 readData,
-		const uint8_t *bufferRead, uint8_t *bufferWrite, int stageIdx)
+static void set_xts_config()
+{
+	g_scsi_aes_crypt_conf.DataType = CRYP_DATATYPE_8B;
+	g_scsi_aes_crypt_conf.KeySize = CRYP_KEYSIZE_128B;
+	g_scsi_aes_crypt_conf.pKey = g_scsi_xts_key;
+	g_scsi_aes_crypt_conf.pInitVect = NULL;
+	g_scsi_aes_crypt_conf.Algorithm = CRYP_AES_ECB;
+	g_scsi_aes_crypt_conf.DataWidthUnit = CRYP_DATAWIDTHUNIT_WORD;
+	HAL_CRYP_SetConfig(&hcryp, &g_scsi_aes_crypt_conf);
+}
+
+//Checks CRYP ECB matches nettle before using it for XTS volumes
+static int xts_self_test()
+{
+	u32 plaintext[AES_BLK_SIZE/4];
+	u32 hw[AES_BLK_SIZE/4];
+	u32 sw[AES_BLK_SIZE/4];
+	for (int i = 0; i < AES_BLK_SIZE/4; i++) {
+		plaintext[i] = 0x03020100 + (i * 0x04040404);
+	}
+	aes128_encrypt(&g_scsi_xts_ctx.encrypt, AES_BLK_SIZE, (u8 *)sw, (const u8 *)plaintext);
+	set_xts_config();
+	if (HAL_CRYP_Encrypt(&hcryp, plaintext, AES_BLK_SIZE/4, hw, 10) != HAL_OK) {
+		return 0;
+	}
+	return memcmp(hw, sw, AES_BLK_SIZE) ? 0 : 1;
+}
+
+//Expands the XTS key schedules once per login instead of once per buffer. The
+//CRYP key registers take big endian words. Standard byte order is used for XTS
+//
+//The CRYP self test runs at the first login, before any volume is unlocked and
+//while the login command keeps the database off the CRYP peripheral. Changing
+//the master password logs in again with the same key and skips it
+void usbd_scsi_set_encrypt_key(const u8 *key)
+{
+	signet_aes_128_xts_init(&g_scsi_xts_ctx, key);
+	for (int i = 0; i < AES_128_KEY_SIZE/4; i++) {
+		u32 w;
+		memcpy(&w, key + i * 4, 4);
+		g_scsi_xts_key[i] = __REV(w);
+	}
+	if (g_scsi_xts_hw < 0) {
+		g_scsi_xts_hw = xts_self_test();
+	}
+}
+
+void usbd_scsi_clear_encrypt_key()
+{
+	memset(&g_scsi_xts_ctx, 0, sizeof(g_scsi_xts_ctx));
+	memset(g_scsi_xts_key, 0, sizeof(g_scsi_xts_key));
+	g_scsi_xts_hw = -1;
+}
+
+static void xts_whiten_buffer(const u32 *src, u32 *dst)
+{
+	for (int i = 0; i < g_scsi_num_aes_sector; i++) {
+		signet_aes_128_xts_whiten(g_scsi_aes_iv[i], 512/AES_BLK_SIZE, (const u8 *)(src + i * (512/4)), (u8 *)(dst + i * (512/4)));
+	}
+}
+
+//
+// Each sector has its own IV so a buffer can't be processed as a single CBC
+// operation. The IVs for every sector in the buffer are derived up front and
+// the next sector is started from the CRYP interrupt so the main loop only
+// sees one completion per buffer.
+//
+// XTS volumes whiten every sector with its tweak so the whole buffer can be
+// processed by a single ECB operation. That is done by start_crypt_xts() from
+// the main loop, since buffers are queued from the USB and SDMMC interrupts
+//
+static void prepare_crypt_buffer(int readLen, const uint8_t *bufferRead, uint8_t *bufferWrite, int stageIdx)
 {
 	g_cryptStageIdx = stageIdx;
 	g_cryptTxLen = readLen;
 	assert((readLen % 512) == 0);
 	g_scsi_num_aes_sector = readLen / 512;
+	assert(g_scsi_num_aes_sector <= SCSI_CRYP_MAX_SECTORS);
 	g_scsi_aes_read = (u32 *)bufferRead;
 	g_scsi_aes_write = (u32 *)bufferWrite;
+	assert(dcache_is_coherent(bufferRead, readLen) && dcache_is_coherent(bufferWrite, readLen));
+	if (!g_scsi_aes_xts) {
+		for (int i = 0; i < g_scsi_num_aes_sector; i++) {
+			derive_iv(g_scsi_cur_aes_sector + i, (u8 *)g_scsi_aes_iv[i]);
+		}
+	}
+}
+
+//Called from usbd_scsi_idle()
+static void start_crypt_xts()
+{
+	for (int i = 0; i < g_scsi_num_aes_sector; i++) {
+		signet_aes_128_xts_tweak(&g_scsi_xts_ctx, g_scsi_cur_aes_sector + i, g_scsi_aes_iv[i]);
+	}
+	xts_whiten_buffer(g_scsi_aes_read, g_scsi_aes_write);
+	if (g_scsi_xts_hw > 0) {
+		HAL_StatusTypeDef status;
+		set_xts_config();
+		if (g_scsi_aes_encrypt) {
+			status = HAL_CRYP_Encrypt_DMA(&hcryp, g_scsi_aes_write, g_cryptTxLen/4, g_scsi_aes_write);
+		} else {
+			status = HAL_CRYP_Decrypt_DMA(&hcryp, g_scsi_aes_write, g_cryptTxLen/4, g_scsi_aes_write);
+		}
+		if (status == HAL_OK) {
+			return;
+		}
+	}
+	if (g_scsi_aes_encrypt) {
+		aes128_encrypt(&g_scsi_xts_ctx.encrypt, g_cryptTxLen, (u8 *)g_scsi_aes_write, (const u8 *)g_scsi_aes_write);
+	} else {
+		aes128_decrypt(&g_scsi_xts_ctx.decrypt, g_cryptTxLen, (u8 *)g_scsi_aes_write, (const u8 *)g_scsi_aes_write);
+	}
+	usbd_scsi_cryp_complete();
+}
+
+static void start_crypt_sector(int idx)
+{
+	u32 *read = g_scsi_aes_read + idx * (512/4);
+	u32 *write = g_scsi_aes_write + idx * (512/4);
+	set_crypt_config(idx);
+	if (g_scsi_aes_encrypt) {
+		HAL_CRYP_Encrypt_DMA(&hcryp, read, 512/4, write);
+	} else {
+		HAL_CRYP_Decrypt_DMA(&hcryp, read, 512/4, write);
+	}
+}
+
+static void processDecryptReadBuffer(struct bufferFIFO *bf,
+		int readLen, u32 readData,
+		const uint8_t *bufferRead, uint8_t *bufferWrite, int stageIdx)
+{
+	if (readData) {
+		g_scsi_cur_aes_sector += readLen/512;
+		g_cryptDataToTransfer -= readLen;
+		if (g_cryptDataToTransfer == 0) {
+			bufferFIFO_stallStage(&usbBulkBufferFIFO, stageIdx);
+		}
+		bufferFIFO_processingComplete(&usbBulkBufferFIFO, stageIdx, readLen, 0);
+		return;
+	}
+	prepare_crypt_buffer(readLen, bufferRead, bufferWrite, stageIdx);
 	g_scsi_aes_encrypt = 0;
-	set_crypt_config();
-	HAL_CRYP_Decrypt_DMA(&hcryp, g_scsi_aes_read, 512/4, g_scsi_aes_write);
+	cryp_user_queue(CRYP_USER_STORAGE);
+}
+
+//Called when the CRYP peripheral is granted to the storage volumes. This can
+//happen in the USB and SDMMC interrupts, so XTS buffers are started from the
+//main loop
+void cryp_user_storage_start()
+{
+	g_scsi_aes_sector_idx = 0;
+	if (g_scsi_aes_xts) {
+		g_cryptXtsStart = 1;
+		BEGIN_WORK(USBD_SCSI_WORK);
+	} else {
+		start_crypt_sector(0);
+	}
 }
 
 #endif
 
-void emmc_user_read_storage_rx_complete()
+int usbd_scsi_storage_busy()
 {
-	mmcDataToTransfer -= mmcReadLen;
-	mmcDataTransferred += mmcReadLen;
-	mmcBlockAddr += mmcReadLen/512;
-	mmcBlocksToTransfer -= mmcReadLen/512;
+	return g_read_ahead.state != READ_AHEAD_IDLE || g_write_cache.flushing || g_bulk_buffer_wipe == 2;
+}
 
-	if (mmcDataToTransfer == 0) {
-		bufferFIFO_stallStage(&usbBulkBufferFIFO, mmcStageIdx);
+//Copies cached blocks over data that was just read from the eMMC
+static void write_cache_patch(int lun, u32 blk_addr, u8 *buf, int len)
+{
+	if (!g_write_cache.n_blocks || g_write_cache.lun != lun) {
+		return;
+	}
+	u32 start = MAX(blk_addr, g_write_cache.blk_addr);
+	u32 end = MIN(blk_addr + len/512, g_write_cache.blk_addr + g_write_cache.n_blocks);
+	if (start < end) {
+		memcpy(buf + (start - blk_addr) * 512,
+			g_write_cache_buf + (start - g_write_cache.blk_addr) * 512,
+			(end - start) * 512);
+	}
+}
+
+static int write_cache_overlaps(int lun, u32 blk_addr, u32 blk_len)
+{
+	return g_write_cache.n_blocks && g_write_cache.lun == lun &&
+		blk_addr < (g_write_cache.blk_addr + g_write_cache.n_blocks) &&
+		(blk_addr + blk_len) > g_write_cache.blk_addr;
+}
+
+//Returns non-zero if a write can be merged into the cache without flushing it first
+static int write_cache_mergeable(int lun, u32 blk_addr, u32 blk_len)
+{
+	if (!g_write_cache.n_blocks) {
+		return 1;
+	}
+	if (g_write_cache.lun != lun ||
+		blk_addr > (g_write_cache.blk_addr + g_write_cache.n_blocks) ||
+		(blk_addr + blk_len) < g_write_cache.blk_addr) {
+		return 0;
+	}
+	u32 start = MIN(blk_addr, g_write_cache.blk_addr);
+	u32 end = MAX(blk_addr + blk_len, g_write_cache.blk_addr + g_write_cache.n_blocks);
+	return (end - start) <= SCSI_WRITE_CACHE_BLOCKS;
+}
+
+static void write_cache_insert(int lun, u32 blk_addr, const u8 *buf, int len)
+{
+	u32 blk_len = len/512;
+	assert(write_cache_mergeable(lun, blk_addr, blk_len));
+	if (!g_write_cache.n_blocks) {
+		g_write_cache.lun = lun;
+		g_write_cache.blk_addr = blk_addr;
 	}
+	u32 start = MIN(blk_addr, g_write_cache.blk_addr);
+	u32 end = MAX(blk_addr + blk_len, g_write_cache.blk_addr + g_write_cache.n_blocks);
+	if (start < g_write_cache.blk_addr) {
+		memmove(g_write_cache_buf + (g_write_cache.blk_addr - start) * 512,
+			g_write_cache_buf,
+			g_write_cache.n_blocks * 512);
+	}
+	memcpy(g_write_cache_buf + (blk_addr - start) * 512, buf, len);
+	g_write_cache.blk_addr = start;
+	g_write_cache.n_blocks = end - start;
+	g_write_cache.write_ms = HAL_GetTick();
+	g_scsi_write_cache_stats.writes_cached++;
+	g_scsi_write_cache_stats.blocks_cached += blk_len;
+	BEGIN_WORK(SCSI_WRITE_CACHE_WORK);
+}
+
+//Must only be called when no other storage transfer is in progress
+static void write_cache_flush()
+{
+	if (!g_write_cache.n_blocks) {
+		return;
+	}
+	g_write_cache.flushing = 1;
+	g_scsi_write_cache_stats.flushes++;
+	END_WORK(SCSI_WRITE_CACHE_WORK);
+	emmc_user_queue(EMMC_USER_STORAGE);
+}
+
+static void write_cache_flush_done()
+{
+	USBD_MSC_BOT_HandleTypeDef  *hmsc = (USBD_MSC_BOT_HandleTypeDef*) g_pdev->pClassData[INTERFACE_MSC];
+	int resume;
+	g_scsi_write_cache_stats.blocks_flushed += g_write_cache.n_blocks;
+	g_write_cache.n_blocks = 0;
+	__disable_irq();
+	g_write_cache.flushing = 0;
+	resume = (hmsc->bot_state == USBD_BOT_CBW_PENDING);
+	__enable_irq();
+	if (resume) {
+		MSC_BOT_ResumeCBW(g_pdev);
+	}
+}
+
+//Starts flushing the cache if it's dirty. The command is decoded again when the flush is done
+static int write_cache_hold_cbw(USBD_MSC_BOT_HandleTypeDef *hmsc)
+{
+	if (!g_write_cache.n_blocks) {
+		return 0;
+	}
+	write_cache_flush();
+	hmsc->bot_state = USBD_BOT_CBW_PENDING;
+	return 1;
+}
+
+static void read_ahead_next_buffer()
+{
+	struct bufferFIFO *bf = &usbBulkBufferFIFO;
+	mmcBufferRead = bf->bufferStorage + g_read_ahead.len;
+	mmcBlockAddr = g_read_ahead.blk_addr + g_read_ahead.len/512;
+	mmcReadLen = MIN(g_read_ahead.max_len - g_read_ahead.len, bf->maxBufferSize);
+	g_read_ahead.state = READ_AHEAD_READING;
+	emmc_user_queue(EMMC_USER_STORAGE);
+}
+
+static void read_ahead_start(int lun, u32 blk_addr)
+{
+	struct bufferFIFO *bf = &usbBulkBufferFIFO;
+	u32 blk_nbr = scsi_volume_blocks(lun);
+	int buffers = MIN(SCSI_READ_AHEAD_BUFFERS, bf->bufferCount);
+	if (buffers <= 0 || blk_addr >= blk_nbr || !g_scsi_volume[lun].visible || g_bulk_buffer_wipe) {
+		return;
+	}
+	g_read_ahead.valid = 1;
+	g_read_ahead.lun = lun;
+	g_read_ahead.blk_addr = blk_addr;
+	g_read_ahead.len = 0;
+	g_read_ahead.max_len = MIN((u32)(buffers * bf->maxBufferSize), (blk_nbr - blk_addr) * 512);
+	read_ahead_next_buffer();
+}
+
+static void read_ahead_buffer_done()
+{
+	USBD_MSC_BOT_HandleTypeDef  *hmsc = (USBD_MSC_BOT_HandleTypeDef*) g_pdev->pClassData[INTERFACE_MSC];
+	int resume = 0;
+	__disable_irq();
+	g_read_ahead.len += mmcReadLen;
+	g_scsi_read_ahead_stats.blocks_read_ahead += mmcReadLen/512;
+	if (hmsc->bot_state == USBD_BOT_CBW_PENDING) {
+		g_read_ahead.state = READ_AHEAD_IDLE;
+		resume = 1;
+	} else if (!g_read_ahead.valid || g_read_ahead.len == g_read_ahead.max_len) {
+		g_read_ahead.state = READ_AHEAD_IDLE;
+	} else {
+		read_ahead_next_buffer();
+	}
+	__enable_irq();
+	if (resume) {
+		MSC_BOT_ResumeCBW(g_pdev);
+	}
+}
+
+static void read_ahead_read_complete()
+{
+	write_cache_patch(g_read_ahead.lun, mmcBlockAddr, mmcBufferRead, mmcReadLen);
+#ifdef BOOT_MODE_B
+	int lun = g_read_ahead.lun;
+	//Don't decrypt for a read ahead that was cancelled by a logout
+	if (g_read_ahead.valid && (g_scsi_volume[lun].flags & HC_VOLUME_FLAG_ENCRYPTED)) {
+		g_read_ahead.state = READ_AHEAD_DECRYPTING;
+		g_scsi_cur_aes_sector = mmcBlockAddr;
+		g_scsi_aes_xts = (g_scsi_volume[lun].flags & HC_VOLUME_FLAG_XTS) ? 1 : 0;
+		prepare_crypt_buffer(mmcReadLen, mmcBufferRead, mmcBufferRead, 0);
+		g_scsi_aes_encrypt = 0;
+		cryp_user_queue(CRYP_USER_STORAGE);
+		return;
+	}
+#endif
+	read_ahead_buffer_done();
+}
+
+//Returns the number of bytes at the start of a read that are already in the bulk buffers
+static int read_ahead_take(int lun, u32 blk_addr, int len)
+{
+	int hit_len = 0;
+	assert(g_read_ahead.state == READ_AHEAD_IDLE);
+	if (g_read_ahead.valid && g_read_ahead.lun == lun && g_read_ahead.blk_addr == blk_addr) {
+		hit_len = MIN(g_read_ahead.len, len);
+		g_scsi_read_ahead_stats.hits++;
+		g_scsi_read_ahead_stats.blocks_hit += hit_len/512;
+	}
+	g_read_ahead.valid = 0;
+	return hit_len;
+}
+
+void emmc_user_read_storage_rx_complete()
+{
+	if (g_read_ahead.state == READ_AHEAD_READING) {
+		emmc_user_done();
+		read_ahead_read_complete();
+		return;
+	}
+	USBD_MSC_BOT_HandleTypeDef  *hmsc = (USBD_MSC_BOT_HandleTypeDef*) g_pdev->pClassData[INTERFACE_MSC];
+	write_cache_patch(hmsc->cbw.bLUN, mmcBlockAddr, mmcBufferRead, mmcReadLen);
+	mmc_read_advance();
 	emmc_user_done();
 	bufferFIFO_processingComplete(&usbBulkBufferFIFO, mmcStageIdx, mmcReadLen, 0);
 }
@@ -591,10 +1196,20 @@ static int8_t SCSI_Read10(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *params
 		mmcBlocksToTransfer = blk_len;
 		mmcBlockAddr = blk_addr;
 		mmcDataTransferred = 0;
+
+		g_scsi_read_ahead_stats.reads++;
+		g_read_stream = (g_read_stream_lun == lun && g_read_stream_end == blk_addr);
+		if (g_read_stream) {
+			g_scsi_read_ahead_stats.sequential++;
+		}
+		g_read_stream_lun = lun;
+		g_read_stream_end = blk_addr + blk_len;
+		g_read_ahead_hit_len = read_ahead_take(lun, blk_addr, hmsc->scsi_blk_len);
 #ifdef BOOT_MODE_B
 		if (g_scsi_volume[lun].flags & HC_VOLUME_FLAG_ENCRYPTED) {
 			g_cryptDataToTransfer = hmsc->scsi_blk_len;
 			g_scsi_cur_aes_sector = blk_addr;
+			g_scsi_aes_xts = (g_scsi_volume[lun].flags & HC_VOLUME_FLAG_XTS) ? 1 : 0;
 			usbBulkBufferFIFO.numStages = 3;
 			usbBulkBufferFIFO.processStage[0] = processMMCReadBuffer;
 			usbBulkBufferFIFO.processStage[1] = processDecryptReadBuffer;
@@ -619,35 +1234,50 @@ static int8_t SCSI_Read10(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *params
 	}
 }
 
+//Trims one range. The next range is queued so it waits for the card to finish this one
+static void unmap_next_range()
+{
+	struct scsi_unmap_range *r = g_unmap.range + g_unmap.idx;
+	u32 start = storage_emmc_block(g_unmap.lun, r->blk_addr);
+	if (HAL_MMC_EraseSequence(&hmmc1, HAL_MMC_TRIM, start, start + r->blk_len - 1) != HAL_OK) {
+		//UNMAP is only a hint so it succeeds without trimming on cards that don't support it
+		g_emmc_trim = 0;
+	}
+	g_unmap.idx++;
+	emmc_user_done();
+	if (g_emmc_trim && g_unmap.idx < g_unmap.count) {
+		emmc_user_queue(EMMC_USER_STORAGE);
+	} else {
+		g_unmap.count = 0;
+		MSC_BOT_SendCSW(g_pdev, USBD_CSW_CMD_PASSED);
+	}
+}
+
 void emmc_user_storage_start()
 {
 	USBD_MSC_BOT_HandleTypeDef  *hmsc = (USBD_MSC_BOT_HandleTypeDef*) g_pdev->pClassData[INTERFACE_MSC];
-	HAL_MMC_CardStateTypeDef cardState;
-	if (hmsc->bot_state == USBD_BOT_DATA_IN) {
-		int lun = hmsc->cbw.bLUN;
-
-		do {
-			cardState = HAL_MMC_GetCardState(&hmmc1);
-		} while (cardState != HAL_MMC_CARD_TRANSFER);
-
-		u32 blockAddrAdj = mmcBlockAddr +
-			(EMMC_STORAGE_FIRST_BLOCK * (HC_BLOCK_SZ/EMMC_SUB_BLOCK_SZ)) +
-			(g_scsi_volume[lun].region_start * g_scsi_region_size_blocks);
-
+	if (g_write_cache.flushing) {
+		HAL_MMC_WriteBlocks_DMA_Initial(&hmmc1, g_write_cache_buf, g_write_cache.n_blocks * 512,
+				storage_emmc_block(g_write_cache.lun, g_write_cache.blk_addr),
+				g_write_cache.n_blocks);
+	} else if (g_unmap.count) {
+		unmap_next_range();
+	} else if (g_read_ahead.state == READ_AHEAD_READING || hmsc->bot_state == USBD_BOT_DATA_IN) {
+		int lun = (g_read_ahead.state == READ_AHEAD_READING) ? g_read_ahead.lun : hmsc->cbw.bLUN;
+
+		u32 blockAddrAdj = storage_emmc_block(lun, mmcBlockAddr);
+
+		//Storage data stays in the non-cacheable bulk buffers so it needs no cache maintenance
+		assert(dcache_is_coherent(mmcBufferRead, mmcReadLen));
 		HAL_MMC_ReadBlocks_DMA(&hmmc1, mmcBufferRead,
 				blockAddrAdj,
 				mmcReadLen/512);
 	} else if (hmsc->bot_state == USBD_BOT_DATA_OUT) {
 		int lun = hmsc->cbw.bLUN;
 
-		do {
-			cardState = HAL_MMC_GetCardState(&hmmc1);
-		} while (cardState != HAL_MMC_CARD_TRANSFER);
-
-		u32 blockAddrAdj = mmcBlockAddr +
-			(EMMC_STORAGE_FIRST_BLOCK * (HC_BLOCK_SZ/EMMC_SUB_BLOCK_SZ)) +
-			(g_scsi_volume[lun].region_start * g_scsi_region_size_blocks);
+		u32 blockAddrAdj = storage_emmc_block(lun, mmcBlockAddr);
 
+		assert(dcache_is_coherent(mmcBufferWrite, mmcReadLen));
 		HAL_MMC_WriteBlocks_DMA_Initial(&hmmc1, mmcBufferWrite, mmcReadLen,
 				blockAddrAdj,
 				mmcReadLen/512);
@@ -657,6 +1287,9 @@ void emmc_user_storage_start()
 void writeProcessingComplete(struct bufferFIFO *bf)
 {
 	assert(mmcDataToTransfer == 0);
+	if (g_write_cache.n_blocks == SCSI_WRITE_CACHE_BLOCKS) {
+		write_cache_flush();
+	}
 	MSC_BOT_SendCSW (g_pdev, USBD_CSW_CMD_PASSED);
 }
 
@@ -679,8 +1312,14 @@ void processUSBWriteBuffer(struct bufferFIFO *bf, int readSize, u32 readData, co
 
 static int g_cryptOutInt = 0;
 
-void HAL_CRYP_OutCpltCallback(CRYP_HandleTypeDef *hcryp)
+//Called from the CRYP interrupt when a sector has been processed
+void usbd_scsi_cryp_complete()
 {
+	g_scsi_aes_sector_idx++;
+	if (!g_scsi_aes_xts && g_scsi_aes_sector_idx < g_scsi_num_aes_sector) {
+		start_crypt_sector(g_scsi_aes_sector_idx);
+		return;
+	}
 	g_cryptOutInt = 1;
 	BEGIN_WORK(USBD_SCSI_WORK);
 }
@@ -690,36 +1329,89 @@ void HAL_CRYP_OutCpltCallback(CRYP_HandleTypeDef *hcryp)
 int usbd_scsi_idle_ready()
 {
 #ifdef BOOT_MODE_B
-	return g_cryptOutInt;
+	return g_cryptOutInt || g_cryptXtsStart;
 #else
 	return 0;
 #endif
 }
 
+static void write_cache_idle()
+{
+	if (!g_write_cache.n_blocks || g_write_cache.flushing ||
+		(HAL_GetTick() - g_write_cache.write_ms) < SCSI_WRITE_CACHE_FLUSH_MS) {
+		return;
+	}
+	USBD_MSC_BOT_HandleTypeDef  *hmsc = (USBD_MSC_BOT_HandleTypeDef*) g_pdev->pClassData[INTERFACE_MSC];
+	int flush = 0;
+	//A CBW that arrives once flushing is set is held until the flush is done
+	__disable_irq();
+	if (hmsc->bot_state == USBD_BOT_IDLE && !usbd_scsi_storage_busy()) {
+		g_write_cache.flushing = 1;
+		flush = 1;
+	}
+	__enable_irq();
+	if (flush) {
+		write_cache_flush();
+	}
+}
+
+//Clears plaintext of a hidden volume from the bulk buffers. A CBW that arrives
+//while the buffers are being cleared is held until they are done
+static void bulk_buffer_wipe_idle()
+{
+	if (g_bulk_buffer_wipe != 1) {
+		return;
+	}
+	USBD_MSC_BOT_HandleTypeDef  *hmsc = g_pdev ? (USBD_MSC_BOT_HandleTypeDef*) g_pdev->pClassData[INTERFACE_MSC] : NULL;
+	int wipe = 0;
+	__disable_irq();
+	if ((!hmsc || hmsc->bot_state == USBD_BOT_IDLE) && !usbd_scsi_storage_busy()) {
+		g_bulk_buffer_wipe = 2;
+		wipe = 1;
+	}
+	__enable_irq();
+	if (!wipe) {
+		return;
+	}
+	struct bufferFIFO *bf = &usbBulkBufferFIFO;
+	memset(bf->bufferStorage, 0, bf->bufferCount * bf->maxBufferSize);
+	g_read_ahead.valid = 0;
+	g_read_ahead.len = 0;
+	g_read_ahead.max_len = 0;
+	g_read_ahead_hit_len = 0;
+	g_bulk_buffer_wipe = 0;
+	if (hmsc) {
+		MSC_BOT_ResumeCBW(g_pdev);
+	}
+}
+
 void usbd_scsi_idle()
 {
+	write_cache_idle();
+	bulk_buffer_wipe_idle();
 #ifdef BOOT_MODE_B
+	if (g_cryptXtsStart) {
+		g_cryptXtsStart = 0;
+		END_WORK(USBD_SCSI_WORK);
+		start_crypt_xts();
+	}
 	if (g_cryptOutInt) {
 		g_cryptOutInt = 0;
 		END_WORK(USBD_SCSI_WORK);
-		g_scsi_cur_aes_sector++;
-		g_scsi_num_aes_sector--;
-		g_scsi_aes_read += 512/4;
-		g_scsi_aes_write += 512/4;
-		if (!g_scsi_num_aes_sector) {
-			g_cryptDataToTransfer -= g_cryptTxLen;
-			if (g_cryptDataToTransfer == 0) {
-				bufferFIFO_stallStage(&usbBulkBufferFIFO, g_cryptStageIdx);
-			}
-			bufferFIFO_processingComplete(&usbBulkBufferFIFO, g_cryptStageIdx, g_cryptTxLen, 0);
-		} else {
-			set_crypt_config();
-			if (g_scsi_aes_encrypt) {
-				HAL_CRYP_Encrypt_DMA(&hcryp, g_scsi_aes_read, 512/4, g_scsi_aes_write);
-			} else {
-				HAL_CRYP_Decrypt_DMA(&hcryp, g_scsi_aes_read, 512/4, g_scsi_aes_write);
-			}
+		cryp_user_done();
+		if (g_scsi_aes_xts) {
+			xts_whiten_buffer(g_scsi_aes_write, g_scsi_aes_write);
+		}
+		g_scsi_cur_aes_sector += g_scsi_num_aes_sector;
+		if (g_read_ahead.state == READ_AHEAD_DECRYPTING) {
+			read_ahead_buffer_done();
+			return;
 		}
+		g_cryptDataToTransfer -= g_cryptTxLen;
+		if (g_cryptDataToTransfer == 0) {
+			bufferFIFO_stallStage(&usbBulkBufferFIFO, g_cryptStageIdx);
+		}
+		bufferFIFO_processingComplete(&usbBulkBufferFIFO, g_cryptStageIdx, g_cryptTxLen, 0);
 	}
 #endif
 }
@@ -727,16 +1419,9 @@ void usbd_scsi_idle()
 #ifdef BOOT_MODE_B
 void processEncryptWriteBuffer(struct bufferFIFO *bf, int readLen, u32 readData, const uint8_t *bufferRead, uint8_t *bufferWrite, int stageIdx)
 {
-	g_cryptStageIdx = stageIdx;
-	g_cryptTxLen = readLen;
-
-	assert((readLen % 512) == 0);
-	g_scsi_num_aes_sector = readLen / 512;
-	g_scsi_aes_read = (u32 *)bufferRead;
-	g_scsi_aes_write = (u32 *)bufferWrite;
+	prepare_crypt_buffer(readLen, bufferRead, bufferWrite, stageIdx);
 	g_scsi_aes_encrypt = 1;
-	set_crypt_config();
-	HAL_CRYP_Encrypt_DMA(&hcryp, g_scsi_aes_read, 512/4, g_scsi_aes_write);
+	cryp_user_queue(CRYP_USER_STORAGE);
 }
 #endif
 
@@ -744,6 +1429,10 @@ int mmcTXDmaActive = 0;
 
 void emmc_user_write_storage_tx_dma_complete(MMC_HandleTypeDef *hmmc)
 {
+	if (g_write_cache.flushing) {
+		HAL_MMC_WriteBlocks_DMA_Cont(&hmmc1, NULL, 0);
+		return;
+	}
 	mmcDataToTransfer -= mmcReadLen;
 	mmcDataTransferred += mmcReadLen;
 	mmcBlockAddr += mmcReadLen/512;
@@ -759,10 +1448,29 @@ void processMMCWriteBuffer(struct bufferFIFO *bf, int readLen, u32 readData, con
 	emmc_user_queue(EMMC_USER_STORAGE);
 }
 
+static void processCacheWriteBuffer(struct bufferFIFO *bf, int readLen, u32 readData, const uint8_t *bufferRead, uint8_t *bufferWrite, int stageIdx)
+{
+	USBD_MSC_BOT_HandleTypeDef  *hmsc = (USBD_MSC_BOT_HandleTypeDef*) g_pdev->pClassData[INTERFACE_MSC];
+	write_cache_insert(hmsc->cbw.bLUN, mmcBlockAddr, bufferRead, readLen);
+	mmcDataToTransfer -= readLen;
+	mmcDataTransferred += readLen;
+	mmcBlockAddr += readLen/512;
+	mmcBlocksToTransfer -= readLen/512;
+	if (mmcDataToTransfer == 0) {
+		bufferFIFO_stallStage(&usbBulkBufferFIFO, stageIdx);
+	}
+	bufferFIFO_processingComplete(&usbBulkBufferFIFO, stageIdx, readLen, 0);
+}
+
 int mmcShortWriteCount = 0;
 
 void emmc_user_write_storage_tx_complete(MMC_HandleTypeDef *hmmc1)
 {
+	if (g_write_cache.flushing) {
+		emmc_user_done();
+		write_cache_flush_done();
+		return;
+	}
 	if (mmcDataToTransfer == 0) {
 		bufferFIFO_stallStage(&usbBulkBufferFIFO, mmcStageIdx);
 	}
@@ -825,10 +1533,19 @@ static int8_t SCSI_Write10 (USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t *par
 			hmsc->bot_state = USBD_BOT_NO_DATA;
 			return -1;
 		}
+		int fua = (params[1] & 0x08U) ? 1 : 0;
+		int cache = !fua && blk_len > 0 && blk_len <= SCSI_WRITE_CACHE_BLOCKS &&
+			hmsc->scsi_blk_len <= usbBulkBufferFIFO.maxBufferSize;
+		if (cache ? !write_cache_mergeable(lun, blk_addr, blk_len) : write_cache_overlaps(lun, blk_addr, blk_len)) {
+			write_cache_hold_cbw(hmsc);
+			return 0;
+		}
+		g_scsi_write_cache_stats.writes++;
 		hmsc->bot_state = USBD_BOT_DATA_OUT;
 
 		/* Prepare EP to receive first data packet */
 		uint32_t len = MIN(hmsc->scsi_blk_len, usbBulkBufferFIFO.maxBufferSize);
+		g_read_ahead.valid = 0;
 		mmcDataToTransfer = hmsc->scsi_blk_len;
 		mmcBlocksToTransfer = blk_len;
 		mmcBlockAddr = blk_addr;
@@ -837,21 +1554,22 @@ static int8_t SCSI_Write10 (USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t *par
 		if (g_scsi_volume[lun].flags & HC_VOLUME_FLAG_ENCRYPTED) {
 			g_cryptDataToTransfer = hmsc->scsi_blk_len;
 			g_scsi_cur_aes_sector = blk_addr;
+			g_scsi_aes_xts = (g_scsi_volume[lun].flags & HC_VOLUME_FLAG_XTS) ? 1 : 0;
 			usbBulkBufferFIFO.numStages = 3;
 			usbBulkBufferFIFO.processStage[0] = processUSBWriteBuffer;
 			usbBulkBufferFIFO.processStage[1] = processEncryptWriteBuffer;
-			usbBulkBufferFIFO.processStage[2] = processMMCWriteBuffer;
+			usbBulkBufferFIFO.processStage[2] = cache ? processCacheWriteBuffer : processMMCWriteBuffer;
 			usbBulkBufferFIFO.processingComplete = writeProcessingComplete;
 		} else {
 			usbBulkBufferFIFO.numStages = 2;
 			usbBulkBufferFIFO.processStage[0] = processUSBWriteBuffer;
-			usbBulkBufferFIFO.processStage[1] = processMMCWriteBuffer;
+			usbBulkBufferFIFO.processStage[1] = cache ? processCacheWriteBuffer : processMMCWriteBuffer;
 			usbBulkBufferFIFO.processingComplete = writeProcessingComplete;
 		}
 #else
 		usbBulkBufferFIFO.numStages = 2;
 		usbBulkBufferFIFO.processStage[0] = processUSBWriteBuffer;
-		usbBulkBufferFIFO.processStage[1] = processMMCWriteBuffer;
+		usbBulkBufferFIFO.processStage[1] = cache ? processCacheWriteBuffer : processMMCWriteBuffer;
 		usbBulkBufferFIFO.processingComplete = writeProcessingComplete;
 #endif
 		bufferFIFO_start(&usbBulkBufferFIFO, len);
@@ -891,6 +1609,112 @@ static int8_t SCSI_Verify10(USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t *par
 	return 0;
 }
 
+/**
+* @brief  SCSI_SynchronizeCache
+*         Process Synchronize Cache(10) and (16) commands. The whole write
+*         cache is flushed whatever range is given
+* @param  lun: Logical unit number
+* @param  params: Command parameters
+* @retval status
+*/
+static int8_t SCSI_SynchronizeCache(USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t *params)
+{
+	USBD_MSC_BOT_HandleTypeDef  *hmsc = (USBD_MSC_BOT_HandleTypeDef*) pdev->pClassData[INTERFACE_MSC];
+	if (write_cache_hold_cbw(hmsc)) {
+		return 0;
+	}
+	hmsc->bot_data_length = 0U;
+	return 0;
+}
+
+/**
+* @brief  SCSI_Unmap
+*         Process Unmap command. The parameter list is received into bot_data
+*         and each block descriptor is trimmed on the eMMC
+* @param  lun: Logical unit number
+* @param  params: Command parameters
+* @retval status
+*/
+static int8_t SCSI_Unmap(USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t *params)
+{
+	USBD_MSC_BOT_HandleTypeDef  *hmsc = (USBD_MSC_BOT_HandleTypeDef*) pdev->pClassData[INTERFACE_MSC];
+	uint16_t param_len = ((uint16_t)params[7] << 8) | params[8];
+
+	if (hmsc->bot_state == USBD_BOT_IDLE) {
+		if (param_len == 0U) {
+			hmsc->bot_data_length = 0U;
+			return 0;
+		}
+		/* case 8 : Hi <> Do */
+		if ((hmsc->cbw.bmFlags & 0x80U) == 0x80U || hmsc->cbw.dDataLength != param_len) {
+			SCSI_SenseCode(pdev, hmsc->cbw.bLUN, ILLEGAL_REQUEST, INVALID_CDB, 0);
+			hmsc->bot_data_length = 0U;
+			hmsc->bot_state = USBD_BOT_NO_DATA;
+			return -1;
+		}
+		if (param_len < 8U || param_len > USBD_BOT_MAX_DATA) {
+			SCSI_SenseCode(pdev, lun, ILLEGAL_REQUEST, PARAMETER_LIST_LENGTH_ERROR, 0);
+			hmsc->bot_data_length = 0U;
+			hmsc->bot_state = USBD_BOT_NO_DATA;
+			return -1;
+		}
+		if(((USBD_StorageTypeDef *)pdev->pUserData)->IsReady(lun) != 0) {
+			SCSI_SenseCode(pdev, lun, NOT_READY, MEDIUM_NOT_PRESENT, 0);
+			hmsc->bot_data_length = 0U;
+			hmsc->bot_state = USBD_BOT_NO_DATA;
+			return -1;
+		}
+		if(((USBD_StorageTypeDef *)pdev->pUserData)->IsWriteProtected(lun) != 0) {
+			SCSI_SenseCode(pdev, lun, NOT_READY, WRITE_PROTECTED, 0);
+			hmsc->bot_data_length = 0U;
+			hmsc->bot_state = USBD_BOT_NO_DATA;
+			return -1;
+		}
+		//Cached blocks in the ranges would be written back after they are trimmed
+		if (write_cache_hold_cbw(hmsc)) {
+			return 0;
+		}
+		g_read_ahead.valid = 0;
+		hmsc->bot_state = USBD_BOT_DATA_OUT;
+		USBD_LL_PrepareReceive(pdev, MSC_EPOUT_ADDR, hmsc->bot_data, param_len);
+		return 0;
+	}
+
+	//The parameter list has been received
+	const uint8_t *data = hmsc->bot_data;
+	u32 blk_nbr = scsi_volume_blocks(lun);
+	int desc_len = MIN(((int)data[2] << 8) | data[3], param_len - 8);
+	hmsc->csw.dDataResidue -= param_len;
+	g_unmap.lun = lun;
+	g_unmap.idx = 0;
+	g_unmap.count = 0;
+	for (int i = 0; i < desc_len/16; i++) {
+		const uint8_t *desc = data + 8 + i * 16;
+		uint64_t blk_addr = 0;
+		for (int j = 0; j < 8; j++) {
+			blk_addr = (blk_addr << 8) | desc[j];
+		}
+		u32 blk_len = ((u32)desc[8] << 24) | ((u32)desc[9] << 16) | ((u32)desc[10] << 8) | desc[11];
+		if (blk_addr > blk_nbr || blk_len > (blk_nbr - blk_addr)) {
+			g_unmap.count = 0;
+			SCSI_SenseCode(pdev, lun, ILLEGAL_REQUEST, ADDRESS_OUT_OF_RANGE, 0);
+			return -1;
+		}
+		if (blk_len) {
+			g_unmap.range[g_unmap.count].blk_addr = (u32)blk_addr;
+			g_unmap.range[g_unmap.count].blk_len = blk_len;
+			g_unmap.count++;
+		}
+	}
+	if (g_unmap.count && g_emmc_trim) {
+		emmc_user_queue(EMMC_USER_STORAGE);
+	} else {
+		g_unmap.count = 0;
+		MSC_BOT_SendCSW(pdev, USBD_CSW_CMD_PASSED);
+	}
+	return 0;
+}
+
 /**
 * @brief  SCSI_CheckAddressRange
 *         Check address range
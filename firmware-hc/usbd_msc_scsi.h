@@ -46,6 +46,7 @@ extern "C" {
 
 #define SCSI_READ_CAPACITY10                        0x25U
 #define SCSI_READ_CAPACITY16                        0x9EU
+#define SCSI_SA_READ_CAPACITY16                     0x10U
 
 #define SCSI_REQUEST_SENSE                          0x03U
 #define SCSI_START_STOP_UNIT                        0x1BU
@@ -56,6 +57,9 @@ extern "C" {
 #define SCSI_WRITE16                                0x8AU
 
 #define SCSI_VERIFY10                               0x2FU
+#define SCSI_SYNCHRONIZE_CACHE10                    0x35U
+#define SCSI_SYNCHRONIZE_CACHE16                    0x91U
+#define SCSI_UNMAP                                  0x42U
 #define SCSI_VERIFY12                               0xAFU
 #define SCSI_VERIFY16                               0x8FU
 
@@ -91,6 +95,7 @@ extern "C" {
 
 #define READ_FORMAT_CAPACITY_DATA_LEN               0x0CU
 #define READ_CAPACITY10_DATA_LEN                    0x08U
+#define READ_CAPACITY16_DATA_LEN                    0x20U
 #define MODE_SENSE10_DATA_LEN                       0x08U
 #define MODE_SENSE6_DATA_LEN                        0x04U
 #define REQUEST_SENSE_DATA_LEN                      0x12U
@@ -125,7 +130,31 @@ extern struct scsi_volume g_scsi_volume[MAX_SCSI_VOLUMES];
 void usbd_scsi_init();
 void usbd_scsi_idle();
 int usbd_scsi_idle_ready();
+void usbd_scsi_cryp_complete();
 void usbd_scsi_device_state_change(enum device_state state);
+int usbd_scsi_storage_busy();
+void usbd_scsi_set_encrypt_key(const u8 *key);
+void usbd_scsi_clear_encrypt_key();
+
+struct scsi_read_ahead_stats {
+	u32 reads; //READ(10) commands
+	u32 sequential; //Reads that started where the previous read ended
+	u32 hits; //Reads that started with read ahead data. Hit rate is hits/sequential
+	u32 blocks_read_ahead;
+	u32 blocks_hit; //Read ahead blocks sent to the host
+};
+
+extern struct scsi_read_ahead_stats g_scsi_read_ahead_stats;
+
+struct scsi_write_cache_stats {
+	u32 writes; //WRITE(10) commands
+	u32 writes_cached; //Writes completed into the write cache
+	u32 blocks_cached;
+	u32 blocks_flushed; //Less than blocks_cached by the number of blocks merged
+	u32 flushes;
+};
+
+extern struct scsi_write_cache_stats g_scsi_write_cache_stats;
 
 typedef struct _SENSE_ITEM {
 	char Skey;
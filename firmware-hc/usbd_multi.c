@@ -4,6 +4,7 @@
 #include "usbd_ctlreq.h"
 #include "signetdev_common_priv.h"
 #include "usb_raw_hid.h"
+#include "dcache.h"
 
 #define LSB(X) ((X) & 0xff)
 #define MSB(X) ((X) >> 8)
@@ -325,10 +326,11 @@ static uint8_t USBD_Multi_DeviceQualifierDesc[USB_LEN_DEV_QUALIFIER_DESC] __attr
 	0x00,
 };
 
-USBD_HID_HandleTypeDef s_cmdHIDClassData __attribute__((aligned(16)));
-static USBD_HID_HandleTypeDef s_fidoHIDClassData __attribute__((aligned(16)));
-static USBD_HID_HandleTypeDef s_keyboardHIDClassData __attribute__((aligned(16)));
-static USBD_MSC_BOT_HandleTypeDef s_SCSIMSCClassData __attribute__((aligned(16)));
+//Endpoint OUT data is received into the class data with DMA
+USBD_HID_HandleTypeDef s_cmdHIDClassData DMA_BUFFER __attribute__((aligned(16)));
+static USBD_HID_HandleTypeDef s_fidoHIDClassData DMA_BUFFER __attribute__((aligned(16)));
+static USBD_HID_HandleTypeDef s_keyboardHIDClassData DMA_BUFFER __attribute__((aligned(16)));
+static USBD_MSC_BOT_HandleTypeDef s_SCSIMSCClassData DMA_BUFFER __attribute__((aligned(16)));
 
 static uint8_t  USBD_Multi_Init (USBD_HandleTypeDef *pdev, uint8_t cfgidx)
 {
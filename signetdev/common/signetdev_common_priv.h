@@ -135,6 +135,22 @@ struct db_block {
 	struct db_uid_ent uid_tbl[];
 } __attribute__((__packed__));
 
+//
+// Record metadata returned by READ_ALL_UID_INFO and READ_UIDS_CHANGED_SINCE. Each
+// message starts with the u16 DB epoch, two reserved bytes and the u32 current
+// change generation. Each entry is a u16 with the same layout as 'db_uid_ent.info',
+// the u16 record size and the u32 generation the record last changed in
+//
+#define UID_INFO_HEADER_SZ (8)
+#define UID_INFO_SZ (8)
+
+//
+// GET_DEVICE_STATE returns the device state byte. Signet HC firmware running the
+// password database follows it with the DB block cache counters: u32 hits, misses,
+// writes and flushes
+//
+#define DEVICE_STATE_DB_CACHE_STATS_SZ (16)
+
 #define INVALID_BLOCK (0)
 #define INVALID_PART_SIZE (0xffff)
 #define INVALID_CRC (0xffffffff)
@@ -185,6 +201,8 @@ enum commands {
 	WRITE_BLOCK_HC,
 	READ_BLOCK_HC,
 	ERASE_BLOCK_HC,
+	READ_ALL_UID_INFO,
+	READ_UIDS_CHANGED_SINCE,
 };
 
 #endif
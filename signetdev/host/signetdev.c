@@ -801,6 +801,29 @@ int signetdev_read_all_uids(void *param, int *token, int masked)
 				0, msg, sizeof(msg), SIGNETDEV_PRIV_GET_RESP);
 }
 
+int signetdev_read_all_uid_info(void *param, int *token)
+{
+	*token = get_cmd_token();
+	return signetdev_priv_send_message(param, *token,
+				READ_ALL_UID_INFO, SIGNETDEV_CMD_READ_ALL_UID_INFO,
+				0, NULL, 0, SIGNETDEV_PRIV_GET_RESP);
+}
+
+int signetdev_read_uids_changed_since(void *param, int *token, unsigned int epoch, u32 generation)
+{
+	*token = get_cmd_token();
+	uint8_t msg[6];
+	msg[0] = (epoch >> 0) & 0xff;
+	msg[1] = (epoch >> 8) & 0xff;
+	msg[2] = (generation >> 0) & 0xff;
+	msg[3] = (generation >> 8) & 0xff;
+	msg[4] = (generation >> 16) & 0xff;
+	msg[5] = (generation >> 24) & 0xff;
+	return signetdev_priv_send_message(param, *token,
+				READ_UIDS_CHANGED_SINCE, SIGNETDEV_CMD_READ_UIDS_CHANGED_SINCE,
+				0, msg, sizeof(msg), SIGNETDEV_PRIV_GET_RESP);
+}
+
 int signetdev_change_master_password(void *param, int *token,
 		u8 *old_key, u32 old_key_len,
 		u8 *new_key, u32 new_key_len,
@@ -1033,6 +1056,35 @@ void signetdev_priv_handle_command_resp(void *user, int token,
 				expected_messages_remaining,
 				resp_code, &cb_resp);
 		} break;
+	case READ_ALL_UID_INFO:
+	case READ_UIDS_CHANGED_SINCE: {
+		struct signetdev_uid_info_resp_data cb_resp;
+		cb_resp.n_entries = 0;
+		if (resp_code == OKAY) {
+			if (resp_len < UID_INFO_HEADER_SZ || ((resp_len - UID_INFO_HEADER_SZ) % UID_INFO_SZ)) {
+				signetdev_priv_handle_error();
+				break;
+			}
+			int i;
+			cb_resp.epoch = resp[0] + (resp[1] << 8);
+			cb_resp.generation = resp[4] + (resp[5] << 8) + (resp[6] << 16) + ((u32)resp[7] << 24);
+			cb_resp.n_entries = (resp_len - UID_INFO_HEADER_SZ) / UID_INFO_SZ;
+			for (i = 0; i < cb_resp.n_entries; i++) {
+				const u8 *ent = resp + UID_INFO_HEADER_SZ + (i * UID_INFO_SZ);
+				int info = ent[0] + (ent[1] << 8);
+				cb_resp.entries[i].uid = info & 0xfff;
+				cb_resp.entries[i].rev = (info >> 12) & 0x3;
+				cb_resp.entries[i].size = ent[2] + (ent[3] << 8);
+				cb_resp.entries[i].generation = ent[4] + (ent[5] << 8) + (ent[6] << 16) + ((u32)ent[7] << 24);
+			}
+		}
+		if (g_command_resp_cb)
+			g_command_resp_cb(g_command_resp_cb_param,
+				user, token, api_cmd,
+				end_device_state,
+				expected_messages_remaining,
+				resp_code, &cb_resp);
+		} break;
 	case READ_UID: {
 		struct signetdev_read_uid_resp_data cb_resp;
 		u8 *data = cb_resp.data;
@@ -79,6 +79,8 @@ typedef enum signetdev_cmd_id {
 	SIGNETDEV_CMD_READ_CLEARTEXT_PASSWORD,
 	SIGNETDEV_CMD_READ_CLEARTEXT_PASSWORD_NAMES,
 	SIGNETDEV_CMD_WRITE_CLEARTEXT_PASSWORD,
+	SIGNETDEV_CMD_READ_ALL_UID_INFO,
+	SIGNETDEV_CMD_READ_UIDS_CHANGED_SINCE,
 	SIGNETDEV_NUM_COMMANDS
 } signetdev_cmd_id_t;
 
@@ -128,6 +130,8 @@ int signetdev_update_uid(void *user, int *token, unsigned int id, unsigned int s
 int signetdev_update_uids(void *user, int *token, unsigned int id, unsigned int size, const u8 *data, const u8 *mask, unsigned int entries_remaining);
 int signetdev_read_uid(void *param, int *token, int uid, int masked);
 int signetdev_read_all_uids(void *param, int *token, int masked);
+int signetdev_read_all_uid_info(void *param, int *token);
+int signetdev_read_uids_changed_since(void *param, int *token, unsigned int epoch, u32 generation);
 int signetdev_has_keyboard();
 
 struct signetdev_get_rand_bits_resp_data {
@@ -142,6 +146,20 @@ struct signetdev_read_all_uids_resp_data {
         u8 mask[MAX_CMD_PACKET_PAYLOAD_SIZE];
 };
 
+struct signetdev_uid_info {
+	int uid;
+	int rev;
+	int size; //Zero if the record has been deleted
+	u32 generation;
+};
+
+struct signetdev_uid_info_resp_data {
+	unsigned int epoch;
+	u32 generation;
+	int n_entries;
+	struct signetdev_uid_info entries[MAX_BLK_SIZE/UID_INFO_SZ];
+};
+
 struct signetdev_read_uid_resp_data {
 	int size;
         u8 data[MAX_CMD_PACKET_PAYLOAD_SIZE];
@@ -0,0 +1,234 @@
+//
+// Host test for the AES key schedules in signet_aes.c
+//
+// The CBC functions and the signet_aes_256_ctx functions expand a key once and use
+// it for every block. This checks they give the same results as expanding the key
+// for each block with the single block functions, which is how the CBC functions
+// used to work, and checks the single block functions against FIPS-197
+//
+// aes-host-test          Runs the checks
+// aes-host-test bench    Times a 16K CBC decrypt with the key expanded per block and
+//                        with a signet_aes_256_ctx
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "types.h"
+#include "signetdev_common.h"
+#include "signet_aes.h"
+
+#define MAX_BLOCKS (1024)
+
+#define BENCH_BLOCKS (16384/AES_BLK_SIZE)
+#define BENCH_ITERATIONS (200)
+
+//FIPS-197 appendix C
+static const u8 fips_pt[AES_BLK_SIZE] = {
+	0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff
+};
+
+static const u8 fips_128_ct[AES_BLK_SIZE] = {
+	0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30, 0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a
+};
+
+static const u8 fips_256_ct[AES_BLK_SIZE] = {
+	0x8e, 0xa2, 0xb7, 0xca, 0x51, 0x67, 0x45, 0xbf, 0xea, 0xfc, 0x49, 0x90, 0x4b, 0x49, 0x60, 0x89
+};
+
+static u8 pt[MAX_BLOCKS * AES_BLK_SIZE];
+static u8 ct[MAX_BLOCKS * AES_BLK_SIZE];
+static u8 ref[MAX_BLOCKS * AES_BLK_SIZE];
+static u8 out[MAX_BLOCKS * AES_BLK_SIZE];
+
+static int failures;
+
+static void check(const char *name, const void *got, const void *expected, int len)
+{
+	if (memcmp(got, expected, len)) {
+		printf("FAIL: %s\n", name);
+		failures++;
+	}
+}
+
+static void fill(u8 *p, int len)
+{
+	for (int i = 0; i < len; i++) {
+		p[i] = rand();
+	}
+}
+
+//
+// CBC built from the single block functions. The key is expanded for every block.
+// A NULL 'iv' is treated as zero like xor_block() does
+//
+static void ref_encrypt_cbc(int key_size, const u8 *key, int n_blocks, const u8 *iv, const u8 *din, u8 *dout)
+{
+	u8 chain[AES_BLK_SIZE];
+	memset(chain, 0, AES_BLK_SIZE);
+	if (iv) {
+		memcpy(chain, iv, AES_BLK_SIZE);
+	}
+	for (int i = 0; i < n_blocks; i++) {
+		u8 temp[AES_BLK_SIZE];
+		for (int k = 0; k < AES_BLK_SIZE; k++) {
+			temp[k] = din[i * AES_BLK_SIZE + k] ^ chain[k];
+		}
+		if (key_size == AES_128_KEY_SIZE) {
+			signet_aes_128_encrypt(key, temp, dout + i * AES_BLK_SIZE);
+		} else {
+			signet_aes_256_encrypt(key, temp, dout + i * AES_BLK_SIZE);
+		}
+		memcpy(chain, dout + i * AES_BLK_SIZE, AES_BLK_SIZE);
+	}
+}
+
+static void ref_decrypt_cbc(int key_size, const u8 *key, int n_blocks, const u8 *iv, const u8 *din, u8 *dout)
+{
+	u8 chain[AES_BLK_SIZE];
+	memset(chain, 0, AES_BLK_SIZE);
+	if (iv) {
+		memcpy(chain, iv, AES_BLK_SIZE);
+	}
+	for (int i = 0; i < n_blocks; i++) {
+		u8 temp[AES_BLK_SIZE];
+		if (key_size == AES_128_KEY_SIZE) {
+			signet_aes_128_decrypt(key, din + i * AES_BLK_SIZE, temp);
+		} else {
+			signet_aes_256_decrypt(key, din + i * AES_BLK_SIZE, temp);
+		}
+		for (int k = 0; k < AES_BLK_SIZE; k++) {
+			dout[i * AES_BLK_SIZE + k] = temp[k] ^ chain[k];
+		}
+		memcpy(chain, din + i * AES_BLK_SIZE, AES_BLK_SIZE);
+	}
+}
+
+static void test_fips()
+{
+	u8 key[AES_256_KEY_SIZE];
+	u8 b[AES_BLK_SIZE];
+	for (int i = 0; i < AES_256_KEY_SIZE; i++) {
+		key[i] = i;
+	}
+	signet_aes_128_encrypt(key, fips_pt, b);
+	check("FIPS-197 AES-128 encrypt", b, fips_128_ct, AES_BLK_SIZE);
+	signet_aes_128_decrypt(key, fips_128_ct, b);
+	check("FIPS-197 AES-128 decrypt", b, fips_pt, AES_BLK_SIZE);
+	signet_aes_256_encrypt(key, fips_pt, b);
+	check("FIPS-197 AES-256 encrypt", b, fips_256_ct, AES_BLK_SIZE);
+	signet_aes_256_decrypt(key, fips_256_ct, b);
+	check("FIPS-197 AES-256 decrypt", b, fips_pt, AES_BLK_SIZE);
+
+	struct signet_aes_256_ctx ctx;
+	signet_aes_256_ctx_init(&ctx, key);
+	signet_aes_256_ctx_encrypt_cbc(&ctx, 1, NULL, fips_pt, b);
+	check("FIPS-197 AES-256 ctx encrypt", b, fips_256_ct, AES_BLK_SIZE);
+	signet_aes_256_ctx_decrypt_cbc(&ctx, 1, NULL, fips_256_ct, b);
+	check("FIPS-197 AES-256 ctx decrypt", b, fips_pt, AES_BLK_SIZE);
+}
+
+static void test_cbc(int n_blocks, int use_iv)
+{
+	u8 key[AES_256_KEY_SIZE];
+	u8 iv_buf[AES_BLK_SIZE];
+	const u8 *iv = use_iv ? iv_buf : NULL;
+	int len = n_blocks * AES_BLK_SIZE;
+	fill(key, sizeof(key));
+	fill(iv_buf, sizeof(iv_buf));
+	fill(pt, len);
+
+	ref_encrypt_cbc(AES_128_KEY_SIZE, key, n_blocks, iv, pt, ref);
+	signet_aes_128_encrypt_cbc(key, n_blocks, iv, pt, out);
+	check("AES-128 CBC encrypt", out, ref, len);
+	ref_decrypt_cbc(AES_128_KEY_SIZE, key, n_blocks, iv, ref, out);
+	check("AES-128 reference round trip", out, pt, len);
+	signet_aes_128_decrypt_cbc(key, n_blocks, iv, ref, out);
+	check("AES-128 CBC decrypt", out, pt, len);
+
+	ref_encrypt_cbc(AES_256_KEY_SIZE, key, n_blocks, iv, pt, ref);
+	signet_aes_256_encrypt_cbc(key, n_blocks, iv, pt, out);
+	check("AES-256 CBC encrypt", out, ref, len);
+	ref_decrypt_cbc(AES_256_KEY_SIZE, key, n_blocks, iv, ref, out);
+	check("AES-256 reference round trip", out, pt, len);
+	signet_aes_256_decrypt_cbc(key, n_blocks, iv, ref, out);
+	check("AES-256 CBC decrypt", out, pt, len);
+
+	//The context is reused for several operations like g_encrypt_ctx
+	struct signet_aes_256_ctx ctx;
+	signet_aes_256_ctx_init(&ctx, key);
+	for (int i = 0; i < 3; i++) {
+		signet_aes_256_ctx_encrypt_cbc(&ctx, n_blocks, iv, pt, ct);
+		check("AES-256 ctx encrypt", ct, ref, len);
+		signet_aes_256_ctx_decrypt_cbc(&ctx, n_blocks, iv, ct, out);
+		check("AES-256 ctx decrypt", out, pt, len);
+	}
+	//decode_uid() decrypts records in place
+	signet_aes_256_ctx_decrypt_cbc(&ctx, n_blocks, iv, ct, ct);
+	check("AES-256 ctx decrypt in place", ct, pt, len);
+	signet_aes_256_decrypt_cbc(key, n_blocks, iv, ref, ref);
+	check("AES-256 CBC decrypt in place", ref, pt, len);
+
+	signet_aes_256_ctx_clear(&ctx);
+	struct signet_aes_256_ctx zero;
+	memset(&zero, 0, sizeof(zero));
+	check("AES-256 ctx cleared", &ctx, &zero, sizeof(ctx));
+}
+
+static double now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void bench()
+{
+	u8 key[AES_256_KEY_SIZE];
+	u8 iv[AES_BLK_SIZE];
+	struct signet_aes_256_ctx ctx;
+	int len = BENCH_BLOCKS * AES_BLK_SIZE;
+	fill(key, sizeof(key));
+	fill(iv, sizeof(iv));
+	fill(ct, len);
+
+	double start = now_us();
+	for (int i = 0; i < BENCH_ITERATIONS; i++) {
+		ref_decrypt_cbc(AES_256_KEY_SIZE, key, BENCH_BLOCKS, iv, ct, out);
+	}
+	double per_block = (now_us() - start) / BENCH_ITERATIONS;
+
+	signet_aes_256_ctx_init(&ctx, key);
+	start = now_us();
+	for (int i = 0; i < BENCH_ITERATIONS; i++) {
+		signet_aes_256_ctx_decrypt_cbc(&ctx, BENCH_BLOCKS, iv, ct, out);
+	}
+	double cached = (now_us() - start) / BENCH_ITERATIONS;
+
+	printf("%d byte AES-256 CBC decrypt, key expanded per block: %.2f us (%.1f MB/s)\n",
+		len, per_block, len / per_block);
+	printf("%d byte AES-256 CBC decrypt, signet_aes_256_ctx:      %.2f us (%.1f MB/s)\n",
+		len, cached, len / cached);
+}
+
+int main(int argc, char **argv)
+{
+	srand(1);
+	if (argc > 1 && !strcmp(argv[1], "bench")) {
+		bench();
+		return 0;
+	}
+	test_fips();
+	static const int sizes[] = {1, 2, 3, 4, 8, 16, 17, 64, 256, MAX_BLOCKS};
+	for (int i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+		test_cbc(sizes[i], 1);
+		test_cbc(sizes[i], 0);
+	}
+	if (failures) {
+		printf("aes-host-test: %d failures\n", failures);
+		return 1;
+	}
+	printf("aes-host-test: passed\n");
+	return 0;
+}
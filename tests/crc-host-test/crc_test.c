@@ -0,0 +1,199 @@
+//
+// Host test for crc.c
+//
+// Builds crc.c against a model of the CRC unit and checks its results bit for bit
+// against a bytewise CRC-32 written independently of the firmware
+//
+// combine    Checks crc_32_combine() and crc_32_combine_op() give the CRC of the
+//            whole buffer for many split points, including the equal sized
+//            partitions the DB block CRCs are built from
+// dma        Checks crc_32_dma_start() and crc_idle() return the same CRC as
+//            crc_32() for the sizes and alignments the firmware uses, and that a
+//            second transfer is refused until the first result is delivered
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "types.h"
+#include "crc.h"
+#include "main.h"
+#include "hal.h"
+
+//Larger than a DB block so the combine length covers more bits of the shift table
+#define TEST_BUF_SZ (65536 + 37)
+
+static u8 buf[TEST_BUF_SZ];
+
+static int failures;
+
+//Results passed to crc_32_dma_complete()
+static int dma_completions;
+static enum crc_user dma_user;
+static u32 dma_crc;
+
+void crc_32_dma_complete(enum crc_user user, u32 crc)
+{
+	dma_completions++;
+	dma_user = user;
+	dma_crc = crc;
+}
+
+//Reference CRC-32 (ISO-HDLC, as used by zlib)
+static u32 ref_crc_32(const u8 *din, int count)
+{
+	u32 crc = 0xffffffff;
+	for (int i = 0; i < count; i++) {
+		crc ^= din[i];
+		for (int k = 0; k < 8; k++) {
+			crc = (crc & 1) ? ((crc >> 1) ^ 0xedb88320) : (crc >> 1);
+		}
+	}
+	return ~crc;
+}
+
+static void check(const char *name, u32 got, u32 expected)
+{
+	if (got != expected) {
+		printf("FAIL: %s: %08x expected %08x\n", name, got, expected);
+		failures++;
+	}
+}
+
+static void fill_buf(unsigned seed)
+{
+	srand(seed);
+	for (int i = 0; i < TEST_BUF_SZ; i++) {
+		buf[i] = rand();
+	}
+}
+
+static void test_reference()
+{
+	check("reference check value", ref_crc_32((const u8 *)"123456789", 9), 0xcbf43926);
+	check("crc_32 check value", crc_32((const u8 *)"123456789", 9), 0xcbf43926);
+	for (int len = 0; len <= 64; len++) {
+		check("crc_32 short", crc_32(buf + 1, len), ref_crc_32(buf + 1, len));
+	}
+	check("crc_32 whole buffer", crc_32(buf, TEST_BUF_SZ), ref_crc_32(buf, TEST_BUF_SZ));
+}
+
+static void test_combine_split(int offs, int len, int split)
+{
+	u32 crc1 = crc_32(buf + offs, split);
+	u32 crc2 = crc_32(buf + offs + split, len - split);
+	u32 expected = ref_crc_32(buf + offs, len);
+	check("crc_32_combine", crc_32_combine(crc1, crc2, len - split), expected);
+	check("crc_32_combine_op", crc_32_combine_op(crc_32_shift_op(len - split), crc1, crc2), expected);
+}
+
+//Combines a header, 'count' partitions of 'part_len' bytes and a tail the way db.c
+//computes a block CRC
+static void test_combine_parts(int head_len, int part_len, int count)
+{
+	int len = head_len + part_len * count;
+	int tail_len = TEST_BUF_SZ - len;
+	u32 op = crc_32_shift_op(part_len);
+	u32 crc = crc_32(buf, head_len);
+	for (int i = 0; i < count; i++) {
+		crc = crc_32_combine_op(op, crc, crc_32(buf + head_len + i * part_len, part_len));
+	}
+	check("partitions", crc, ref_crc_32(buf, len));
+	crc = crc_32_combine(crc, crc_32(buf + len, tail_len), tail_len);
+	check("partitions and tail", crc, ref_crc_32(buf, TEST_BUF_SZ));
+}
+
+static void test_combine()
+{
+	static const int lens[] = {0, 1, 2, 3, 4, 5, 7, 8, 15, 16, 17, 511, 512, 513, 4095, 4096, 4097, 65536};
+	for (int i = 0; i < sizeof(lens)/sizeof(lens[0]); i++) {
+		int len = lens[i];
+		for (int split = 0; split <= len; split += (len < 64) ? 1 : (len / 61)) {
+			test_combine_split(3, len, split);
+		}
+		test_combine_split(3, len, len);
+	}
+	for (int i = 0; i < 1000; i++) {
+		int len = rand() % (TEST_BUF_SZ + 1);
+		int split = rand() % (len + 1);
+		test_combine_split(TEST_BUF_SZ - len, len, split);
+	}
+	for (int part_len = 16; part_len <= 4096; part_len *= 2) {
+		test_combine_parts(252, part_len, (TEST_BUF_SZ - 252 - 1) / part_len);
+		test_combine_parts(4, part_len, 1);
+	}
+}
+
+//Runs one DMA CRC of 'len' bytes at 'offs' and checks it against crc_32()
+static void test_dma_len(int offs, int len, enum crc_user user)
+{
+	u32 expected = ref_crc_32(buf + offs, len);
+	int completions = dma_completions;
+	if (!crc_32_dma_start(buf + offs, len, user)) {
+		printf("FAIL: crc_32_dma_start refused %d bytes\n", len);
+		failures++;
+		return;
+	}
+	crc_idle();
+	check("no result before the transfer", dma_completions, completions);
+	hal_dma_run();
+	check("CRC_WORK set", (g_work_to_do & CRC_WORK) != 0, 1);
+	//The software CRC shares the CRC unit once the transfer is done
+	check("crc_32 before crc_idle", crc_32(buf + offs, len), expected);
+	crc_idle();
+	check("one result", dma_completions, completions + 1);
+	check("CRC_WORK cleared", (g_work_to_do & CRC_WORK) != 0, 0);
+	check("user", dma_user, user);
+	check("DMA CRC", dma_crc, expected);
+}
+
+static void test_dma()
+{
+	static const int lens[] = {1, 2, 3, 4, 5, 15, 16, 17, 511, 512, 513, 4092, 4096, 8188, 65535};
+	if ((uintptr_t)(buf + TEST_BUF_SZ) > UINT32_MAX) {
+		printf("FAIL: buffer above 4G, link without PIE\n");
+		failures++;
+		return;
+	}
+	for (int i = 0; i < sizeof(lens)/sizeof(lens[0]); i++) {
+		for (int offs = 0; offs < 4; offs++) {
+			test_dma_len(offs, lens[i], (i & 1) ? CRC_USER_DB_INDEX : CRC_USER_ROOT_BLOCK);
+		}
+	}
+	for (int i = 0; i < 200; i++) {
+		int len = 1 + rand() % (TEST_BUF_SZ - 1);
+		test_dma_len(rand() % (TEST_BUF_SZ - len + 1), len, CRC_USER_DB_INDEX);
+	}
+
+	check("empty transfer refused", crc_32_dma_start(buf, 0, CRC_USER_DB_INDEX), 0);
+	check("first transfer", crc_32_dma_start(buf, 4096, CRC_USER_DB_INDEX), 1);
+	check("refused while busy", crc_32_dma_start(buf, 512, CRC_USER_ROOT_BLOCK), 0);
+	hal_dma_run();
+	check("refused until delivered", crc_32_dma_start(buf, 512, CRC_USER_ROOT_BLOCK), 0);
+	crc_idle();
+	check("first result", dma_crc, ref_crc_32(buf, 4096));
+	test_dma_len(0, 512, CRC_USER_ROOT_BLOCK);
+}
+
+int main(int argc, char **argv)
+{
+	const char *test = argc > 1 ? argv[1] : "combine";
+	crc_init();
+	fill_buf(1);
+	test_reference();
+	if (!strcmp(test, "combine")) {
+		test_combine();
+	} else if (!strcmp(test, "dma")) {
+		test_dma();
+	} else {
+		fprintf(stderr, "unknown test %s\n", test);
+		return 2;
+	}
+	if (failures) {
+		printf("crc-host-test %s: %d failures\n", test, failures);
+		return 1;
+	}
+	printf("crc-host-test %s: passed\n", test);
+	return 0;
+}
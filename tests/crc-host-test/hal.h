@@ -0,0 +1,12 @@
+#ifndef HAL_H
+#define HAL_H
+
+//Non-zero while a DMA transfer started by crc.c hasn't run yet
+int hal_dma_busy();
+
+//Feeds the pending DMA transfer to the CRC unit and runs its interrupt handler
+void hal_dma_run();
+
+void DMA2_Stream0_IRQHandler(void);
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef STM32F7XX_H
+#define STM32F7XX_H
+
+#include "stm32f7xx_hal.h"
+
+#endif
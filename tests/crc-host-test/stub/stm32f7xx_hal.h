@@ -0,0 +1,119 @@
+#ifndef STM32F7XX_HAL_H
+#define STM32F7XX_HAL_H
+
+//
+// The parts of the STM32 HAL that crc.c uses. hal.c models the CRC unit and the
+// DMA stream that feeds it. Interrupts don't exist on the host
+//
+
+#include <stdint.h>
+
+typedef enum {
+	HAL_OK,
+	HAL_ERROR,
+	HAL_BUSY,
+	HAL_TIMEOUT
+} HAL_StatusTypeDef;
+
+typedef struct {
+	int unused;
+} PCD_HandleTypeDef;
+
+//
+// CRC unit. DR reads back the bit reflected CRC, which is what the firmware
+// configures with CRC_OUTPUTDATA_INVERSION_ENABLE and byte input inversion
+//
+typedef struct {
+	volatile uint32_t DR;
+} CRC_TypeDef;
+
+extern CRC_TypeDef g_crc_unit;
+#define CRC (&g_crc_unit)
+
+typedef struct {
+	uint8_t DefaultPolynomialUse;
+	uint8_t DefaultInitValueUse;
+	uint32_t CRCLength;
+	uint32_t InputDataInversionMode;
+	uint32_t OutputDataInversionMode;
+} CRC_InitTypeDef;
+
+typedef struct {
+	CRC_TypeDef *Instance;
+	CRC_InitTypeDef Init;
+	uint32_t InputDataFormat;
+} CRC_HandleTypeDef;
+
+#define DEFAULT_POLYNOMIAL_ENABLE (0)
+#define DEFAULT_INIT_VALUE_ENABLE (0)
+#define CRC_POLYLENGTH_32B (0)
+#define CRC_INPUTDATA_INVERSION_BYTE (1)
+#define CRC_OUTPUTDATA_INVERSION_ENABLE (1)
+#define CRC_INPUTDATA_FORMAT_BYTES (1)
+
+#define __HAL_CRC_DR_RESET(h) ((h)->Instance->DR = 0xffffffff)
+
+HAL_StatusTypeDef HAL_CRC_Init(CRC_HandleTypeDef *hcrc);
+uint32_t HAL_CRC_Calculate(CRC_HandleTypeDef *hcrc, uint32_t *buf, uint32_t len);
+uint32_t HAL_CRC_Accumulate(CRC_HandleTypeDef *hcrc, uint32_t *buf, uint32_t len);
+
+//
+// DMA
+//
+typedef struct {
+	int unused;
+} DMA_Stream_TypeDef;
+
+extern DMA_Stream_TypeDef g_dma2_stream0;
+#define DMA2_Stream0 (&g_dma2_stream0)
+
+typedef struct {
+	uint32_t Channel;
+	uint32_t Direction;
+	uint32_t PeriphInc;
+	uint32_t MemInc;
+	uint32_t PeriphDataAlignment;
+	uint32_t MemDataAlignment;
+	uint32_t Mode;
+	uint32_t Priority;
+	uint32_t FIFOMode;
+	uint32_t FIFOThreshold;
+	uint32_t MemBurst;
+	uint32_t PeriphBurst;
+} DMA_InitTypeDef;
+
+typedef struct __DMA_HandleTypeDef {
+	DMA_Stream_TypeDef *Instance;
+	DMA_InitTypeDef Init;
+	void (*XferCpltCallback)(struct __DMA_HandleTypeDef *hdma);
+} DMA_HandleTypeDef;
+
+#define DMA_CHANNEL_0 (0)
+#define DMA_MEMORY_TO_MEMORY (2)
+#define DMA_PINC_ENABLE (1)
+#define DMA_MINC_DISABLE (0)
+#define DMA_PDATAALIGN_BYTE (0)
+#define DMA_MDATAALIGN_BYTE (0)
+#define DMA_NORMAL (0)
+#define DMA_PRIORITY_LOW (0)
+#define DMA_FIFOMODE_ENABLE (1)
+#define DMA_FIFO_THRESHOLD_FULL (3)
+#define DMA_MBURST_SINGLE (0)
+#define DMA_PBURST_SINGLE (0)
+
+HAL_StatusTypeDef HAL_DMA_Init(DMA_HandleTypeDef *hdma);
+HAL_StatusTypeDef HAL_DMA_Start_IT(DMA_HandleTypeDef *hdma, uint32_t src, uint32_t dst, uint32_t len);
+void HAL_DMA_IRQHandler(DMA_HandleTypeDef *hdma);
+
+typedef enum {
+	DMA2_Stream0_IRQn
+} IRQn_Type;
+
+void HAL_NVIC_SetPriority(IRQn_Type irq, uint32_t preempt, uint32_t sub);
+void HAL_NVIC_EnableIRQ(IRQn_Type irq);
+
+#define __weak __attribute__((weak))
+#define __disable_irq() do { } while (0)
+#define __enable_irq() do { } while (0)
+
+#endif
@@ -0,0 +1,802 @@
+//
+// Host test for the HC UID database
+//
+// Each run of the program is one boot of the device. The phase named on the command
+// line loads the image file left by the previous phase, runs the startup scan and then
+// adds, changes, reads and deletes records through the same entry points the command
+// handlers use. The expected version of every record is kept next to the image
+//
+// Phases:
+//
+// init              Formats the image and writes and rewrites a few thousand records
+// boot              Restarts and checks every record
+// batch             Writes records with UPDATE_UIDS batches
+// crashbatch <n>    Loses power after <n> writes of a batch
+// bootcheck         Checks every record has its old or new value after a power loss
+// crash <n>         Loses power after <n> writes of an update that moves a record
+// readall           Checks READ_ALL_UIDS returns every record once
+// stall <trigger>   Checks an UPDATE_UIDS sequence that stops part way is written back
+//                   after a timeout, before another command or on disconnect
+// info              Checks READ_ALL_UID_INFO and READ_UIDS_CHANGED_SINCE
+// info-restart      Checks the change generations survive a clean restart
+// info-replay       Checks the generations survive a restart that replays the journal
+// lose-generations  Corrupts the change generations after a checkpoint
+// info-lost         Checks the epoch changes when the generations are lost
+// damage            Corrupts the block holding the records after the first UID info message
+// info-damaged      Checks READ_ALL_UID_INFO after 'damage'
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "commands.h"
+#include "memory_layout.h"
+#include "signet_aes.h"
+#include "main.h"
+#include "sim.h"
+
+#define IMAGE_FILE "db.img"
+#define VERSIONS_FILE "versions.bin"
+#define OLD_VERSIONS_FILE "versions_old.bin"
+#define NEW_VERSIONS_FILE "versions_new.bin"
+#define GENERATION_FILE "generation.txt"
+
+#define UID_INFO_PER_MESSAGE ((BLK_SIZE - UID_INFO_HEADER_SZ) / UID_INFO_SZ)
+
+//Highest UID the tests write
+#define TEST_MAX_UID (2500)
+
+//Version of each record written. -1 if the record doesn't exist
+static int versions[MAX_UID + 1];
+
+static void save_versions(const char *path)
+{
+	FILE *fp = fopen(path, "wb");
+	fwrite(versions, sizeof(versions), 1, fp);
+	fclose(fp);
+}
+
+static void load_versions(const char *path)
+{
+	FILE *fp = fopen(path, "rb");
+	if (!fp || fread(versions, sizeof(versions), 1, fp) != 1) {
+		fprintf(stderr, "%s: missing\n", path);
+		exit(1);
+	}
+	fclose(fp);
+}
+
+static int record_size(int uid, int version)
+{
+	return 20 + ((uid * 37 + version * 101) % 600);
+}
+
+//Generates the contents of a record. The mask bytes of each sub block are zero
+static int record_data(int uid, int version, u8 *buf)
+{
+	int sz = record_size(uid, version);
+	int n = SIZE_TO_SUB_BLK_COUNT(sz);
+	for (int i = 0; i < n; i++) {
+		for (int j = 0; j < SUB_BLK_SIZE; j++) {
+			buf[i * SUB_BLK_SIZE + j] = (j < SUB_BLK_MASK_SIZE) ? 0 : (uid ^ version ^ i ^ j);
+		}
+	}
+	return n * SUB_BLK_SIZE;
+}
+
+static void startup()
+{
+	for (int i = 0; i < AES_256_KEY_SIZE; i++) {
+		g_encrypt_key[i] = i * 7 + 1;
+	}
+	signet_aes_256_ctx_init(&g_encrypt_ctx, g_encrypt_key);
+	memset(&sim_stats, 0, sizeof(sim_stats));
+	active_cmd = STARTUP;
+	db3_startup_scan(cmd_data.startup.block, &cmd_data.startup.blk_info);
+	sim_run();
+	printf("startup: reads=%d bytes=%d\n", sim_stats.reads, sim_stats.read_bytes);
+	g_device_state = DS_LOGGED_IN;
+}
+
+//Lets the checkpoint and group commit timers expire
+static void idle()
+{
+	for (int i = 0; i < 4; i++) {
+		sim_tick += 5000;
+		BEGIN_WORK(DB_INDEX_SYNC_WORK);
+		db_index_idle();
+		sim_run();
+	}
+}
+
+//
+// Starts a command the way restart_signet_command() does. Blocks left dirty by a
+// group commit are written back first unless the command continues UPDATE_UIDS
+//
+static int begin_command(int cmd, int continuation)
+{
+	active_cmd = cmd;
+	sim_last_resp = -1;
+	while (db_command_wait(continuation)) {
+		int restarts = sim_stats.restarts;
+		if (sim_run() < 0)
+			return -2;
+		if (sim_stats.restarts == restarts) {
+			printf("command %d: not restarted\n", cmd);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+//Writes 'version' of a record or deletes it if 'version' is -1
+static int update(int uid, int version)
+{
+	static u8 buf[BLK_SIZE];
+	int len = 0;
+	int sz = 0;
+	if (version >= 0) {
+		len = record_data(uid, version, buf);
+		sz = record_size(uid, version);
+	}
+	if (begin_command(UPDATE_UID, 0))
+		return -2;
+	memcpy(cmd_packet_buf, buf, len);
+	update_uid_cmd(uid, cmd_packet_buf, len, sz, 0, 0);
+	if (sim_run() < 0)
+		return -2;
+	return sim_last_resp;
+}
+
+//Returns 0 if the record has 'version' or if it doesn't exist and 'version' is -1
+static int check(int uid, int version)
+{
+	static u8 buf[BLK_SIZE];
+	if (begin_command(READ_UID, 0))
+		return 1;
+	read_uid_cmd(uid, 0);
+	sim_run();
+	if (sim_last_resp == -1) {
+		read_uid_cmd_complete();
+		sim_run();
+	}
+	if (version < 0)
+		return sim_last_resp == ID_INVALID ? 0 : 1;
+	if (sim_last_resp != OKAY)
+		return 1;
+	int len = record_data(uid, version, buf);
+	int sz = sim_last_payload[0] | (sim_last_payload[1] << 8);
+	return sz != record_size(uid, version) || memcmp(sim_last_payload + 2, buf, len);
+}
+
+static int check_all()
+{
+	int bad = 0;
+	for (int uid = MIN_UID; uid <= TEST_MAX_UID; uid++) {
+		if (check(uid, versions[uid])) {
+			printf("uid %d: response %d, expected version %d\n", uid, sim_last_resp, versions[uid]);
+			bad++;
+		}
+	}
+	printf("check: bad=%d\n", bad);
+	return bad;
+}
+
+static int count_records()
+{
+	int n = 0;
+	for (int uid = MIN_UID; uid <= MAX_UID; uid++) {
+		if (versions[uid] >= 0)
+			n++;
+	}
+	return n;
+}
+
+//Writes 'n' records starting at 'first' in one UPDATE_UIDS command
+static int batch(int first, int n, int version)
+{
+	static u8 buf[BLK_SIZE];
+	sim_stats.writes = 0;
+	for (int k = 0; k < n; k++) {
+		int uid = first + k;
+		int len = record_data(uid, version, buf);
+		sim_messages_remaining = n - k - 1;
+		if (begin_command(UPDATE_UIDS, k > 0))
+			return -2;
+		memcpy(cmd_packet_buf, buf, len);
+		update_uid_cmd(uid, cmd_packet_buf, len, record_size(uid, version), 0, sim_messages_remaining);
+		if (sim_run() < 0)
+			return -2;
+		if (sim_last_resp != OKAY) {
+			printf("batch uid %d: response %d\n", uid, sim_last_resp);
+			return 1;
+		}
+		versions[uid] = version;
+	}
+	if (active_cmd != -1) {
+		printf("batch: command still active\n");
+		return 1;
+	}
+	printf("batch of %d: writes=%d flushes=%u\n", n, sim_stats.writes, g_db_block_cache_stats.flushes);
+	return 0;
+}
+
+static int last_epoch;
+static u32 last_gen;
+static int last_msgs;
+static int info_seen[MAX_UID + 1]; //Records in the last UID info response
+
+//Runs READ_ALL_UID_INFO or READ_UIDS_CHANGED_SINCE and checks every entry
+static int uid_info(int all, int epoch, u32 since, int *count, int *deleted)
+{
+	int bad = 0;
+	int msgs = 0;
+	*count = 0;
+	*deleted = 0;
+	memset(info_seen, 0, sizeof(info_seen));
+	sim_stats.reads = 0;
+	if (begin_command(all ? READ_ALL_UID_INFO : READ_UIDS_CHANGED_SINCE, 0))
+		return 1;
+	if (all) {
+		read_all_uid_info_cmd();
+	} else {
+		read_uids_changed_since_cmd(epoch, since);
+	}
+	sim_run();
+	while (1) {
+		msgs++;
+		last_epoch = sim_last_payload[0] | (sim_last_payload[1] << 8);
+		memcpy(&last_gen, sim_last_payload + 4, 4);
+		for (int i = UID_INFO_HEADER_SZ; i < sim_last_payload_len; i += UID_INFO_SZ) {
+			int info = sim_last_payload[i] | (sim_last_payload[i + 1] << 8);
+			int uid = info & 0xfff;
+			int sz = sim_last_payload[i + 2] | (sim_last_payload[i + 3] << 8);
+			(*count)++;
+			info_seen[uid] = 1;
+			if (!sz) {
+				(*deleted)++;
+				if (versions[uid] >= 0)
+					bad++;
+			} else if (versions[uid] < 0 || sz != record_size(uid, versions[uid])) {
+				bad++;
+			}
+		}
+		if (active_cmd == -1)
+			break;
+		if (sim_last_payload_len != BLK_SIZE) {
+			printf("uid info: message %d not full\n", msgs);
+			bad++;
+		}
+		uid_info_cmd_complete();
+		sim_run();
+	}
+	last_msgs = msgs;
+	printf("uid info(all=%d since=%d/%u): n=%d deleted=%d bad=%d msgs=%d reads=%d epoch=%d gen=%u\n",
+		all, epoch, since, *count, *deleted, bad, msgs, sim_stats.reads, last_epoch, last_gen);
+	return bad;
+}
+
+static int uid_info_all()
+{
+	int n, deleted;
+	if (uid_info(1, 0, 0, &n, &deleted))
+		return 1;
+	return n != count_records();
+}
+
+static int read_all()
+{
+	static u8 buf[BLK_SIZE];
+	static int seen[MAX_UID + 1];
+	int bad = 0;
+	int n = 0;
+	memset(seen, 0, sizeof(seen));
+	sim_stats.reads = 0;
+	if (begin_command(READ_ALL_UIDS, 0))
+		return 1;
+	read_all_uids_cmd(1);
+	sim_run();
+	while (1) {
+		int uid = sim_last_payload[0] | (sim_last_payload[1] << 8);
+		if (sim_last_resp == OKAY) {
+			int sz = sim_last_payload[2] | (sim_last_payload[3] << 8);
+			n++;
+			if (uid > MAX_UID || seen[uid]++ || versions[uid] < 0) {
+				bad++;
+			} else {
+				int len = record_data(uid, versions[uid], buf);
+				if (sz != record_size(uid, versions[uid]) || memcmp(sim_last_payload + 4, buf, len))
+					bad++;
+			}
+		} else if (sim_last_resp != ID_INVALID) {
+			bad++;
+		}
+		if (active_cmd == -1)
+			break;
+		read_all_uids_cmd_complete();
+		sim_run();
+	}
+	printf("read all: n=%d expected=%d bad=%d reads=%d\n", n, count_records(), bad, sim_stats.reads);
+	return bad || n != count_records();
+}
+
+static void save_generation(int epoch, u32 gen)
+{
+	FILE *fp = fopen(GENERATION_FILE, "w");
+	fprintf(fp, "%d %u\n", epoch, gen);
+	fclose(fp);
+}
+
+static void load_generation(int *epoch, u32 *gen)
+{
+	FILE *fp = fopen(GENERATION_FILE, "r");
+	if (!fp || fscanf(fp, "%d %u", epoch, gen) != 2) {
+		fprintf(stderr, "%s: missing\n", GENERATION_FILE);
+		exit(1);
+	}
+	fclose(fp);
+}
+
+static int phase_init()
+{
+	static u8 blk[BLK_SIZE];
+	sim_open(IMAGE_FILE, 1);
+	memset(root_page.device_id, 0x5a, DEVICE_ID_LEN);
+	root_page.db_format = DB_FORMAT_CURRENT;
+	root_page.format = ROOT_BLOCK_FORMAT_CURRENT;
+	sync_root_block();
+	for (int i = MIN_DATA_BLOCK; i <= MAX_DATA_BLOCK; i++) {
+		sim_block_write(i, (u8 *)db3_initialize_block(i, (struct block *)blk), BLK_SIZE);
+	}
+	memset(blk, 0xff, BLK_SIZE);
+	sim_block_write(DB_INDEX_BLOCK, blk, BLK_SIZE);
+	startup();
+
+	for (int uid = MIN_UID; uid <= MAX_UID; uid++) {
+		versions[uid] = -1;
+	}
+	for (int uid = MIN_UID; uid <= 1200; uid++) {
+		int rc = update(uid, 0);
+		if (rc != OKAY) {
+			printf("update %d: response %d\n", uid, rc);
+			return 1;
+		}
+		versions[uid] = 0;
+	}
+	for (int k = 0; k < 3000; k++) {
+		int uid = MIN_UID + (k * 7919) % 1500;
+		int version = (k % 11 == 0) ? -1 : k;
+		int rc = update(uid, version);
+		if (version < 0 && versions[uid] < 0)
+			continue;
+		if (rc != OKAY) {
+			printf("update %d version %d: response %d\n", uid, version, rc);
+			return 1;
+		}
+		versions[uid] = version;
+	}
+	if (check_all())
+		return 1;
+	idle();
+	save_versions(VERSIONS_FILE);
+	return 0;
+}
+
+static int phase_boot()
+{
+	return check_all();
+}
+
+static int phase_batch()
+{
+	if (batch(1501, 1000, 7) || batch(1501, 1000, 8) || batch(2, 300, 9))
+		return 1;
+	if (check_all())
+		return 1;
+	idle();
+	save_versions(VERSIONS_FILE);
+	return 0;
+}
+
+static int phase_crashbatch(int n)
+{
+	int version = 50 + n % 7;
+	save_versions(OLD_VERSIONS_FILE);
+	sim_crash_after_writes = n;
+	printf("crashbatch: rc=%d\n", batch(2, 300, version));
+	for (int uid = 2; uid < 302; uid++) {
+		versions[uid] = version;
+	}
+	save_versions(NEW_VERSIONS_FILE);
+	return 0;
+}
+
+static int phase_bootcheck()
+{
+	static int old_versions[MAX_UID + 1];
+	int bad = 0;
+	int updated = 0;
+	load_versions(OLD_VERSIONS_FILE);
+	memcpy(old_versions, versions, sizeof(versions));
+	load_versions(NEW_VERSIONS_FILE);
+	for (int uid = MIN_UID; uid <= TEST_MAX_UID; uid++) {
+		if (!check(uid, old_versions[uid]))
+			continue;
+		if (!check(uid, versions[uid])) {
+			updated++;
+			continue;
+		}
+		printf("uid %d: neither version\n", uid);
+		bad++;
+	}
+	printf("bootcheck: bad=%d updated=%d\n", bad, updated);
+	if (bad)
+		return 1;
+
+	//Continue from whatever survived
+	for (int uid = MIN_UID; uid <= TEST_MAX_UID; uid++) {
+		if (!check(uid, old_versions[uid]))
+			versions[uid] = old_versions[uid];
+	}
+	idle();
+	save_versions(VERSIONS_FILE);
+	return 0;
+}
+
+static int phase_crash(int n)
+{
+	int version = 1000000 + n;
+	save_versions(OLD_VERSIONS_FILE);
+	sim_crash_after_writes = n;
+	printf("crash: rc=%d\n", update(5, version));
+	versions[5] = version;
+	save_versions(NEW_VERSIONS_FILE);
+	return 0;
+}
+
+static int phase_readall()
+{
+	if (read_all() || batch(2, 50, 70) || read_all())
+		return 1;
+	idle();
+	save_versions(VERSIONS_FILE);
+	return 0;
+}
+
+static int phase_info()
+{
+	int n, deleted;
+	if (uid_info_all() || uid_info_all())
+		return 1;
+	int epoch = last_epoch;
+	u32 gen = last_gen;
+	if (batch(2, 300, 60))
+		return 1;
+	if (uid_info(0, epoch, gen, &n, &deleted) || n != 300)
+		return 1;
+	update(7, -1);
+	versions[7] = -1;
+	if (uid_info(0, epoch, gen + 300, &n, &deleted) || n != 1 || deleted != 1)
+		return 1;
+	//A stale epoch returns every record
+	if (uid_info(0, epoch + 1, gen + 300, &n, &deleted) || n != count_records())
+		return 1;
+	idle();
+	save_versions(VERSIONS_FILE);
+	save_generation(epoch, last_gen);
+	return 0;
+}
+
+static int phase_info_restart()
+{
+	int epoch, n, deleted;
+	u32 gen;
+	load_generation(&epoch, &gen);
+	if (uid_info(0, epoch, gen, &n, &deleted) || n != 0 || last_epoch != epoch || last_gen != gen) {
+		printf("info-restart: generations not restored\n");
+		return 1;
+	}
+	if (uid_info(0, epoch, gen - 1, &n, &deleted) || n != 1)
+		return 1;
+	//Leave changes that aren't checkpointed. The host sees them
+	if (batch(400, 5, 61) || uid_info(0, epoch, gen, &n, &deleted) || n != 5)
+		return 1;
+	save_versions(VERSIONS_FILE);
+	save_generation(epoch, last_gen);
+	return 0;
+}
+
+//
+// Restarts with changes in the journal. The generations are restored from the
+// checkpoint without a new epoch and the records in the journaled blocks are
+// reported as changed even to a host that has seen the latest changes
+//
+static int phase_info_replay()
+{
+	int epoch, n, deleted;
+	u32 gen;
+	load_generation(&epoch, &gen);
+	if (uid_info(0, epoch, gen, &n, &deleted))
+		return 1;
+	if (last_epoch != epoch || last_gen <= gen) {
+		printf("info-replay: generations not restored\n");
+		return 1;
+	}
+	for (int uid = 400; uid < 405; uid++) {
+		if (!info_seen[uid]) {
+			printf("info-replay: uid %d missing\n", uid);
+			return 1;
+		}
+	}
+	if (n == count_records()) {
+		printf("info-replay: every record reported\n");
+		return 1;
+	}
+	idle();
+	save_generation(epoch, last_gen);
+	return 0;
+}
+
+//Takes a checkpoint and corrupts the change generations written with it
+static int phase_lose_generations()
+{
+	static u8 blk[BLK_SIZE];
+	idle();
+	sim_block_read(DB_GEN_BLOCK, blk, BLK_SIZE);
+	blk[0] ^= 0xff;
+	sim_block_write(DB_GEN_BLOCK, blk, BLK_SIZE);
+	return 0;
+}
+
+//
+// Stops an UPDATE_UIDS sequence part way and checks its staged blocks are written
+// back when the sequence stalls, when another command runs or when the host
+// disconnects. Every later write is dropped so the next boot only sees records
+// that were written back here
+//
+static int phase_stall(const char *trigger)
+{
+	static u8 buf[BLK_SIZE];
+	int first = 600;
+	int sent = 10;
+	int version = 80 + (int)strlen(trigger);
+	for (int k = 0; k < sent; k++) {
+		int uid = first + k;
+		int len = record_data(uid, version, buf);
+		sim_messages_remaining = 2 * sent - k - 1;
+		if (begin_command(UPDATE_UIDS, k > 0))
+			return 1;
+		memcpy(cmd_packet_buf, buf, len);
+		update_uid_cmd(uid, cmd_packet_buf, len, record_size(uid, version), 0, sim_messages_remaining);
+		sim_run();
+		if (sim_last_resp != OKAY)
+			return 1;
+		versions[uid] = version;
+	}
+	sim_messages_remaining = 0;
+
+	int writes = sim_stats.writes;
+	if (!strcmp(trigger, "timeout")) {
+		//The work bit stays set while the timer runs
+		sim_tick += DB_GROUP_COMMIT_FLUSH_MS - 1;
+		db_index_idle();
+		sim_run();
+		if (!(g_work_to_do & DB_INDEX_SYNC_WORK) || sim_stats.writes != writes) {
+			printf("stall: written back early\n");
+			return 1;
+		}
+		sim_tick += 1;
+	} else if (!strcmp(trigger, "command")) {
+		if (check(first, version))
+			return 1;
+	} else if (!strcmp(trigger, "disconnect")) {
+		active_cmd = -1;
+		db_flush_group_commit();
+	} else {
+		return 1;
+	}
+	//Main loop iterations without time passing
+	for (int i = 0; i < 100 && (g_work_to_do & DB_INDEX_SYNC_WORK); i++) {
+		db_index_idle();
+		sim_run();
+	}
+	if (sim_stats.writes == writes) {
+		printf("stall: nothing written back\n");
+		return 1;
+	}
+	sim_crash_after_writes = 0;
+
+	//Work is ended once nothing is left to do so the main loop can sleep
+	for (int i = 0; i < 100 && (g_work_to_do & DB_INDEX_SYNC_WORK); i++) {
+		sim_tick += 100;
+		db_index_idle();
+		sim_run();
+	}
+	if (g_work_to_do & DB_INDEX_SYNC_WORK) {
+		printf("stall: work not ended\n");
+		return 1;
+	}
+	save_versions(VERSIONS_FILE);
+	return 0;
+}
+
+//Returns the UID of the 'j'th UID table entry of a block read from the image
+static int block_ent_uid(const u8 *blk, int j)
+{
+	//Header followed by 6 byte UID table entries. The UID is the low 12 bits
+	const u8 *ent = blk + 8 + j * 6;
+	return ent[0] | ((ent[1] & 0xf) << 8);
+}
+
+static int block_occupancy(const u8 *blk)
+{
+	int part_size = blk[4] | (blk[5] << 8);
+	int occupancy = blk[6] | (blk[7] << 8);
+	if (part_size == INVALID_PART_SIZE || occupancy > BLK_SIZE / 6)
+		return 0;
+	return occupancy;
+}
+
+//
+// Arranges for the records of one block to be the only ones after the first UID
+// info message and then corrupts the block after a checkpoint. READ_ALL_UID_INFO
+// counts those records before it reads the block and finds they are lost
+//
+static int phase_damage()
+{
+	static u8 blk[BLK_SIZE];
+	int damaged_block = -1;
+	int damaged_min_uid = MIN_UID;
+	idle();
+	for (int i = MIN_DATA_BLOCK; i <= MAX_DATA_BLOCK; i++) {
+		sim_block_read(i, blk, BLK_SIZE);
+		int occupancy = block_occupancy(blk);
+		int min_uid = MAX_UID + 1;
+		for (int j = 0; j < occupancy; j++) {
+			int uid = block_ent_uid(blk, j);
+			if (uid < min_uid)
+				min_uid = uid;
+		}
+		if (occupancy && min_uid <= MAX_UID && min_uid > damaged_min_uid) {
+			damaged_block = i;
+			damaged_min_uid = min_uid;
+		}
+	}
+	sim_block_read(damaged_block, blk, BLK_SIZE);
+	int occupancy = block_occupancy(blk);
+	static int in_block[MAX_UID + 1];
+	for (int j = 0; j < occupancy; j++) {
+		in_block[block_ent_uid(blk, j)] = 1;
+	}
+
+	//Delete the other records after the block's first record and enough before it
+	//to leave exactly one message of records in front of it
+	int before = 0;
+	for (int uid = MIN_UID; uid <= MAX_UID; uid++) {
+		if (versions[uid] < 0)
+			continue;
+		if (uid > damaged_min_uid && !in_block[uid]) {
+			if (update(uid, -1) != OKAY)
+				return 1;
+			versions[uid] = -1;
+		} else if (uid < damaged_min_uid) {
+			before++;
+		}
+	}
+	if (before < UID_INFO_PER_MESSAGE) {
+		printf("damage: only %d records before block %d\n", before, damaged_block);
+		return 1;
+	}
+	for (int uid = MIN_UID; before > UID_INFO_PER_MESSAGE; uid++) {
+		if (versions[uid] >= 0 && !in_block[uid]) {
+			if (update(uid, -1) != OKAY)
+				return 1;
+			versions[uid] = -1;
+			before--;
+		}
+	}
+	idle();
+
+	sim_block_read(damaged_block, blk, BLK_SIZE);
+	blk[BLK_SIZE - 1] ^= 0xff;
+	sim_block_write(damaged_block, blk, BLK_SIZE);
+	for (int j = 0; j < occupancy; j++) {
+		versions[block_ent_uid(blk, j)] = -1;
+	}
+	printf("damage: block=%d uid=%d records=%d\n", damaged_block, damaged_min_uid, occupancy);
+	save_versions(VERSIONS_FILE);
+	return 0;
+}
+
+//
+// The first read of a corrupted block drops its records. READ_ALL_UID_INFO may have
+// counted them already. Its message count must still match what it sends, with no
+// empty message at the end
+//
+static int phase_info_damaged()
+{
+	int n, deleted;
+	if (uid_info(1, 0, 0, &n, &deleted))
+		return 1;
+	int expected_msgs = (n + UID_INFO_PER_MESSAGE - 1) / UID_INFO_PER_MESSAGE;
+	if (n - deleted != count_records() || last_msgs != expected_msgs) {
+		printf("info-damaged: expected %d records in %d messages\n", count_records(), expected_msgs);
+		return 1;
+	}
+	if (n && sim_last_payload_len == UID_INFO_HEADER_SZ) {
+		printf("info-damaged: empty last message\n");
+		return 1;
+	}
+	return 0;
+}
+
+static int phase_info_lost()
+{
+	int epoch, n, deleted;
+	u32 gen;
+	load_generation(&epoch, &gen);
+	if (uid_info(0, epoch, gen, &n, &deleted))
+		return 1;
+	if (last_epoch == epoch) {
+		printf("info-lost: epoch unchanged\n");
+		return 1;
+	}
+	return n != count_records();
+}
+
+int main(int argc, char **argv)
+{
+	int rc;
+	setvbuf(stdout, NULL, _IONBF, 0);
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <phase> [writes]\n", argv[0]);
+		return 2;
+	}
+	const char *phase = argv[1];
+	int n = argc > 2 ? atoi(argv[2]) : 0;
+
+	if (!strcmp(phase, "init")) {
+		rc = phase_init();
+	} else {
+		sim_open(IMAGE_FILE, 0);
+		load_versions(VERSIONS_FILE);
+		startup();
+		if (!strcmp(phase, "boot")) {
+			rc = phase_boot();
+		} else if (!strcmp(phase, "batch")) {
+			rc = phase_batch();
+		} else if (!strcmp(phase, "crashbatch")) {
+			rc = phase_crashbatch(n);
+		} else if (!strcmp(phase, "bootcheck")) {
+			rc = phase_bootcheck();
+		} else if (!strcmp(phase, "crash")) {
+			rc = phase_crash(n);
+		} else if (!strcmp(phase, "readall")) {
+			rc = phase_readall();
+		} else if (!strcmp(phase, "stall")) {
+			rc = argc > 2 ? phase_stall(argv[2]) : 2;
+		} else if (!strcmp(phase, "info")) {
+			rc = phase_info();
+		} else if (!strcmp(phase, "info-restart")) {
+			rc = phase_info_restart();
+		} else if (!strcmp(phase, "info-replay")) {
+			rc = phase_info_replay();
+		} else if (!strcmp(phase, "lose-generations")) {
+			rc = phase_lose_generations();
+		} else if (!strcmp(phase, "damage")) {
+			rc = phase_damage();
+		} else if (!strcmp(phase, "info-damaged")) {
+			rc = phase_info_damaged();
+		} else if (!strcmp(phase, "info-lost")) {
+			rc = phase_info_lost();
+		} else {
+			fprintf(stderr, "unknown phase %s\n", phase);
+			rc = 2;
+		}
+	}
+	printf("%s: %s cache hits=%u misses=%u cryp=%d crc dma=%d\n", phase, rc ? "FAIL" : "ok",
+		g_db_block_cache_stats.hits, g_db_block_cache_stats.misses,
+		sim_stats.cryp_ops, sim_stats.crc_dma_ops);
+	sim_close();
+	return rc;
+}
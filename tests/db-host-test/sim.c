@@ -0,0 +1,451 @@
+//
+// Host models of the parts of the firmware that db.c talks to
+//
+// Blocks are stored in an image file. Reads, writes, CRC DMA transfers and CRYP
+// transfers are queued and complete one at a time from sim_run() so db.c sees the
+// same completion order as on the device. sim_crash_after_writes drops every write
+// after the given count to simulate losing power in the middle of an update
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "commands.h"
+#include "memory_layout.h"
+#include "crc.h"
+#include "signet_aes.h"
+#include "main.h"
+#include "sim.h"
+
+volatile int g_work_to_do;
+int active_cmd = -1;
+enum device_state g_device_state = DS_LOGGED_IN;
+union cmd_data_u cmd_data;
+struct hc_device_data root_page;
+u8 g_encrypt_key[AES_256_KEY_SIZE];
+struct signet_aes_256_ctx g_encrypt_ctx;
+u8 cmd_packet_buf[BLK_SIZE + 64];
+CRYP_HandleTypeDef hcryp;
+
+struct sim_stats sim_stats;
+u32 sim_tick;
+int sim_messages_remaining;
+int sim_crash_after_writes = -1;
+int sim_last_resp = -1;
+u8 sim_last_payload[BLK_SIZE + 64];
+int sim_last_payload_len;
+
+static int sim_fd = -1;
+
+//
+// Image file: SIM_NUM_BLOCKS blocks followed by the root page
+//
+static off_t sim_block_offset(int idx)
+{
+	return (off_t)idx * BLK_SIZE;
+}
+
+static off_t sim_root_offset()
+{
+	return (off_t)SIM_NUM_BLOCKS * BLK_SIZE;
+}
+
+void sim_open(const char *path, int create)
+{
+	sim_fd = open(path, O_RDWR | (create ? O_CREAT | O_TRUNC : 0), 0644);
+	if (sim_fd < 0) {
+		perror(path);
+		exit(1);
+	}
+	if (create) {
+		if (ftruncate(sim_fd, sim_root_offset() + sizeof(root_page))) {
+			perror(path);
+			exit(1);
+		}
+	} else if (pread(sim_fd, &root_page, sizeof(root_page), sim_root_offset()) != sizeof(root_page)) {
+		fprintf(stderr, "%s: short image\n", path);
+		exit(1);
+	}
+}
+
+void sim_close()
+{
+	close(sim_fd);
+	sim_fd = -1;
+}
+
+void sim_block_read(int idx, u8 *dest, int len)
+{
+	if (pread(sim_fd, dest, len, sim_block_offset(idx)) != len) {
+		perror("pread");
+		exit(1);
+	}
+}
+
+void sim_block_write(int idx, const u8 *src, int len)
+{
+	if (pwrite(sim_fd, src, len, sim_block_offset(idx)) != len) {
+		perror("pwrite");
+		exit(1);
+	}
+}
+
+void sync_root_block()
+{
+	sim_stats.root_syncs++;
+	if (pwrite(sim_fd, &root_page, sizeof(root_page), sim_root_offset()) != sizeof(root_page)) {
+		perror("pwrite");
+		exit(1);
+	}
+}
+
+int sync_root_block_pending()
+{
+	return 0;
+}
+
+u32 HAL_GetTick()
+{
+	return sim_tick;
+}
+
+//
+// eMMC requests
+//
+enum sim_op {
+	SIM_OP_NONE,
+	SIM_OP_READ,
+	SIM_OP_WRITE
+};
+
+static enum sim_op pending_op;
+static int pending_idx;
+static u8 *pending_dest;
+static const u8 *pending_src;
+static int pending_len;
+
+void read_data_block_part(int idx, u8 *dest, int len)
+{
+	assert(pending_op == SIM_OP_NONE);
+	pending_op = SIM_OP_READ;
+	pending_idx = idx;
+	pending_dest = dest;
+	pending_len = ((len + 511) / 512) * 512;
+}
+
+void read_data_block(int idx, u8 *dest)
+{
+	read_data_block_part(idx, dest, BLK_SIZE);
+}
+
+void write_data_block_part(int idx, const u8 *src, int len)
+{
+	assert(pending_op == SIM_OP_NONE);
+	pending_op = SIM_OP_WRITE;
+	pending_idx = idx;
+	pending_src = src;
+	pending_len = len;
+}
+
+void write_data_block(int idx, const u8 *src)
+{
+	if (db_index_write_data_block(idx, src)) {
+		return;
+	}
+	update_data_block_cache(idx, src);
+	write_data_block_part(idx, src, BLK_SIZE);
+}
+
+int emmc_user_queued(enum emmc_user user)
+{
+	return 0;
+}
+
+//
+// CRC unit
+//
+static const u8 *crc_pending;
+static int crc_pending_len;
+
+u32 crc_32(const u8 *din, int count)
+{
+	u32 crc = 0xffffffff;
+	for (int i = 0; i < count; i++) {
+		crc ^= din[i];
+		for (int k = 0; k < 8; k++) {
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+		}
+	}
+	return ~crc;
+}
+
+u32 crc_32_cont(const u8 *din, int count)
+{
+	return crc_32(din, count);
+}
+
+static u32 crc_multmodp(u32 a, u32 b)
+{
+	u32 m = 1u << 31;
+	u32 p = 0;
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ 0xedb88320 : b >> 1;
+	}
+	return p;
+}
+
+u32 crc_32_shift_op(int len)
+{
+	static u32 x2n_table[32];
+	if (!x2n_table[0]) {
+		u32 p = 1u << 30;
+		x2n_table[0] = p;
+		for (int n = 1; n < 32; n++) {
+			x2n_table[n] = p = crc_multmodp(p, p);
+		}
+	}
+	u32 p = 1u << 31;
+	int k = 3;
+	while (len) {
+		if (len & 1)
+			p = crc_multmodp(x2n_table[k & 31], p);
+		len >>= 1;
+		k++;
+	}
+	return p;
+}
+
+u32 crc_32_combine_op(u32 op, u32 crc1, u32 crc2)
+{
+	return crc_multmodp(op, crc1) ^ crc2;
+}
+
+u32 crc_32_combine(u32 crc1, u32 crc2, int len2)
+{
+	return crc_32_combine_op(crc_32_shift_op(len2), crc1, crc2);
+}
+
+int crc_32_dma_start(const u8 *din, int count, enum crc_user user)
+{
+	if (crc_pending)
+		return 0;
+	crc_pending = din;
+	crc_pending_len = count;
+	return 1;
+}
+
+//
+// CRYP unit. The key and IV registers hold big endian words
+//
+static int cryp_owned;
+static int cryp_pending;
+static int cryp_encrypting;
+static u32 *cryp_in;
+static u32 *cryp_out;
+static int cryp_words;
+
+//'words' is the transfer size in 32 bit words as it is for the HAL
+static void cryp_run(int encrypt, u32 *in, int words, u32 *out)
+{
+	u8 key[AES_256_KEY_SIZE];
+	u8 iv[AES_BLK_SIZE];
+	struct signet_aes_256_ctx ctx;
+	for (int i = 0; i < AES_256_KEY_SIZE / 4; i++) {
+		u32 w = __REV(hcryp.Init.pKey[i]);
+		memcpy(key + i * 4, &w, 4);
+	}
+	for (int i = 0; i < AES_BLK_SIZE / 4; i++) {
+		u32 w = __REV(hcryp.Init.pInitVect[i]);
+		memcpy(iv + i * 4, &w, 4);
+	}
+	signet_aes_256_ctx_init(&ctx, key);
+	if (encrypt) {
+		signet_aes_256_ctx_encrypt_cbc(&ctx, words / (AES_BLK_SIZE / 4), iv, (u8 *)in, (u8 *)out);
+	} else {
+		signet_aes_256_ctx_decrypt_cbc(&ctx, words / (AES_BLK_SIZE / 4), iv, (u8 *)in, (u8 *)out);
+	}
+}
+
+HAL_StatusTypeDef HAL_CRYP_SetConfig(CRYP_HandleTypeDef *h, CRYP_ConfigTypeDef *conf)
+{
+	h->Init = *conf;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_CRYP_Encrypt(CRYP_HandleTypeDef *h, u32 *in, u16 size, u32 *out, u32 timeout)
+{
+	cryp_run(1, in, size, out);
+	return HAL_OK;
+}
+
+static HAL_StatusTypeDef cryp_dma_start(int encrypt, u32 *in, u16 size, u32 *out)
+{
+	assert(!cryp_pending);
+	cryp_pending = 1;
+	cryp_encrypting = encrypt;
+	cryp_in = in;
+	cryp_words = size;
+	cryp_out = out;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_CRYP_Encrypt_DMA(CRYP_HandleTypeDef *h, u32 *in, u16 size, u32 *out)
+{
+	return cryp_dma_start(1, in, size, out);
+}
+
+HAL_StatusTypeDef HAL_CRYP_Decrypt_DMA(CRYP_HandleTypeDef *h, u32 *in, u16 size, u32 *out)
+{
+	return cryp_dma_start(0, in, size, out);
+}
+
+void cryp_user_queue(enum cryp_user user)
+{
+	assert(!cryp_owned);
+	cryp_owned = 1;
+	cryp_user_db_start();
+}
+
+void cryp_user_done()
+{
+	cryp_owned = 0;
+}
+
+//
+// Cache maintenance is a no-op since the host has no DMA
+//
+void dcache_clean(const void *addr, int len)
+{
+}
+
+void dcache_invalidate(void *addr, int len)
+{
+}
+
+void dcache_clean_invalidate(void *addr, int len)
+{
+}
+
+//
+// Command layer
+//
+void cmd_packet_hold()
+{
+	sim_stats.packet_holds++;
+}
+
+void cmd_packet_release()
+{
+}
+
+void cmd_packet_restart()
+{
+	sim_stats.restarts++;
+}
+
+void finish_command_multi(enum command_responses resp, int messages_remaining, const u8 *payload, int payload_len)
+{
+	sim_last_resp = resp;
+	if (payload) {
+		memcpy(sim_last_payload, payload, payload_len);
+	}
+	sim_last_payload_len = payload_len;
+	if (!messages_remaining && !sim_messages_remaining) {
+		active_cmd = -1;
+	}
+}
+
+void finish_command(enum command_responses resp, const u8 *payload, int payload_len)
+{
+	finish_command_multi(resp, 0, payload, payload_len);
+}
+
+void finish_command_resp(enum command_responses resp)
+{
+	finish_command(resp, NULL, 0);
+}
+
+void derive_iv(u32 id, u8 *iv)
+{
+	memset(iv, 0, AES_BLK_SIZE);
+	memcpy(iv + 12, &id, sizeof(id));
+}
+
+void begin_button_press_wait()
+{
+}
+
+void begin_long_button_press_wait()
+{
+}
+
+void enter_state(enum device_state state)
+{
+	g_device_state = state;
+}
+
+//
+// Completes the oldest outstanding transfer. Returns 0 when nothing is outstanding
+// and -1 when the simulated power loss drops a write
+//
+static int sim_step()
+{
+	if (cryp_pending) {
+		cryp_pending = 0;
+		sim_stats.cryp_ops++;
+		cryp_run(cryp_encrypting, cryp_in, cryp_words, cryp_out);
+		db_cryp_complete();
+		return 1;
+	}
+	if (g_work_to_do & DB_CRYP_WORK) {
+		db_cryp_idle();
+		return 1;
+	}
+	if (crc_pending) {
+		const u8 *din = crc_pending;
+		crc_pending = NULL;
+		sim_stats.crc_dma_ops++;
+		db_index_crc_complete(crc_32(din, crc_pending_len));
+		return 1;
+	}
+	switch (pending_op) {
+	case SIM_OP_READ:
+		pending_op = SIM_OP_NONE;
+		sim_stats.reads++;
+		sim_stats.read_bytes += pending_len;
+		sim_block_read(pending_idx, pending_dest, pending_len);
+		db3_read_block_complete();
+		return 1;
+	case SIM_OP_WRITE:
+		if (sim_crash_after_writes == 0) {
+			return -1;
+		}
+		if (sim_crash_after_writes > 0) {
+			sim_crash_after_writes--;
+		}
+		pending_op = SIM_OP_NONE;
+		sim_stats.writes++;
+		sim_block_write(pending_idx, pending_src, pending_len);
+		if (!db_index_write_complete()) {
+			db3_write_block_complete();
+		}
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+int sim_run()
+{
+	int rc;
+	while ((rc = sim_step()) > 0);
+	return rc;
+}
@@ -0,0 +1,47 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include "types.h"
+#include "signetdev_common_priv.h"
+#include "db.h"
+
+//Data blocks, the DB index block and a few spare blocks
+#define SIM_NUM_BLOCKS (DB_INDEX_BLOCK + 8)
+
+struct sim_stats {
+	int reads;
+	int read_bytes;
+	int writes;
+	int crc_dma_ops;
+	int cryp_ops;
+	int root_syncs;
+	int packet_holds;
+	int restarts; //Calls to cmd_packet_restart()
+};
+
+extern struct sim_stats sim_stats;
+
+//Value of HAL_GetTick()
+extern u32 sim_tick;
+
+//Messages the host still has to send for the active command
+extern int sim_messages_remaining;
+
+//Number of writes that complete before the simulated power loss. -1 for none
+extern int sim_crash_after_writes;
+
+extern int sim_last_resp;
+extern u8 sim_last_payload[];
+extern int sim_last_payload_len;
+
+void sim_open(const char *path, int create);
+void sim_close();
+void sim_block_read(int idx, u8 *dest, int len);
+void sim_block_write(int idx, const u8 *src, int len);
+
+//Runs queued transfers until none are left. Returns -1 after a simulated power loss
+int sim_run();
+
+void cryp_user_db_start();
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef STM32F7XX_HAL_H
+#define STM32F7XX_HAL_H
+
+//
+// The parts of the STM32 HAL that db.c uses. Interrupts don't exist on the host so
+// the work bit macros in main.h just update g_work_to_do
+//
+
+#include <stdint.h>
+
+typedef enum {
+	HAL_OK,
+	HAL_ERROR,
+	HAL_BUSY,
+	HAL_TIMEOUT
+} HAL_StatusTypeDef;
+
+typedef struct {
+	uint32_t DataType;
+	uint32_t KeySize;
+	uint32_t *pKey;
+	uint32_t *pInitVect;
+	uint32_t Algorithm;
+	uint32_t DataWidthUnit;
+} CRYP_ConfigTypeDef;
+
+typedef struct {
+	CRYP_ConfigTypeDef Init;
+} CRYP_HandleTypeDef;
+
+typedef struct {
+	int unused;
+} PCD_HandleTypeDef;
+
+#define CRYP_DATATYPE_8B (2)
+#define CRYP_KEYSIZE_256B (1)
+#define CRYP_AES_CBC (1)
+#define CRYP_DATAWIDTHUNIT_WORD (0)
+
+#define __REV(x) __builtin_bswap32(x)
+#define __disable_irq() do { } while (0)
+#define __enable_irq() do { } while (0)
+
+uint32_t HAL_GetTick();
+HAL_StatusTypeDef HAL_CRYP_SetConfig(CRYP_HandleTypeDef *hcryp, CRYP_ConfigTypeDef *conf);
+HAL_StatusTypeDef HAL_CRYP_Encrypt(CRYP_HandleTypeDef *hcryp, uint32_t *in, uint16_t size, uint32_t *out, uint32_t timeout);
+HAL_StatusTypeDef HAL_CRYP_Encrypt_DMA(CRYP_HandleTypeDef *hcryp, uint32_t *in, uint16_t size, uint32_t *out);
+HAL_StatusTypeDef HAL_CRYP_Decrypt_DMA(CRYP_HandleTypeDef *hcryp, uint32_t *in, uint16_t size, uint32_t *out);
+
+#endif
@@ -0,0 +1,190 @@
+//
+// Host benchmark of crypto_ecc256_sign()
+//
+// Builds fido2/crypto.c against the host nettle and times loading a credential
+// key (unwrapping the key handle), converting a private key to an ecc_scalar and
+// signing, each on its own. Every signature is checked with ecdsa_verify()
+//
+// ecc-sign-bench [iterations]
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <nettle/ecc.h>
+#include <nettle/ecc-curve.h>
+#include <nettle/ecdsa.h>
+#include <gmp.h>
+
+#include "types.h"
+#include "crypto.h"
+
+#define CREDENTIAL_KEYS (4)
+
+static int failures;
+
+//
+// Firmware dependencies
+//
+int rand_avail()
+{
+	return 1 << 20;
+}
+
+u32 rand_get()
+{
+	return ((u32)random() << 16) ^ (u32)random();
+}
+
+//Added to nettle by the firmware build. The same as ecc_point_mul_g()
+void ecdsa_generate_pub_from_priv(struct ecc_point *pub, const struct ecc_scalar *key)
+{
+	ecc_point_mul_g(pub, key);
+}
+
+static void mpz_from_bytes(mpz_t v, const u8 *b)
+{
+	mpz_init(v);
+	mpz_import(v, 32, 1, 1, 1, 0, b);
+}
+
+static void verify(const u8 *pubkey, const u8 *hash, const u8 *sig)
+{
+	struct ecc_point pub;
+	struct dsa_signature signature;
+	mpz_t x, y;
+	ecc_point_init(&pub, nettle_get_secp_256r1());
+	mpz_from_bytes(x, pubkey);
+	mpz_from_bytes(y, pubkey + 32);
+	if (!ecc_point_set(&pub, x, y)) {
+		printf("FAIL: public key not on the curve\n");
+		failures++;
+	}
+	dsa_signature_init(&signature);
+	mpz_import(signature.r, 32, 1, 1, 1, 0, sig);
+	mpz_import(signature.s, 32, 1, 1, 1, 0, sig + 32);
+	if (!ecdsa_verify(&pub, 32, hash, &signature)) {
+		failures++;
+	}
+	dsa_signature_clear(&signature);
+	mpz_clear(x);
+	mpz_clear(y);
+	ecc_point_clear(&pub);
+}
+
+static double now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static u8 key_handle[CREDENTIAL_KEYS][64];
+static u8 pubkey[CREDENTIAL_KEYS][64];
+
+struct bench_result {
+	double load_key;
+	double sign;
+};
+
+//Signs 'iterations' hashes with the credential keys in turn
+static struct bench_result bench_credential(int iterations)
+{
+	struct bench_result r = {0, 0};
+	u8 hash[32];
+	u8 sig[64];
+	for (int i = 0; i < iterations; i++) {
+		int k = i % CREDENTIAL_KEYS;
+		for (int j = 0; j < sizeof(hash); j++) {
+			hash[j] = random();
+		}
+		double start = now_us();
+		crypto_ecc256_load_key(key_handle[k], sizeof(key_handle[k]), NULL, 0);
+		double loaded = now_us();
+		crypto_ecc256_sign(hash, sizeof(hash), sig);
+		r.sign += now_us() - loaded;
+		r.load_key += loaded - start;
+		verify(pubkey[k], hash, sig);
+	}
+	r.load_key /= iterations;
+	r.sign /= iterations;
+	return r;
+}
+
+static struct bench_result bench_attestation(int iterations, const u8 *attestation_pubkey)
+{
+	struct bench_result r = {0, 0};
+	u8 hash[32];
+	u8 sig[64];
+	for (int i = 0; i < iterations; i++) {
+		for (int j = 0; j < sizeof(hash); j++) {
+			hash[j] = random();
+		}
+		double start = now_us();
+		crypto_ecc256_load_attestation_key();
+		double loaded = now_us();
+		crypto_ecc256_sign(hash, sizeof(hash), sig);
+		r.sign += now_us() - loaded;
+		r.load_key += loaded - start;
+		verify(attestation_pubkey, hash, sig);
+	}
+	r.load_key /= iterations;
+	r.sign /= iterations;
+	return r;
+}
+
+//The key buffer to ecc_scalar conversion crypto_sign() does for every signature
+static double bench_scalar(int iterations, const u8 *privkey)
+{
+	const struct ecc_curve *curve = nettle_get_secp_256r1();
+	double total = 0;
+	for (int i = 0; i < iterations; i++) {
+		struct ecc_scalar key;
+		mpz_t val;
+		double start = now_us();
+		mpz_from_bytes(val, privkey);
+		ecc_scalar_init(&key, curve);
+		ecc_scalar_set(&key, val);
+		mpz_clear(val);
+		ecc_scalar_clear(&key);
+		total += now_us() - start;
+	}
+	return total / iterations;
+}
+
+int main(int argc, char **argv)
+{
+	int iterations = argc > 1 ? atoi(argv[1]) : 1000;
+	u8 secret[96];
+	u8 privkey[32];
+	u8 attestation_pubkey[64];
+	srandom(1);
+	for (int i = 0; i < sizeof(secret); i++) {
+		secret[i] = random();
+	}
+	crypto_ecc256_init();
+	crypto_load_master_secret(secret);
+	for (int k = 0; k < CREDENTIAL_KEYS; k++) {
+		for (int i = 0; i < sizeof(key_handle[k]); i++) {
+			key_handle[k][i] = random();
+		}
+		generate_private_key(key_handle[k], sizeof(key_handle[k]), NULL, 0, privkey);
+		crypto_ecc256_compute_public_key(privkey, pubkey[k]);
+	}
+	crypto_ecc256_compute_public_key(attestation_key, attestation_pubkey);
+
+	struct bench_result credential = bench_credential(iterations);
+	struct bench_result attestation = bench_attestation(iterations, attestation_pubkey);
+	double scalar = bench_scalar(iterations, privkey);
+
+	printf("%d signatures each\n", iterations);
+	printf("credential key:  load %.2f us, sign %.1f us\n", credential.load_key, credential.sign);
+	printf("attestation key: load %.2f us, sign %.1f us\n", attestation.load_key, attestation.sign);
+	printf("scalar conversion (included in sign): %.2f us\n", scalar);
+	if (failures) {
+		printf("ecc-sign-bench: %d signatures failed to verify\n", failures);
+		return 1;
+	}
+	return 0;
+}